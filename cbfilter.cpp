@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "netimg.h"
+#include "hash.h"
+#include "cbfilter.h"
+
+/*
+ * cbfilter(nkeys): allocate CBF_PERKEY counters for each of the
+ * nkeys keys expected, rounded up to a power of 2.
+ */
+cbfilter::
+cbfilter(int nkeys)
+{
+  unsigned int n;
+
+  net_assert((CBF_NHASH*4 > SHA1_MDLEN), "cbfilter: not enough SHA1 bytes for CBF_NHASH");
+  for (n = 64; n < (unsigned int) nkeys*CBF_PERKEY; n <<= 1);
+  cbf_mask = n-1;
+  cbf_cnt = (unsigned char *) calloc(n, sizeof(unsigned char));
+  net_assert((cbf_cnt == NULL), "cbfilter: calloc");
+}
+
+cbfilter::
+~cbfilter()
+{
+  free(cbf_cnt);
+}
+
+void cbfilter::
+clear()
+{
+  memset(cbf_cnt, 0, cbf_mask+1);
+}
+
+/*
+ * cbf_slots(md, mask, idx): the CBF_NHASH counter indices for the key
+ * whose SHA1 is md, in a filter of mask+1 slots.  Each index is a
+ * distinct 4-byte slice of md.
+ */
+static void
+cbf_slots(unsigned char *md, unsigned int mask, unsigned int idx[])
+{
+  int i;
+
+  for (i = 0; i < CBF_NHASH; i++) {
+    idx[i] = ((unsigned int) md[4*i] | ((unsigned int) md[4*i+1] << 8) |
+              ((unsigned int) md[4*i+2] << 16) | ((unsigned int) md[4*i+3] << 24)) & mask;
+  }
+}
+
+void cbfilter::
+slots(unsigned char *md, unsigned int idx[])
+{
+  cbf_slots(md, cbf_mask, idx);
+}
+
+void cbfilter::
+add(unsigned char *md)
+{
+  int i;
+  unsigned int idx[CBF_NHASH];
+
+  slots(md, idx);
+  for (i = 0; i < CBF_NHASH; i++) {
+    if (cbf_cnt[idx[i]] < CBF_CMAX) {
+      cbf_cnt[idx[i]]++;
+    }
+  }
+}
+
+/*
+ * remove: undo a previous add() of the same key.  Removing a key
+ * that was never added corrupts the filter.
+ */
+void cbfilter::
+remove(unsigned char *md)
+{
+  int i;
+  unsigned int idx[CBF_NHASH];
+
+  slots(md, idx);
+  for (i = 0; i < CBF_NHASH; i++) {
+    if (cbf_cnt[idx[i]] && cbf_cnt[idx[i]] < CBF_CMAX) {
+      cbf_cnt[idx[i]]--;
+    }
+  }
+}
+
+/*
+ * query: returns 1 if the key may be present, 0 if it definitely isn't.
+ */
+int cbfilter::
+query(unsigned char *md)
+{
+  int i;
+  unsigned int idx[CBF_NHASH];
+
+  slots(md, idx);
+  for (i = 0; i < CBF_NHASH; i++) {
+    if (!cbf_cnt[idx[i]]) {
+      return(0);
+    }
+  }
+  return(1);
+}
+
+/*
+ * bitmap(bits): flatten the filter into a plain Bloom filter bit
+ * vector, one bit per non-zero counter.  "bits" must hold size()/8
+ * bytes.  The result can be queried with bmquery().
+ */
+void cbfilter::
+bitmap(unsigned char *bits)
+{
+  unsigned int i;
+
+  memset(bits, 0, (cbf_mask+1)/8);
+  for (i = 0; i <= cbf_mask; i++) {
+    if (cbf_cnt[i]) {
+      bits[i >> 3] |= 1 << (i & 7);
+    }
+  }
+}
+
+/*
+ * bmquery(bits, nslots, md): query a bit vector made by bitmap() on a
+ * filter of nslots slots.  Returns 1 if the key may be present, 0 if
+ * it definitely isn't.
+ */
+int cbfilter::
+bmquery(unsigned char *bits, unsigned int nslots, unsigned char *md)
+{
+  int i;
+  unsigned int idx[CBF_NHASH];
+
+  cbf_slots(md, nslots-1, idx);
+  for (i = 0; i < CBF_NHASH; i++) {
+    if (!(bits[idx[i] >> 3] & (1 << (idx[i] & 7)))) {
+      return(0);
+    }
+  }
+  return(1);
+}
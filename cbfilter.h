@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __CBFILTER_H__
+#define __CBFILTER_H__
+
+#include "hash.h"
+
+#define CBF_NHASH     4     // counters per key, taken from 4-byte slices of the SHA1
+#define CBF_PERKEY   16     // counters per expected key, ~0.2% false positives
+#define CBF_CMAX    255     // saturated counters are never decremented
+
+/*
+ * Counting Bloom filter keyed by the SHA1 of an image name.  Unlike the
+ * plain bit-vector filter, keys can be removed again, so entries can be
+ * evicted without leaving their bits behind.
+ */
+class cbfilter {
+  unsigned char *cbf_cnt;     // one 8-bit counter per slot
+  unsigned int cbf_mask;      // number of slots - 1, slots are a power of 2
+
+  void slots(unsigned char *md, unsigned int idx[]);
+  cbfilter(const cbfilter &);             // not copyable
+  cbfilter &operator=(const cbfilter &);
+
+public:
+  cbfilter(int nkeys);        // sized for nkeys keys
+  ~cbfilter();
+  void clear();
+  void add(unsigned char *md);
+  void remove(unsigned char *md);
+  int query(unsigned char *md);
+  unsigned int size() { return(cbf_mask+1); }
+  void bitmap(unsigned char *bits);
+  static int bmquery(unsigned char *bits, unsigned int nslots, unsigned char *md);
+};
+
+#endif /* __CBFILTER_H__ */
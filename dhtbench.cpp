@@ -0,0 +1,741 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>         // fprintf(), snprintf()
+#include <stdlib.h>        // malloc(), mkdtemp(), strtod()
+#include <string.h>        // memset(), strstr()
+#include <unistd.h>        // getopt(), link()
+#include <time.h>          // clock_gettime(), time()
+#include <sched.h>         // sched_yield()
+#include <ftw.h>           // nftw()
+#include <pthread.h>
+#include <netinet/in.h>    // struct sockaddr_in
+#include <arpa/inet.h>     // htonl(), htons()
+#include <sys/types.h>
+#include <sys/stat.h>      // mkdir()
+#include <sys/time.h>      // utimes()
+#include <sys/socket.h>    // socket API
+#include <sys/utsname.h>   // uname()
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <algorithm>       // sort()
+using namespace std;
+
+#include "netimg.h"
+#include "hash.h"
+#include "ltga.h"
+#include "imgdb.h"
+#include "imgcodec.h"
+#include "imgsend.h"
+#include "dhtring.h"
+#include "dhtbench.h"
+#include "nlog.h"
+
+static volatile long dhtbench_sum;   // results, so the work isn't optimized away
+
+static double
+dhtbench_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec*1e9 + ts.tv_nsec);
+}
+
+/*
+ * dhtbench_tga: a "width" by "height" image with "depth" bytes per
+ * pixel, made of 16-pixel-wide runs, every third of them noisy, so
+ * that it compresses about as well as a drawing.
+ */
+class dhtbench_tga : public LTGA {
+public:
+  dhtbench_tga(uint width, uint height, uint depth) : LTGA(width, height)
+  {
+    unsigned int x, y, block;
+    byte *p;
+
+    m_pixelDepth = depth*8;
+    m_alphaDepth = depth == 4 ? 8 : 0;
+    m_type = depth == 4 ? itRGBA : itRGB;
+    m_pixels = (byte *) malloc((size_t) width*height*depth);
+    for (y = 0, p = m_pixels; y < height; y++) {
+      for (x = 0; x < width; x++, p += depth) {
+        block = x/16 + (y/16)*97;
+        p[0] = (byte) (block*37 + (block % 3 ? 0 : (x*131 + y*71) & 0x3f));
+        p[1] = (byte) (block*11 + y/16);
+        p[2] = (byte) (block*5);
+        if (depth == 4) {
+          p[3] = (byte) (255 - (block & 0x7f));
+        }
+      }
+    }
+  }
+};
+
+/*
+ * dhtbench_catalog: a folder of "n" images, all links to one small
+ * image, listed in its FILELIST.txt.
+ */
+static void
+dhtbench_catalog(const string &folder, int n)
+{
+  dhtbench_tga icon(DHTBENCH_ICON, DHTBENCH_ICON, 3);
+  ofstream list;
+  char name[NETIMG_MAXFNAME];
+  int i;
+
+  net_assert((mkdir(folder.c_str(), 0755) < 0), "dhtbench_catalog: mkdir");
+  list.open((folder+IMGDB_DIRSEP+IMGDB_FILELIST).c_str());
+  for (i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "img%05d.tga", i);
+    if (!i) {
+      net_assert(!icon.WriteToFile(folder+IMGDB_DIRSEP+name), "dhtbench_catalog: write image");
+    } else {
+      net_assert((link((folder+IMGDB_DIRSEP+"img00000.tga").c_str(),
+                       (folder+IMGDB_DIRSEP+name).c_str()) < 0), "dhtbench_catalog: link");
+    }
+    list << name << endl;
+  }
+  list.close();
+}
+
+static int
+dhtbench_rm(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  return(remove(path));
+}
+
+/* ID_inrange() over a spread of IDs and ranges */
+static void
+dhtbench_inrange(void *arg)
+{
+  long sum = 0;
+  int i;
+
+  for (i = 0; i < 65536; i++) {
+    sum += ID_inrange((unsigned char) (i*31), (unsigned char) i, (unsigned char) (i >> 8));
+  }
+  dhtbench_sum += sum;
+}
+
+static void
+dhtbench_id(void *arg)
+{
+  unsigned char (*mds)[SHA1_MDLEN] = (unsigned char (*)[SHA1_MDLEN]) arg;
+  long sum = 0;
+  int i;
+
+  for (i = 0; i < DHTBENCH_NAMES; i++) {
+    sum += ID(mds[i]);
+  }
+  dhtbench_sum += sum;
+}
+
+static void
+dhtbench_bfidx(void *arg)
+{
+  unsigned char (*mds)[SHA1_MDLEN] = (unsigned char (*)[SHA1_MDLEN]) arg;
+  long sum = 0;
+  int i;
+
+  for (i = 0; i < DHTBENCH_NAMES; i++) {
+    sum += bfIDX(BFIDX1, mds[i]) + bfIDX(BFIDX2, mds[i]) + bfIDX(BFIDX3, mds[i]);
+  }
+  dhtbench_sum += sum;
+}
+
+/* getForwardIdx() of every node for every ID */
+static void
+dhtbench_fwdidx(void *arg)
+{
+  unsigned char (*fids)[DHTN_FINGERS] = (unsigned char (*)[DHTN_FINGERS]) arg;
+  long sum = 0;
+  int self, id;
+
+  for (self = 0; self <= NETIMG_IDMAX; self++) {
+    for (id = 0; id <= NETIMG_IDMAX; id++) {
+      sum += getForwardIdx((unsigned char) self, fids[self], id);
+    }
+  }
+  dhtbench_sum += sum;
+}
+
+typedef struct {
+  imgdb *dbs_db;
+  vector<string> dbs_names;
+} dhtbench_search;
+
+static void
+dhtbench_searchdb(void *arg)
+{
+  dhtbench_search *s = (dhtbench_search *) arg;
+  long sum = 0;
+  unsigned int i;
+
+  for (i = 0; i < s->dbs_names.size(); i++) {
+    sum += s->dbs_db->searchdb((char *) s->dbs_names[i].c_str());
+  }
+  dhtbench_sum += sum;
+}
+
+typedef struct {
+  string dbl_folder;
+  imgdb *dbl_db;                // for reloaddb()
+  unsigned char dbl_beg, dbl_end;
+} dhtbench_load;
+
+/* loaddb() of a node starting up, with the whole circle */
+static void
+dhtbench_loaddb(void *arg)
+{
+  dhtbench_load *l = (dhtbench_load *) arg;
+  imgdb *db = new imgdb;
+
+  db->setfolder((char *) l->dbl_folder.c_str());
+  db->loaddb();
+  delete db;
+}
+
+/* reloaddb() of a node whose range has changed */
+static void
+dhtbench_reloaddb(void *arg)
+{
+  dhtbench_load *l = (dhtbench_load *) arg;
+
+  l->dbl_db->reloaddb(l->dbl_beg, l->dbl_end);
+}
+
+typedef struct {
+  string dbt_path;
+  LTGA dbt_img;
+} dhtbench_tgafile;
+
+static void
+dhtbench_loadtga(void *arg)
+{
+  dhtbench_tgafile *t = (dhtbench_tgafile *) arg;
+
+  net_assert(!t->dbt_img.LoadFromFile(t->dbt_path), "dhtbench_loadtga: LoadFromFile");
+}
+
+static void
+dhtbench_swaprb(void *arg)
+{
+  ((dhtbench_tgafile *) arg)->dbt_img.SwapRB();
+}
+
+/*
+ * The receiving end of the loopback connection images are sent on,
+ * drained by a thread of its own.
+ */
+typedef struct {
+  int dbk_sd;
+  long dbk_recvd;
+  long dbk_sent;                // bytes, over all calls
+} dhtbench_sink;
+
+static void *
+dhtbench_drain(void *arg)
+{
+  dhtbench_sink *sink = (dhtbench_sink *) arg;
+  char buf[65536];
+  int bytes;
+
+  while ((bytes = recv(sink->dbk_sd, buf, sizeof(buf), 0)) > 0) {
+    __sync_fetch_and_add(&sink->dbk_recvd, (long) bytes);
+  }
+  return(NULL);
+}
+
+/*
+ * An image sent by imgsend(), as dhtn sends it, less the pauses
+ * between segments, to a client asking dbx_req of it.
+ */
+typedef struct {
+  int dbx_sd;
+  dhtbench_sink *dbx_sink;
+  imgdb *dbx_db;                // its current image is sent
+  imgsend_req dbx_req;
+  long dbx_bytes;               // on the wire, per call
+} dhtbench_xfer;
+
+static void
+dhtbench_sendimg(void *arg)
+{
+  dhtbench_xfer *x = (dhtbench_xfer *) arg;
+
+  imgsend(x->dbx_sd, &x->dbx_req, x->dbx_db, IMGDB_FOUND, 0);
+
+  /* until the client has it all */
+  x->dbx_sink->dbk_sent += x->dbx_bytes;
+  while (__sync_fetch_and_add(&x->dbx_sink->dbk_recvd, 0L) < x->dbx_sink->dbk_sent) {
+    sched_yield();
+  }
+}
+
+/*
+ * dhtbench_sizexfer: what one dhtbench_sendimg() of "x" puts on the
+ * wire, counted once the client has stopped receiving.
+ */
+static void
+dhtbench_sizexfer(dhtbench_xfer *x)
+{
+  long recvd, last;
+
+  imgsend(x->dbx_sd, &x->dbx_req, x->dbx_db, IMGDB_FOUND, 0);
+  last = x->dbx_sink->dbk_sent;
+  do {
+    recvd = last;
+    usleep(50000);
+    last = __sync_fetch_and_add(&x->dbx_sink->dbk_recvd, 0L);
+  } while (last != recvd);
+  x->dbx_bytes = last - x->dbx_sink->dbk_sent;
+  x->dbx_sink->dbk_sent = last;
+}
+
+/*
+ * dhtbench_loopback: connect *sd to a dhtbench_drain() thread over
+ * the loopback interface.
+ */
+static void
+dhtbench_loopback(int *sd, dhtbench_sink *sink)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  pthread_t tid;
+  int lsd;
+
+  lsd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  net_assert((lsd < 0), "dhtbench_loopback: socket");
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  net_assert((bind(lsd, (struct sockaddr *) &addr, sizeof(addr)) < 0), "dhtbench_loopback: bind");
+  net_assert((listen(lsd, 1) < 0), "dhtbench_loopback: listen");
+  net_assert((getsockname(lsd, (struct sockaddr *) &addr, &len) < 0), "dhtbench_loopback: getsockname");
+
+  *sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  net_assert((*sd < 0), "dhtbench_loopback: socket");
+  net_assert((connect(*sd, (struct sockaddr *) &addr, sizeof(addr)) < 0), "dhtbench_loopback: connect");
+  sink->dbk_sd = accept(lsd, NULL, NULL);
+  net_assert((sink->dbk_sd < 0), "dhtbench_loopback: accept");
+  close(lsd);
+  sink->dbk_recvd = sink->dbk_sent = 0;
+  net_assert(pthread_create(&tid, NULL, dhtbench_drain, sink), "dhtbench_loopback: pthread_create");
+  pthread_detach(tid);
+}
+
+/*
+ * dhtbench_measure: time case "c".  After a first run to size them,
+ * DHTBENCH_SAMPLES samples are taken, each calling dbc_fn enough
+ * times to last about "ms" milliseconds.
+ */
+static void
+dhtbench_measure(dhtbench_case *c, int ms, dhtbench_result *r)
+{
+  double ns[DHTBENCH_SAMPLES], t0, el, target = ms*1e6;
+  long calls, i;
+  int s;
+
+  for (calls = 1; ; calls *= 2) {
+    t0 = dhtbench_now();
+    for (i = 0; i < calls; i++) {
+      c->dbc_fn(c->dbc_arg);
+    }
+    el = dhtbench_now()-t0;
+    if (el >= target/8) {
+      break;
+    }
+  }
+  calls = (long) (calls*target/el) + 1;
+
+  for (s = 0; s < DHTBENCH_SAMPLES; s++) {
+    t0 = dhtbench_now();
+    for (i = 0; i < calls; i++) {
+      c->dbc_fn(c->dbc_arg);
+    }
+    ns[s] = (dhtbench_now()-t0)/((double) calls*c->dbc_ops);
+  }
+  sort(ns, ns+DHTBENCH_SAMPLES);
+
+  r->dbr_calls = calls;
+  r->dbr_ns = ns[DHTBENCH_SAMPLES/2];
+  r->dbr_minns = ns[0];
+}
+
+/*
+ * dhtbench_field: the string value of "field" in a result line of
+ * dhtbench's own output, or "" if it has none.
+ */
+static string
+dhtbench_field(const char *line, const char *field)
+{
+  string key = string("\"")+field+"\": \"";
+  const char *p = strstr(line, key.c_str()), *q;
+
+  if (!p) {
+    return("");
+  }
+  p += key.size();
+  q = strchr(p, '"');
+  return(q ? string(p, q-p) : "");
+}
+
+/*
+ * dhtbench_readbase: the ns_per_op of each case in the results at
+ * "path", by name and args.  Returns 0, or -1 if it can't be read.
+ */
+static int
+dhtbench_readbase(const char *path, map<string, double> *base)
+{
+  ifstream in(path);
+  string line;
+  const char *p;
+
+  if (!in) {
+    return(-1);
+  }
+  while (getline(in, line)) {
+    p = strstr(line.c_str(), "\"ns_per_op\": ");
+    if (p && !dhtbench_field(line.c_str(), "name").empty()) {
+      (*base)[dhtbench_field(line.c_str(), "name")+"|"+dhtbench_field(line.c_str(), "args")] =
+        strtod(p+strlen("\"ns_per_op\": "), NULL);
+    }
+  }
+  return(0);
+}
+
+static void
+dhtbench_usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s [-o <results.json> -f <name> -c <baseline.json> -x <percent> -t <ms>]\n",
+          progname);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  dhtbench_opts opts;
+  extern char *optarg;
+  char tmpl[] = "/tmp/dhtbenchXXXXXX", name[NETIMG_MAXFNAME], args[128], host[64];
+  string dir;
+  vector<dhtbench_case> cases;
+  vector<dhtbench_result> results;
+  dhtbench_case c;
+  map<string, double> base;
+  map<string, double>::iterator it;
+  static unsigned char mds[DHTBENCH_NAMES][SHA1_MDLEN];
+  static unsigned char fids[NETIMG_IDMAX+1][DHTN_FINGERS];
+  static const int catalogs[] = { 100, 300, 1000 };  // all below IMGDB_MAXDBSIZE
+  static const char *tgas[] = { "24-bit raw", "24-bit RLE", "32-bit raw", "32-bit RLE" };
+  dhtbench_search hit, miss, falsepos;
+  dhtbench_load loads[3], reloads[3];
+  dhtbench_tgafile tgafiles[4];
+  dhtbench_sink sink;
+  dhtbench_xfer xfers[8];
+  imgdb *db, *storedb, *memdb;
+  imsg_t imsg;
+  struct utsname uts;
+  struct timeval tv[2];
+  FILE *out = stdout;
+  long imgsize;
+  int ch, i, n, sd, nx, slow = 0;
+  unsigned char codecs;
+
+  opts.dbo_out = opts.dbo_filter = opts.dbo_base = NULL;
+  opts.dbo_slower = DHTBENCH_SLOWER;
+  opts.dbo_ms = DHTBENCH_MINMS;
+  while ((ch = getopt(argc, argv, "o:f:c:x:t:")) != EOF) {
+    switch (ch) {
+    case 'o':
+      opts.dbo_out = optarg;
+      break;
+    case 'f':
+      opts.dbo_filter = optarg;
+      break;
+    case 'c':
+      opts.dbo_base = optarg;
+      break;
+    case 'x':
+      opts.dbo_slower = atoi(optarg);
+      net_assert((opts.dbo_slower < 0), "dhtbench: percent must not be negative");
+      break;
+    case 't':
+      opts.dbo_ms = atoi(optarg);
+      net_assert((opts.dbo_ms <= 0), "dhtbench: sample time must be positive");
+      break;
+    default:
+      dhtbench_usage(argv[0]);
+      break;
+    }
+  }
+  if (opts.dbo_base && dhtbench_readbase(opts.dbo_base, &base) < 0) {
+    perror(opts.dbo_base);
+    exit(1);
+  }
+
+  net_assert(!mkdtemp(tmpl), "dhtbench: mkdtemp");
+  dir = tmpl;
+  nlog_setlevel(NLOG_WARN);    // quiet imgdb's reports of what it loads
+
+  /* hashing and routing */
+  for (i = 0; i < DHTBENCH_NAMES; i++) {
+    snprintf(name, sizeof(name), "img%05d.tga", i);
+    SHA1((unsigned char *) name, strlen(name), mds[i]);
+  }
+  for (i = 0; i <= NETIMG_IDMAX; i++) {
+    calcfID((unsigned char) i, fids[i]);
+  }
+  c.dbc_bytes = 0;
+  c.dbc_name = "ID_inrange";
+  c.dbc_fn = dhtbench_inrange;
+  c.dbc_arg = NULL;
+  c.dbc_ops = 65536;
+  cases.push_back(c);
+  c.dbc_name = "ID";
+  c.dbc_fn = dhtbench_id;
+  c.dbc_arg = mds;
+  c.dbc_ops = DHTBENCH_NAMES;
+  cases.push_back(c);
+  c.dbc_name = "bfIDX";
+  c.dbc_fn = dhtbench_bfidx;
+  c.dbc_ops = 3*DHTBENCH_NAMES;
+  cases.push_back(c);
+  c.dbc_name = "getForwardIdx";
+  c.dbc_fn = dhtbench_fwdidx;
+  c.dbc_arg = fids;
+  c.dbc_ops = (NETIMG_IDMAX+1)*(NETIMG_IDMAX+1);
+  cases.push_back(c);
+
+  /* the image DB, with catalogs of several sizes */
+  for (i = 0; i < 3; i++) {
+    snprintf(name, sizeof(name), "/cat%d", catalogs[i]);
+    dhtbench_catalog(dir+name, catalogs[i]);
+
+    loads[i].dbl_folder = dir+name;
+    dhtbench_loaddb(&loads[i]);   // transcodes the images into the store once
+    snprintf(args, sizeof(args), "catalog %d", catalogs[i]);
+    c.dbc_name = "imgdb::loaddb";
+    c.dbc_args = args;
+    c.dbc_fn = dhtbench_loaddb;
+    c.dbc_arg = &loads[i];
+    c.dbc_ops = 1;
+    cases.push_back(c);
+
+    /* a node with a quarter of the circle */
+    reloads[i].dbl_folder = dir+name;
+    reloads[i].dbl_db = new imgdb;
+    reloads[i].dbl_db->setfolder((char *) reloads[i].dbl_folder.c_str());
+    reloads[i].dbl_beg = 3*(NETIMG_IDMAX+1)/4;
+    reloads[i].dbl_end = 0;
+    snprintf(args, sizeof(args), "catalog %d, range (%d, %d]", catalogs[i],
+             reloads[i].dbl_beg, reloads[i].dbl_end);
+    c.dbc_name = "imgdb::reloaddb";
+    c.dbc_args = args;
+    c.dbc_fn = dhtbench_reloaddb;
+    c.dbc_arg = &reloads[i];
+    cases.push_back(c);
+  }
+
+  /* searchdb() on the largest catalog, with the whole circle */
+  db = new imgdb;
+  db->setfolder((char *) loads[2].dbl_folder.c_str());
+  db->loaddb();
+  hit.dbs_db = miss.dbs_db = falsepos.dbs_db = db;
+  for (i = 0; i < DHTBENCH_NAMES; i++) {
+    snprintf(name, sizeof(name), "img%05d.tga", i*(catalogs[2]/DHTBENCH_NAMES));
+    hit.dbs_names.push_back(name);
+  }
+  for (i = 0; i < (1 << 20) && (miss.dbs_names.size() < DHTBENCH_NAMES ||
+                                falsepos.dbs_names.size() < DHTBENCH_NAMES); i++) {
+    snprintf(name, sizeof(name), "absent%07d.tga", i);
+    n = db->searchdb(name);
+    if (n == IMGDB_MISS && miss.dbs_names.size() < DHTBENCH_NAMES) {
+      miss.dbs_names.push_back(name);
+    } else if (n == IMGDB_FALSE && falsepos.dbs_names.size() < DHTBENCH_NAMES) {
+      falsepos.dbs_names.push_back(name);
+    }
+  }
+  c.dbc_name = "imgdb::searchdb";
+  c.dbc_fn = dhtbench_searchdb;
+  c.dbc_args = "hit";
+  c.dbc_arg = &hit;
+  c.dbc_ops = hit.dbs_names.size();
+  cases.push_back(c);
+  c.dbc_args = "miss";
+  c.dbc_arg = &miss;
+  c.dbc_ops = miss.dbs_names.size();
+  if (c.dbc_ops) {
+    cases.push_back(c);
+  }
+  c.dbc_args = "false positive";
+  c.dbc_arg = &falsepos;
+  c.dbc_ops = falsepos.dbs_names.size();
+  if (c.dbc_ops) {
+    cases.push_back(c);
+  }
+
+  /* decoding and swapping */
+  net_assert((mkdir((dir+"/img").c_str(), 0755) < 0), "dhtbench: mkdir");
+  for (i = 0; i < 4; i++) {
+    dhtbench_tga img(DHTBENCH_WIDTH, DHTBENCH_HEIGHT, i < 2 ? 3 : 4);
+    snprintf(name, sizeof(name), "/img/big%d%s.tga", i < 2 ? 24 : 32, i % 2 ? "r" : "");
+    tgafiles[i].dbt_path = dir+name;
+    net_assert(!img.WriteToFile(tgafiles[i].dbt_path, i % 2), "dhtbench: write image");
+    dhtbench_loadtga(&tgafiles[i]);
+
+    c.dbc_name = "LTGA::LoadFromFile";
+    c.dbc_args = tgas[i];
+    c.dbc_fn = dhtbench_loadtga;
+    c.dbc_arg = &tgafiles[i];
+    c.dbc_ops = 1;
+    c.dbc_bytes = (long) DHTBENCH_WIDTH*DHTBENCH_HEIGHT*(i < 2 ? 3 : 4);
+    cases.push_back(c);
+  }
+  for (i = 0; i < 4; i += 2) {
+    c.dbc_name = "LTGA::SwapRB";
+    c.dbc_args = i ? "32-bit" : "24-bit";
+    c.dbc_fn = dhtbench_swaprb;
+    c.dbc_arg = &tgafiles[i];
+    c.dbc_bytes = (long) DHTBENCH_WIDTH*DHTBENCH_HEIGHT*(i ? 4 : 3);
+    cases.push_back(c);
+  }
+
+  /* sending the 24-bit image over loopback, from the store and, with
+     the store made stale, from memory */
+  net_assert((mkdir((dir+"/mem").c_str(), 0755) < 0), "dhtbench: mkdir");
+  {
+    dhtbench_tga img(DHTBENCH_WIDTH, DHTBENCH_HEIGHT, 3);
+    net_assert(!img.WriteToFile(dir+"/mem/big24.tga", 0), "dhtbench: write image");
+    ofstream list((dir+"/img/"+IMGDB_FILELIST).c_str());
+    list << "big24.tga" << endl;
+    ofstream mlist((dir+"/mem/"+IMGDB_FILELIST).c_str());
+    mlist << "big24.tga" << endl;
+  }
+  storedb = new imgdb;
+  storedb->setfolder((char *) (dir+"/img").c_str());
+  storedb->loaddb();
+  net_assert((storedb->searchdb((char *) "big24.tga") != IMGDB_FOUND), "dhtbench: searchdb");
+  memdb = new imgdb;
+  memdb->setfolder((char *) (dir+"/mem").c_str());
+  memdb->loaddb();
+  gettimeofday(&tv[0], NULL);
+  tv[0].tv_sec += 10;
+  tv[1] = tv[0];
+  net_assert((utimes((dir+"/mem/big24.tga").c_str(), tv) < 0), "dhtbench: utimes");
+  net_assert((memdb->searchdb((char *) "big24.tga") != IMGDB_FOUND), "dhtbench: searchdb");
+  memset(&imsg, 0, sizeof(imsg_t));
+  imgsize = (long) storedb->marshall_imsg(&imsg);
+
+  dhtbench_loopback(&sd, &sink);
+  codecs = imgcodec_supported();
+  for (nx = 0; nx < 8; nx++) {
+    dhtbench_xfer *x = &xfers[nx];
+    x->dbx_sd = sd;
+    x->dbx_sink = &sink;
+    x->dbx_db = storedb;
+    memset(&x->dbx_req, 0, sizeof(imgsend_req));
+    x->dbx_req.isr_codecs = NETIMG_CODEC_RAW;
+  }
+  xfers[0].dbx_db = memdb;
+  xfers[2].dbx_req.isr_codecs = NETIMG_CODEC_RLE;
+  xfers[3].dbx_req.isr_codecs = codecs & NETIMG_CODEC_LZ4;
+  xfers[4].dbx_req.isr_codecs = codecs & NETIMG_CODEC_ZSTD;
+  xfers[5].dbx_req.isr_flags = NETIMG_PROGRESSIVE;
+  xfers[6].dbx_req.isr_tag = imsg.im_tag;
+  xfers[6].dbx_req.isr_off = imgsize/2;
+  xfers[7].dbx_req.isr_flags = NETIMG_PROGRESSIVE;
+  xfers[7].dbx_req.isr_tag = imsg.im_tag;
+  xfers[7].dbx_req.isr_off = imgsize;
+  for (nx = 0; nx < 8; nx++) {
+    static const char *how[] = { "raw from memory", "raw from the store", "RLE stripes",
+                                 "LZ4 stripes", "Zstandard stripes", "progressive",
+                                 "second half", "not modified" };
+    if ((nx == 3 || nx == 4) && !xfers[nx].dbx_req.isr_codecs) {
+      continue;   // not built with it
+    }
+    dhtbench_sizexfer(&xfers[nx]);
+    c.dbc_name = "sendimg";
+    c.dbc_args = how[nx];
+    c.dbc_fn = dhtbench_sendimg;
+    c.dbc_arg = &xfers[nx];
+    c.dbc_bytes = nx == 6 ? imgsize - imgsize/2 : nx == 7 ? 0 : imgsize;
+    cases.push_back(c);
+  }
+
+  results.resize(cases.size());
+  for (i = 0; i < (int) cases.size(); i++) {
+    if (!opts.dbo_filter || strstr(cases[i].dbc_name, opts.dbo_filter)) {
+      dhtbench_measure(&cases[i], opts.dbo_ms, &results[i]);
+    }
+  }
+
+  if (opts.dbo_out) {
+    out = fopen(opts.dbo_out, "w");
+    net_assert(!out, "dhtbench: fopen");
+  }
+  if (gethostname(host, sizeof(host))) {
+    strcpy(host, "");
+  }
+  host[sizeof(host)-1] = '\0';
+  uname(&uts);
+  fprintf(out, "{\n  \"bench\": \"dhtbench\",\n  \"time\": %ld,\n  \"host\": \"%s\",\n"
+          "  \"system\": \"%s %s %s\",\n  \"ms_per_sample\": %d,\n  \"samples\": %d,\n"
+          "  \"results\": [", (long) time(NULL), host, uts.sysname, uts.release, uts.machine,
+          opts.dbo_ms, DHTBENCH_SAMPLES);
+  for (i = n = 0; i < (int) cases.size(); i++) {
+    if (opts.dbo_filter && !strstr(cases[i].dbc_name, opts.dbo_filter)) {
+      continue;
+    }
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"args\": \"%s\", \"ops\": %ld, "
+            "\"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f",
+            n++ ? "," : "", cases[i].dbc_name, cases[i].dbc_args.c_str(),
+            results[i].dbr_calls*cases[i].dbc_ops, results[i].dbr_ns, results[i].dbr_minns);
+    if (cases[i].dbc_bytes) {
+      fprintf(out, ", \"mb_per_s\": %.1f",
+              cases[i].dbc_bytes*1e3/(cases[i].dbc_ops*results[i].dbr_ns));
+    }
+    fprintf(out, "}");
+
+    it = base.find(string(cases[i].dbc_name)+"|"+cases[i].dbc_args);
+    if (it != base.end() && results[i].dbr_ns > it->second*(100+opts.dbo_slower)/100.0) {
+      fprintf(stderr, "dhtbench: %s%s%s%s: %.1f ns/op, was %.1f, %.0f%% slower\n", cases[i].dbc_name,
+              cases[i].dbc_args.empty() ? "" : " (", cases[i].dbc_args.c_str(),
+              cases[i].dbc_args.empty() ? "" : ")", results[i].dbr_ns, it->second,
+              100.0*(results[i].dbr_ns/it->second-1));
+      slow++;
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  close(sd);
+  for (i = 0; i < 3; i++) {
+    delete reloads[i].dbl_db;
+  }
+  delete db;
+  delete storedb;
+  delete memdb;
+  nftw(dir.c_str(), dhtbench_rm, 16, FTW_DEPTH | FTW_PHYS);
+
+  return(slow ? 1 : 0);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __DHTBENCH_H__
+#define __DHTBENCH_H__
+
+#include <string>
+using namespace std;
+
+#define DHTBENCH_MINMS     200  // default time each sample runs for, at least
+#define DHTBENCH_SAMPLES     5  // samples per case, the median is reported
+#define DHTBENCH_SLOWER     10  // default percent slower than the baseline that fails
+#define DHTBENCH_WIDTH    1024  // images decoded, swapped, and sent
+#define DHTBENCH_HEIGHT    768
+#define DHTBENCH_ICON       64  // width and height of the images in the catalogs
+#define DHTBENCH_NAMES     256  // names looked up per searchdb() call of a case
+
+typedef struct {
+  char *dbo_out;        // -o: where the JSON goes, stdout if NULL
+  char *dbo_filter;     // -f: only the cases whose name contains this
+  char *dbo_base;       // -c: results to compare against
+  int dbo_slower;       // -x: percent slower than dbo_base that is a regression
+  int dbo_ms;           // -t
+} dhtbench_opts;
+
+/* one case, see dhtbench_run() */
+typedef struct {
+  const char *dbc_name;
+  string dbc_args;              // what sets this case apart from others of its name
+  void (*dbc_fn)(void *arg);
+  void *dbc_arg;
+  long dbc_ops;                 // operations per call of dbc_fn
+  long dbc_bytes;               //   and bytes they process, 0 if it doesn't apply
+} dhtbench_case;
+
+typedef struct {
+  long dbr_calls;               // of dbc_fn per sample
+  double dbr_ns;                // per operation, median of the samples
+  double dbr_minns;             //   fastest sample
+} dhtbench_result;
+
+#endif /* __DHTBENCH_H__ */
@@ -20,7 +20,10 @@
 #include <stdio.h>         // fprintf(), perror(), fflush()
 #include <stdlib.h>        // atoi()
 #include <assert.h>        // assert()
+#include <errno.h>
 #include <limits.h>        // LONG_MAX
+#include <sys/time.h>      // gettimeofday()
+#include <pthread.h>
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>      // socklen_t
@@ -34,6 +37,8 @@
 #include <arpa/inet.h>     // htons()
 #include <sys/types.h>     // u_short
 #include <sys/socket.h>    // socket API
+#include <sys/stat.h>      // mkdir()
+#include <fcntl.h>         // open()
 #endif
 #ifdef __APPLE__
 #include <GLUT/glut.h>
@@ -42,19 +47,68 @@
 #endif
 
 #include "netimg.h"
+#include "imgcodec.h"
 #include "dhtn.h"
+#include "dhtcbench.h"
+
+#define DHTC_RESUMES 3     /* reconnects in a row without progress before giving up */
+#define DHTC_FRAMEUS 16667 /* at most this often, in usecs, is the texture updated */
+#define DHTC_RCVBUF (4*1024*1024)  /* socket receive buffer, what the server may have in flight */
+#define DHTC_CHUNK  65536  /* bytes of raw pixels per bulk read */
+
+#define DHTC_CACHEDIR ".dhtc"          /* under $HOME, images viewed before */
+#define DHTC_CACHEMAGIC 0x43544844U    /* "DHTC" on little-endian hosts */
+
+#define DHTC_RECVING   0   /* recv_state: the receive thread is receiving */
+#define DHTC_RECVDONE  1   /*   it has received the whole image */
+#define DHTC_RECVBROKE 2   /*   the connection broke, see dhtc_resume() */
 
 int sd;                   /* socket descriptor */
+char *srv_name;           /* server, and image queried, to resume from */
+u_short srv_port;
+char *query;
+int resumes;              /* reconnects since the last bytes received */
+int rawxfer;              /* -r: ask for the image as stored, see dhtc_mkquery() */
 
 imsg_t imsg;
 char *image;
 long img_size;    
 long img_offset;
 
+pthread_t recv_tid;       /* receive thread, see dhtc_recvthread() */
+int recv_running;
+volatile long recv_offset;  /* bytes of pixels in place, published by the receive thread */
+volatile int recv_state;    /* DHTC_RECV*, set after the last recv_offset */
+
+char *stripe_buf;         /* stripe payload, if imsg.im_codec isn't RAW, reused */
+long stripe_cap;          /*   for every stripe */
+
+char *ilace;              /* if NETIMG_PROGRESSIVE, pixels as received, in pass order */
+long ilace_px;            /* pixels of ilace already put in place in image */
+imgcodec_cursor ilace_cur;
+
+/*
+ * A cached image is a dhtc_cachehdr followed by the image's pixels, in
+ * row order, see dhtc_cacheload().  The file is local to the host, so
+ * the imsg_t is in host byte order.
+ */
+typedef struct {
+  unsigned int dch_magic;    /* DHTC_CACHEMAGIC */
+  unsigned int dch_vers;     /* NETIMG_VERS */
+  imsg_t dch_imsg;           /* of the whole image, its im_tag the version cached */
+} dhtc_cachehdr;
+
+unsigned int cache_tag;   /* version of the image in the cache, 0 if none */
+
+int tex_ready;            /* the texture has the size and format of image */
+int dirty_lo, dirty_hi;   /* rows of image changed since the texture was updated */
+struct timeval tex_last;  /* when it was */
+
 void
 dhtc_usage(char *progname)
 {
-  fprintf(stderr, "Usage: %s -s serverFQDN.port -q <imagename.tga>\n", progname); 
+  fprintf(stderr, "Usage: %s -s serverFQDN.port -q <imagename.tga> [-r]\n", progname); 
+  fprintf(stderr, "       %s -b -s serverFQDN.port [-s ...] (-t <trace> | -z <names> [-a <alpha>] [-n <queries>]) [-c <connections>] [-p <pipeline>] [-w <ms>] [-r]\n", progname); 
   exit(1);
 }
 
@@ -65,11 +119,15 @@ dhtc_usage(char *progname)
  * and "port" points to the port to connect at server, in network byte order.  Both "*sname", and
  * "port" must be allocated by caller.  The variable "*imagename" points to the name of the image
  * to search for.
+ * With -b, the options for dhtc_bench() go in "*bench" instead, and
+ * every -s is kept.
+ * With -r, "rawxfer" is set, see dhtc_mkquery().
  *
  * Nothing else is modified.
  */
 int
-dhtc_args(int argc, char *argv[], char **sname, u_short *port, char **imagename)
+dhtc_args(int argc, char *argv[], char **sname, u_short *port, char **imagename,
+          dhtc_benchopts *bench)
 {
   char c, *p;
   extern char *optarg;
@@ -78,7 +136,7 @@ dhtc_args(int argc, char *argv[], char **sname, u_short *port, char **imagename)
     return (1);
   }
   
-  while ((c = getopt(argc, argv, "s:q:")) != EOF) {
+  while ((c = getopt(argc, argv, "s:q:bt:z:a:n:c:p:w:r")) != EOF) {
     switch (c) {
     case 's':
       for (p = optarg+strlen(optarg)-1;      // point to last character of addr:port arg
@@ -90,20 +148,155 @@ dhtc_args(int argc, char *argv[], char **sname, u_short *port, char **imagename)
 
       net_assert((p-optarg > NETIMG_MAXFNAME), "dhtc_args: FQDN too long");
       *sname = optarg;
+      net_assert((bench->dcb_nsrvs >= DHTCB_MAXSRVS), "dhtc_args: too many servers");
+      bench->dcb_snames[bench->dcb_nsrvs] = *sname;
+      bench->dcb_ports[bench->dcb_nsrvs++] = *port;
       break;
     case 'q':
       net_assert((strlen(optarg) >= NETIMG_MAXFNAME), "dhtc_args: image name too long");
       *imagename = optarg;
       break;
+    case 'b':
+      bench->dcb_on = 1;
+      break;
+    case 't':
+      bench->dcb_trace = optarg;
+      break;
+    case 'z':
+      bench->dcb_names = optarg;
+      break;
+    case 'a':
+      bench->dcb_alpha = atof(optarg);
+      break;
+    case 'n':
+      bench->dcb_queries = atol(optarg);
+      break;
+    case 'c':
+      bench->dcb_conns = atoi(optarg);
+      break;
+    case 'p':
+      bench->dcb_pipe = atoi(optarg);
+      break;
+    case 'w':
+      bench->dcb_timeout = atoi(optarg);
+      break;
+    case 'r':
+      rawxfer = 1;
+      break;
     default:
       return(1);
       break;
     }
   }
 
+  if (bench->dcb_on) {
+    return(!bench->dcb_nsrvs || !bench->dcb_trace == !bench->dcb_names ||
+           bench->dcb_conns < 1 || bench->dcb_queries < 1 ||
+           bench->dcb_pipe < 0 || bench->dcb_pipe > DHTCB_MAXPIPE ||
+           bench->dcb_timeout < 1);
+  }
   return (0);
 }
 
+/*
+ * dhtc_cachepath: the path of the cached copy of "imagename", in
+ * "path" of "len" bytes.  Returns 0 if the image can't be cached.
+ */
+int
+dhtc_cachepath(char *imagename, char *path, int len)
+{
+  char *home = getenv("HOME");
+  int n;
+
+  if (!home || strchr(imagename, '/')) {
+    return(0);
+  }
+  n = snprintf(path, len, "%s/%s/%s", home, DHTC_CACHEDIR, imagename);
+  return(n > 0 && n < len);
+}
+
+/*
+ * dhtc_cacheload: load the cached copy of "imagename", if any, into the
+ * global variables imsg and "image", with "img_offset" at its end, so
+ * that the query asks only for what comes after it: nothing, if the
+ * server's version of the image is still the one cached, else the
+ * whole of the new version, see dhtc_recvimsg().
+ * Returns the version cached, or 0 if there's no usable copy.
+ */
+unsigned int
+dhtc_cacheload(char *imagename)
+{
+  char path[NETIMG_MAXFNAME+1024];
+  dhtc_cachehdr hdr;
+  long len;
+  int fd;
+
+  if (!dhtc_cachepath(imagename, path, sizeof(path)) ||
+      (fd = open(path, O_RDONLY)) < 0) {
+    return(0);
+  }
+  len = -1;
+  if (read(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr) &&
+      hdr.dch_magic == DHTC_CACHEMAGIC && hdr.dch_vers == NETIMG_VERS &&
+      hdr.dch_imsg.im_depth && hdr.dch_imsg.im_tag) {
+    len = (long) hdr.dch_imsg.im_width*hdr.dch_imsg.im_height*hdr.dch_imsg.im_depth;
+    image = (char *) realloc(image, len);
+    if (read(fd, image, len) != (ssize_t) len) {
+      len = -1;
+    }
+  }
+  close(fd);
+  if (len < 0) {
+    return(0);
+  }
+
+  imsg = hdr.dch_imsg;
+  img_size = img_offset = len;
+  cache_tag = imsg.im_tag;
+  return(cache_tag);
+}
+
+/*
+ * dhtc_cachesave: cache the image just received in full as
+ * "imagename", unless it is the version already cached.  The copy is
+ * written to a temporary file renamed over the old one, so a
+ * concurrent dhtc never reads half of it.  Errors only mean the image
+ * isn't cached.
+ */
+void
+dhtc_cachesave(char *imagename)
+{
+  char path[NETIMG_MAXFNAME+1024], tmp[NETIMG_MAXFNAME+1040];
+  dhtc_cachehdr hdr;
+  int fd, ok;
+
+  if (imsg.im_tag == cache_tag || !dhtc_cachepath(imagename, path, sizeof(path))) {
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s/%s", getenv("HOME"), DHTC_CACHEDIR);
+  mkdir(tmp, 0755);
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.dch_magic = DHTC_CACHEMAGIC;
+  hdr.dch_vers = NETIMG_VERS;
+  hdr.dch_imsg = imsg;
+  hdr.dch_imsg.im_flags &= ~NETIMG_PROGRESSIVE;  // put in place by now
+  hdr.dch_imsg.im_offset = 0;
+  hdr.dch_imsg.im_length = img_size;
+  ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr) &&
+       write(fd, image, img_size) == (ssize_t) img_size;
+  close(fd);
+  if (!ok || rename(tmp, path)) {
+    unlink(tmp);
+    return;
+  }
+  cache_tag = imsg.im_tag;
+}
+
 /*
  * dhtc_sockinit: creates a new socket to connect to the provided server.
  * The server's FQDN and port number are provided.  The port number
@@ -115,7 +308,7 @@ dhtc_args(int argc, char *argv[], char **sname, u_short *port, char **imagename)
 void
 dhtc_sockinit(char *sname, u_short port)
 {
-  int err;
+  int err, rcvbuf;
   struct sockaddr_in server;
   struct hostent *sp;
 
@@ -132,6 +325,10 @@ dhtc_sockinit(char *sname, u_short port)
   sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);   // sd global
   net_assert((sd < 0), "dhtc_sockinit: socket");
 
+  /* before connecting, so the window can grow to match */
+  rcvbuf = DHTC_RCVBUF;
+  setsockopt(sd, SOL_SOCKET, SO_RCVBUF, (char *) &rcvbuf, sizeof(rcvbuf));
+
   /* obtain the server's IPv4 address from sname and initialize the
      socket address with server's address and port number . */
   memset((char *) &server, 0, sizeof(struct sockaddr_in));
@@ -148,21 +345,44 @@ dhtc_sockinit(char *sname, u_short port)
   return;
 }
 
+/*
+ * dhtc_mkquery: fill in "iqry" to query for imagename.
+ * Only the pixels from "offset" on are asked for, if the server still has
+ * version "tag" of the image; pass 0, 0 for the whole image.
+ * The image is asked for in any codec we can decode, in Adam7 pass
+ * order, unless "rawxfer": then it is asked for uncompressed, in row
+ * order, which the server can send straight from its image store, see
+ * imgsend().  That is faster when the link is fast enough that
+ * compressing and interlacing don't pay, e.g., on the loopback.
+ */
+void
+dhtc_mkquery(iqry_t *iqry, char *imagename, unsigned int tag, long offset)
+{
+  memset(iqry, 0, sizeof(iqry_t));
+  iqry->iq_vers = NETIMG_VERS;
+  iqry->iq_type = DHTM_FIND;
+  strcpy(iqry->iq_name, imagename); 
+  iqry->iq_codecs = rawxfer ? NETIMG_CODEC_RAW : imgcodec_supported();
+  iqry->iq_flags = rawxfer ? 0 : NETIMG_PROGRESSIVE;
+  iqry->iq_maxwidth = htons(NETIMG_WIDTH);
+  iqry->iq_maxheight = htons(NETIMG_HEIGHT);
+  iqry->iq_tag = htonl(tag);
+  iqry->iq_offset = htonl((unsigned int) offset);
+}
+
 /*
  * dhtc_sendquery: send a query for provided imagename to connected server.
- * Query is of type iqry_t, defined in netimg.h
+ * Query is of type iqry_t, defined in netimg.h, see dhtc_mkquery().
  *
  * On send error, return 0, else return 1
  */
 int
-dhtc_sendquery(char *imagename)
+dhtc_sendquery(char *imagename, unsigned int tag, long offset)
 {
   int bytes;
   iqry_t iqry;
 
-  iqry.iq_vers = NETIMG_VERS;
-  iqry.iq_type = DHTM_FIND;
-  strcpy(iqry.iq_name, imagename); 
+  dhtc_mkquery(&iqry, imagename, tag, offset);
   bytes = send(sd, (char *) &iqry, sizeof(iqry_t), 0);
   if (bytes != sizeof(iqry_t)) {
     // the other could have closed connection since
@@ -174,6 +394,30 @@ dhtc_sendquery(char *imagename)
   return(1);
 }
   
+/*
+ * dhtc_recvn: receive "len" bytes into "buf", however many recv()s it
+ * takes.  Returns the number of bytes received, less than "len" only
+ * if the connection broke.
+ */
+long
+dhtc_recvn(char *buf, long len)
+{
+  long got = 0;
+  int bytes;
+
+  while (got < len) {
+    bytes = recv(sd, buf+got, len-got, MSG_WAITALL);
+    if (bytes <= 0) {
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    got += bytes;
+  }
+  return(got);
+}
+
 /*
  * dhtc_recvimsg: receive an imsg_t packet from server and store it 
  * in the global variable imsg.  The type imsg_t is defined in netimg.h.
@@ -184,114 +428,366 @@ dhtc_sendquery(char *imagename)
  * If the received imsg has im_depth field = 0, it indicates
  * that no image is sent back, most likely due to image not found.
  * In which case, return 0, otherwise return 1.
+ * The image buffers are (re)allocated for the image and the pixels
+ * are received from im_offset on, see dhtc_resume().
  */
 int
 dhtc_recvimsg()
 {
-  int bytes;
+  long len;
   double img_dsize;
 
-  bytes = recv(sd, (char *) &imsg, sizeof(imsg_t), 0);   // imsg global
-  if (bytes <= 0) {
+  if (dhtc_recvn((char *) &imsg, sizeof(imsg_t)) != sizeof(imsg_t)) {   // imsg global
     // the other could have closed connection since
     // only one active search is allowed at any time
     close(sd);
     return(-1);
   }
 
-  net_assert((bytes != sizeof(imsg_t)), "dhtc_recvimsg: malformed header");
   net_assert((imsg.im_vers != NETIMG_VERS), "dhtc_recvimg: wrong imsg version");
 
   if (imsg.im_depth) {
     imsg.im_height = ntohs(imsg.im_height);
     imsg.im_width = ntohs(imsg.im_width);
     imsg.im_format = ntohs(imsg.im_format);
+    imsg.im_tag = ntohl(imsg.im_tag);
+    imsg.im_offset = ntohl(imsg.im_offset);
+    imsg.im_length = ntohl(imsg.im_length);
     
     img_dsize = (double) (imsg.im_height*imsg.im_width*(u_short)imsg.im_depth);
     net_assert((img_dsize > (double) LONG_MAX), "dhtc_recvimsg: image too large");
     img_size = (long) img_dsize;                 // global
-    image = (char *)malloc(img_size*sizeof(char));
+    net_assert(((long) imsg.im_offset > img_offset ||
+                (long) (imsg.im_offset+imsg.im_length) != img_size), "dhtc_recvimsg: bad range");
+    image = (char *)realloc(image, img_size*sizeof(char));
+    net_assert((imsg.im_codec != NETIMG_CODEC_RAW &&
+                !(imsg.im_codec & imgcodec_supported())), "dhtc_recvimsg: unknown codec");
+    img_offset = imsg.im_offset;
+    if (!img_offset) {
+      memset(image, 0, img_size);
+    }
+    tex_ready = 0;
+    if (imsg.im_flags & NETIMG_PROGRESSIVE) {
+      ilace = (char *)realloc(ilace, img_size*sizeof(char));
+      if (!img_offset) {
+        imgcodec_cursorinit(&ilace_cur, imsg.im_width, imsg.im_height);
+        ilace_px = 0;
+      }
+    } else {
+      free(ilace);
+      ilace = NULL;
+    }
+    /* stripes are no larger than the server's, see imgcodec_striperows() */
+    if (imsg.im_codec != NETIMG_CODEC_RAW && img_size) {
+      len = (long) imgcodec_striperows(imsg.im_width, imsg.im_depth)*imsg.im_width*imsg.im_depth;
+      len = len < img_size ? len : img_size;
+      if (len > stripe_cap) {
+        stripe_buf = (char *) realloc(stripe_buf, len);
+        stripe_cap = len;
+      }
+    }
     return (1);
   }
 
   return (0);
 }
 
+/*
+ * dhtc_resume: the connection broke before the whole image came in.
+ * Reconnect and ask for the rest of the image, from "img_offset" on,
+ * provided the server still has the version received so far.  If not,
+ * the new version is received from the start.
+ * Terminate process if the server can't be reached or no longer has
+ * the image, or after DHTC_RESUMES reconnects without progress.
+ */
+void
+dhtc_resume()
+{
+  close(sd);
+  net_assert((++resumes > DHTC_RESUMES), "dhtc_resume: transfer keeps breaking");
+  fprintf(stderr, "dhtc_resume: resuming at offset 0x%x\n", (unsigned int) img_offset);
+
+  dhtc_sockinit(srv_name, srv_port);
+  net_assert((!dhtc_sendquery(query, imsg.im_tag, img_offset)), "dhtc_resume: send query");
+  net_assert((dhtc_recvimsg() != 1), "dhtc_resume: image gone");
+  if (!img_offset) {
+    fprintf(stderr, "dhtc_resume: image changed, starting over\n");
+  }
+
+  return;
+}
+
+/*
+ * dhtc_recvstripe: receive the next stripe, see istripe_t in netimg.h,
+ * and decode it into "dst" at *off, advancing *off past it.
+ * Returns 0 if the connection broke, else 1.
+ * Terminate process on malformed stripe.
+ */
+int
+dhtc_recvstripe(char *dst, long *off)
+{
+  istripe_t stripe;
+
+  if (dhtc_recvn((char *) &stripe, sizeof(istripe_t)) != sizeof(istripe_t)) {
+    return(0);
+  }
+  stripe.is_rawlen = ntohl(stripe.is_rawlen);
+  stripe.is_len = ntohl(stripe.is_len);
+  net_assert((!stripe.is_rawlen || (long) stripe.is_rawlen > img_size-*off ||
+              stripe.is_len > stripe.is_rawlen), "dhtc_recvstripe: malformed stripe");
+  if ((long) stripe.is_len > stripe_cap) {
+    stripe_buf = (char *) realloc(stripe_buf, stripe.is_len);
+    stripe_cap = stripe.is_len;
+  }
+  if (dhtc_recvn(stripe_buf, stripe.is_len) != (long) stripe.is_len) {
+    return(0);
+  }
+
+  net_assert((imgcodec_decode(stripe.is_codec, imsg.im_depth, stripe_buf, stripe.is_len,
+                              dst+*off, stripe.is_rawlen) < 0),
+             "dhtc_recvstripe: corrupt stripe");
+  fprintf(stderr, "dhtc_recvstripe: offset 0x%x, received %u bytes as %u\n",
+          (unsigned int) *off, stripe.is_rawlen, stripe.is_len);
+  *off += stripe.is_rawlen;
+
+  return(1);
+}
+
+/*
+ * dhtc_recvthread: receive the rest of the image, from "recv_offset"
+ * on, into "image", or "ilace" if the image is progressive, in bulk
+ * reads that block until they are filled, as fast as the network
+ * allows.  After each read, the bytes in place so far are published in
+ * "recv_offset" for the GLUT idle callback, see dhtc_recvimage(); the
+ * image buffers and imsg must not change until the thread is joined.
+ * Ends with "recv_state" set to DHTC_RECVDONE, or DHTC_RECVBROKE if the
+ * connection broke.
+ */
+void *
+dhtc_recvthread(void *arg)
+{
+  char *dst = ilace ? ilace : image;
+  long off = recv_offset, want, got;
+
+  while (off < img_size) {
+    if (imsg.im_codec != NETIMG_CODEC_RAW) {
+      if (!dhtc_recvstripe(dst, &off)) {
+        break;
+      }
+    } else {
+      want = img_size-off < DHTC_CHUNK ? img_size-off : DHTC_CHUNK;
+      got = dhtc_recvn(dst+off, want);
+      if (got > 0) {
+        fprintf(stderr, "dhtc_recvthread: offset 0x%x, received %ld bytes\n", (unsigned int) off, got);
+      }
+      off += got;
+      if (got < want) {
+        break;
+      }
+    }
+    __sync_synchronize();     // the pixels before the offset
+    recv_offset = off;
+  }
+
+  __sync_synchronize();
+  recv_offset = off;
+  recv_state = off < img_size ? DHTC_RECVBROKE : DHTC_RECVDONE;
+  return(NULL);
+}
+
+/*
+ * dhtc_recvstart: start receiving the pixels from "img_offset" on, see
+ * dhtc_recvthread().
+ * Terminate process if the thread can't be created.
+ */
+void
+dhtc_recvstart()
+{
+  recv_offset = img_offset;
+  recv_state = DHTC_RECVING;
+  net_assert((pthread_create(&recv_tid, NULL, dhtc_recvthread, NULL) != 0),
+             "dhtc_recvstart: pthread_create");
+  recv_running = 1;
+}
+
+/*
+ * dhtc_dirty: rows [lo, hi) of "image" have changed.
+ */
+void
+dhtc_dirty(int lo, int hi)
+{
+  hi = hi < imsg.im_height ? hi : imsg.im_height;
+  if (lo >= hi) {
+    return;
+  }
+  if (dirty_lo >= dirty_hi) {
+    dirty_lo = lo;
+    dirty_hi = hi;
+  } else {
+    dirty_lo = lo < dirty_lo ? lo : dirty_lo;
+    dirty_hi = hi > dirty_hi ? hi : dirty_hi;
+  }
+}
+
+/*
+ * dhtc_upload: give the rows of "image" changed since the last update
+ * to OpenGL, and redisplay, unless the last update was less than
+ * DHTC_FRAMEUS ago.  If "force", update regardless.
+ */
+void
+dhtc_upload(int force)
+{
+  struct timeval now;
+  long rowlen = (long) imsg.im_width*imsg.im_depth;
+
+  gettimeofday(&now, NULL);
+  if (!force && tex_ready &&
+      (now.tv_sec-tex_last.tv_sec)*1000000L+(now.tv_usec-tex_last.tv_usec) < DHTC_FRAMEUS) {
+    return;
+  }
+  tex_last = now;
+
+  if (!tex_ready) {
+    /* rows of odd-width images needn't be 4-byte aligned */
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, (GLint) netimg_texfmt(imsg.im_format),
+                 (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
+                 (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, image);
+    tex_ready = 1;
+  } else if (dirty_lo < dirty_hi) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint) dirty_lo,
+                    (GLsizei) imsg.im_width, (GLsizei) (dirty_hi-dirty_lo),
+                    (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, image+dirty_lo*rowlen);
+  } else {
+    return;
+  }
+  dirty_lo = dirty_hi = 0;
+
+  /* redisplay */
+  glutPostRedisplay();
+}
+
 /* Callback functions for GLUT */
 
 /*
  * dhtc_recvimage: called by GLUT when idle
- * On each call, receive as much of the image is available on the network and
- * store it in global variable "image" at offset "img_offset" from the
- * start of the buffer.  The global variable "img_offset" must be updated
- * to reflect the amount of data received so far.  Another global variable "img_size"
- * stores the expected size of the image transmitted from the server.
+ * The image is received by the receive thread, see dhtc_recvthread(),
+ * into the global variable "image", or "ilace", at offset "img_offset"
+ * from the start of the buffer.  On each call, take in what it has put
+ * in place since the last call, up to "recv_offset", and update the
+ * global variable "img_offset" to reflect the amount of data taken in so
+ * far.  Another global variable "img_size" stores the expected size of
+ * the image transmitted from the server.
  * The variable "img_size" must NOT be modified.
- * Terminate process on receive error.
+ * Only the rows that changed are given to OpenGL, see dhtc_upload().
+ * If there is nothing new, give OpenGL the rows held back since the
+ * last update, if a frame has passed, and wait a frame rather than spin.
+ * If the connection breaks, the transfer is resumed, see dhtc_resume().
  */
 void
 dhtc_recvimage(void)
 {
-  int bytes;
+  int pass, y, state;
+  long prev = img_offset, off, rowlen = (long) imsg.im_width*imsg.im_depth;
    
-  // img_offset is a global variable that keeps track of how many bytes
-  // have been received and stored in the buffer.  Initialy it is 0.
-  //
-  // img_size is another global variable that stores the size of the image.
-  // If all goes well, we should receive img_size bytes of data from the server.
-  if (img_offset <  img_size) { 
-    /* 
-     * Receive as much of the remaining image as available from the network
-     * put the data in the buffer pointed to by the global variable 
-     * "image" starting at "img_offset".
-     *
-     * For example, the first time this function is called, img_offset is 0
-     * so the received data is stored at the start (offset 0) of the "image" 
-     * buffer.  The global variable "image" should not be modified.
-     *
-     * Update img_offset by the amount of data received, in preparation for the
-     * next iteration, the next time this function is called.
-     */
-    bytes = recv(sd, image+img_offset, img_size-img_offset, 0);
-    net_assert((bytes < 0), "dhtc_recvimage: recv error");
-    fprintf(stderr, "dhtc_recvimage: offset 0x%x, received %d bytes\n", (unsigned int) img_offset, bytes);
-    img_offset += bytes;
-    
-    /* give the updated image to OpenGL for texturing */
-    glTexImage2D(GL_TEXTURE_2D, 0, (GLint) imsg.im_format,
-                 (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
-                 (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, image);
-    /* redisplay */
-    glutPostRedisplay();
+  if (!recv_running) {
+    return;
   }
 
+  state = recv_state;
+  __sync_synchronize();     // pairs with dhtc_recvthread()'s
+  off = recv_offset;
+
+  if (off == img_offset) {
+    if (state == DHTC_RECVING) {
+      dhtc_upload(0);       // rows held back by the last call's throttling
+      usleep(DHTC_FRAMEUS);
+      return;
+    }
+    pthread_join(recv_tid, NULL);
+    recv_running = 0;
+    if (state == DHTC_RECVBROKE) {
+      dhtc_resume();
+      dhtc_recvstart();
+    } else {
+      dhtc_cachesave(query);
+      dhtc_upload(1);   // if it all came from the cache
+    }
+    return;
+  }
+  img_offset = off;
+  resumes = 0;
+
+  /* if progressive, put the pixels received so far in place, each
+     standing in for its neighbors until they arrive; the blocks
+     they fill are at most 8 rows high */
+  if (ilace) {
+    pass = ilace_cur.icc_pass;
+    y = ilace_cur.icc_y;
+    imgcodec_deinterlace(&ilace_cur, ilace+ilace_px*imsg.im_depth,
+                         img_offset/imsg.im_depth-ilace_px, image,
+                         imsg.im_width, imsg.im_height, imsg.im_depth);
+    ilace_px = img_offset/imsg.im_depth;
+    if (ilace_cur.icc_pass != pass) {
+      dhtc_dirty(0, imsg.im_height);
+    } else {
+      dhtc_dirty(y, ilace_cur.icc_y+8);
+    }
+  } else {
+    dhtc_dirty(prev/rowlen, (img_offset+rowlen-1)/rowlen);
+  }
+  
+  /* give the updated rows to OpenGL for texturing, at most once a frame */
+  dhtc_upload(img_offset == img_size);
+
   return;
 }
 
 int
 main(int argc, char *argv[])
 {
-  char *sname, *imagename;
+  char *sname, *imagename = NULL;
   u_short port;
   int err;
+  dhtc_benchopts bench;
+
+  memset(&bench, 0, sizeof(bench));
+  bench.dcb_alpha = DHTCB_ALPHA;
+  bench.dcb_queries = DHTCB_QUERIES;
+  bench.dcb_conns = DHTCB_CONNS;
+  bench.dcb_timeout = DHTCB_TIMEOUT;
 
   // parse args, see the comments for dhtc_args()
-  if (dhtc_args(argc, argv, &sname, &port, &imagename)) {
+  if (dhtc_args(argc, argv, &sname, &port, &imagename, &bench) ||
+      (!bench.dcb_on && !imagename)) {
     dhtc_usage(argv[0]);
   }
 
 #ifndef _WIN32
   signal(SIGPIPE, SIG_IGN);    /* don't die if peer is dead */
 #endif
+
+  if (bench.dcb_on) {
+    return(dhtc_bench(&bench));
+  }
   
   dhtc_sockinit(sname, port);
+  srv_name = sname;
+  srv_port = port;
+  query = imagename;
 
-  if (dhtc_sendquery(imagename)) {
+  /* only revalidated if cached, see dhtc_cacheload() */
+  dhtc_cacheload(imagename);
+  if (dhtc_sendquery(imagename, cache_tag, img_offset)) {
 
     err = dhtc_recvimsg();
     if (err == 1) { // if image found
+      if (cache_tag && imsg.im_tag == cache_tag) {
+        fprintf(stderr, "%s: cached %s is current\n", argv[0], imagename);
+      }
       netimg_glutinit(&argc, argv, dhtc_recvimage);
       netimg_imginit();
+      dhtc_recvstart();
       
       /* start the GLUT main loop */
       glutMainLoop();
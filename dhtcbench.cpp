@@ -0,0 +1,489 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>         // fprintf(), printf()
+#include <stdlib.h>        // drand48()
+#include <string.h>        // memset(), memcpy(), strlen()
+#include <math.h>          // pow()
+#include <errno.h>
+#include <unistd.h>        // close()
+#include <fcntl.h>         // fcntl()
+#include <poll.h>          // poll()
+#include <netdb.h>         // gethostbyname()
+#include <netinet/in.h>    // struct sockaddr_in
+#include <arpa/inet.h>     // ntohs(), ntohl()
+#include <sys/socket.h>    // socket API
+#include <sys/time.h>      // gettimeofday()
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>       // sort(), lower_bound()
+using namespace std;
+
+#include "netimg.h"
+#include "dhtcbench.h"
+
+#define DHTCB_BUFSIZE 65536
+
+/* where a connection is in its query */
+#define DHTCB_IDLE    0
+#define DHTCB_CONNECT 1   // waiting for connect() to finish
+#define DHTCB_QUERY   2   // sending the batch of iqry_t
+#define DHTCB_IMSG    3   // receiving the imsg_t of the next reply
+#define DHTCB_PIXELS  4   // receiving raw pixels
+#define DHTCB_SHDR    5   // receiving a stripe header
+#define DHTCB_SDATA   6   // receiving a stripe payload
+
+typedef struct {
+  int dbc_state;
+  int dbc_sd;
+  iqry_t dbc_iqry[DHTCB_MAXPIPE];  // the batch of queries under way
+  int dbc_nq;             // queries in the batch
+  int dbc_done;           // of them answered
+  imsg_t dbc_imsg;
+  istripe_t dbc_stripe;
+  long dbc_got;           // bytes of the batch, imsg, or stripe header
+  long dbc_left;          // bytes of pixels still to come
+  long dbc_sleft;         // bytes of the current stripe payload still to come
+  long dbc_wire;          // bytes received
+  double dbc_start;       // when the batch was sent, in ms
+  double dbc_imsgms;      // when the imsg_t of the current reply was in
+  double dbc_deadline;    // when the current reply must be in, in ms
+} dhtcb_conn;
+
+typedef struct {
+  long dbs_ok, dbs_missed, dbs_failed;
+  long dbs_wire;
+  vector<double> dbs_imsgms;    // time to imsg_t of each query answered
+  vector<double> dbs_lastms;    // time to last byte
+} dhtcb_stats;
+
+static double
+dhtcb_now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec*1000.0 + tv.tv_usec/1000.0);
+}
+
+/*
+ * dhtcb_readnames: the non-empty lines of "path".  Terminates process
+ * if there are none.
+ */
+static void
+dhtcb_readnames(const char *path, vector<string> *names)
+{
+  ifstream in(path);
+  string line;
+
+  while (getline(in, line)) {
+    if (!line.empty() && line[line.size()-1] == '\r') {
+      line.erase(line.size()-1);
+    }
+    if (!line.empty()) {
+      net_assert((line.size() >= NETIMG_MAXFNAME), "dhtc_bench: image name too long");
+      names->push_back(line);
+    }
+  }
+  net_assert((names->empty()), path);
+}
+
+/*
+ * dhtcb_zipf: "n" names drawn from "names" with probability
+ * proportional to 1/rank^alpha, rank 1 being the first.
+ */
+static void
+dhtcb_zipf(const vector<string> &names, double alpha, long n, vector<string> *queries)
+{
+  vector<double> cdf(names.size());
+  double sum = 0.0;
+  unsigned int i;
+  long q;
+
+  for (i = 0; i < names.size(); i++) {
+    sum += 1.0/pow((double) (i+1), alpha);
+    cdf[i] = sum;
+  }
+  srand48(DHTCB_SEED);
+  for (q = 0; q < n; q++) {
+    i = lower_bound(cdf.begin(), cdf.end(), drand48()*sum) - cdf.begin();
+    queries->push_back(names[i < names.size() ? i : names.size()-1]);
+  }
+}
+
+/*
+ * dhtcb_batch: make the next batch of queries of "conn": one query, or
+ * with "pipe", up to "pipe" queries sent back to back on a kept-alive
+ * connection.  Each is tagged with its index in "queries", which
+ * starts at *next.
+ */
+static void
+dhtcb_batch(dhtcb_conn *conn, const vector<string> &queries, long *next, int pipe)
+{
+  iqry_t *iqry;
+
+  conn->dbc_nq = conn->dbc_done = 0;
+  conn->dbc_got = 0;
+  do {
+    iqry = &conn->dbc_iqry[conn->dbc_nq++];
+    dhtc_mkquery(iqry, (char *) queries[*next].c_str(), 0, 0);
+    iqry->iq_id = htonl((unsigned int) *next);
+    if (pipe) {
+      iqry->iq_flags |= NETIMG_KEEPALIVE;
+    }
+    (*next)++;
+  } while (conn->dbc_nq < pipe && *next < (long) queries.size());
+  conn->dbc_start = dhtcb_now();
+}
+
+/*
+ * dhtcb_start: connect "conn" to the server at "srv".
+ * Returns 0 on success, -1 if the connection can't be started.
+ */
+static int
+dhtcb_start(dhtcb_conn *conn, struct sockaddr_in *srv)
+{
+  memset(conn, 0, sizeof(dhtcb_conn));
+  conn->dbc_sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (conn->dbc_sd < 0) {
+    return(-1);
+  }
+  fcntl(conn->dbc_sd, F_SETFL, fcntl(conn->dbc_sd, F_GETFL, 0) | O_NONBLOCK);
+  if (connect(conn->dbc_sd, (struct sockaddr *) srv, sizeof(struct sockaddr_in)) == 0) {
+    conn->dbc_state = DHTCB_QUERY;
+  } else if (errno == EINPROGRESS) {
+    conn->dbc_state = DHTCB_CONNECT;
+  } else {
+    close(conn->dbc_sd);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * dhtcb_answered: record the reply just received in full on "conn" and
+ * get ready for the next one of the batch, if any.
+ */
+static void
+dhtcb_answered(dhtcb_conn *conn, dhtcb_stats *stats)
+{
+  stats->dbs_wire += conn->dbc_wire;
+  conn->dbc_wire = 0;
+  if (!conn->dbc_imsg.im_depth) {
+    stats->dbs_missed++;
+  } else {
+    stats->dbs_ok++;
+    stats->dbs_imsgms.push_back(conn->dbc_imsgms - conn->dbc_start);
+    stats->dbs_lastms.push_back(dhtcb_now() - conn->dbc_start);
+  }
+  conn->dbc_done++;
+  conn->dbc_got = 0;
+  conn->dbc_state = DHTCB_IMSG;
+}
+
+/*
+ * dhtcb_finish: free "conn", counting the queries of its batch not
+ * answered yet as failed.
+ */
+static void
+dhtcb_finish(dhtcb_conn *conn, dhtcb_stats *stats)
+{
+  close(conn->dbc_sd);
+  conn->dbc_state = DHTCB_IDLE;
+  stats->dbs_wire += conn->dbc_wire;
+  stats->dbs_failed += conn->dbc_nq - conn->dbc_done;
+}
+
+/*
+ * dhtcb_io: make as much progress on "conn" as its socket allows
+ * without blocking.  Returns 1 while the reply is under way, 0 once a
+ * reply has been received in full, -1 if the connection broke or the
+ * reply doesn't answer any query of the batch.
+ */
+static int
+dhtcb_io(dhtcb_conn *conn, char *buf)
+{
+  int bytes, err;
+  socklen_t len;
+  long want, total;
+  int i;
+
+  for (;;) {
+    switch (conn->dbc_state) {
+    case DHTCB_CONNECT:
+      len = sizeof(err);
+      if (getsockopt(conn->dbc_sd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        return(-1);
+      }
+      conn->dbc_state = DHTCB_QUERY;
+      break;
+
+    case DHTCB_QUERY:
+      total = conn->dbc_nq*sizeof(iqry_t);
+      bytes = send(conn->dbc_sd, (char *) conn->dbc_iqry+conn->dbc_got,
+                   total-conn->dbc_got, 0);
+      if (bytes <= 0) {
+        return(bytes < 0 && errno == EAGAIN ? 1 : -1);
+      }
+      conn->dbc_got += bytes;
+      if (conn->dbc_got == total) {
+        conn->dbc_got = 0;
+        conn->dbc_state = DHTCB_IMSG;
+      }
+      break;
+
+    case DHTCB_IMSG:
+      bytes = recv(conn->dbc_sd, (char *) &conn->dbc_imsg+conn->dbc_got,
+                   sizeof(imsg_t)-conn->dbc_got, 0);
+      if (bytes <= 0) {
+        return(bytes < 0 && errno == EAGAIN ? 1 : -1);
+      }
+      conn->dbc_wire += bytes;
+      conn->dbc_got += bytes;
+      if (conn->dbc_got < (long) sizeof(imsg_t)) {
+        break;
+      }
+      conn->dbc_imsgms = dhtcb_now();
+      if (conn->dbc_imsg.im_vers != NETIMG_VERS) {
+        return(-1);
+      }
+      /* replies may come in any order */
+      for (i = 0; i < conn->dbc_nq && conn->dbc_iqry[i].iq_id != conn->dbc_imsg.im_id; i++);
+      if (i == conn->dbc_nq) {
+        return(-1);
+      }
+      if (!conn->dbc_imsg.im_depth) {
+        return(0);
+      }
+      conn->dbc_left = ntohl(conn->dbc_imsg.im_length);
+      conn->dbc_got = 0;
+      conn->dbc_state = conn->dbc_imsg.im_codec == NETIMG_CODEC_RAW ? DHTCB_PIXELS : DHTCB_SHDR;
+      if (!conn->dbc_left) {
+        return(0);
+      }
+      break;
+
+    case DHTCB_PIXELS:
+      want = conn->dbc_left < DHTCB_BUFSIZE ? conn->dbc_left : DHTCB_BUFSIZE;
+      bytes = recv(conn->dbc_sd, buf, want, 0);
+      if (bytes <= 0) {
+        return(bytes < 0 && errno == EAGAIN ? 1 : -1);
+      }
+      conn->dbc_wire += bytes;
+      conn->dbc_left -= bytes;
+      if (!conn->dbc_left) {
+        return(0);
+      }
+      break;
+
+    case DHTCB_SHDR:
+      bytes = recv(conn->dbc_sd, (char *) &conn->dbc_stripe+conn->dbc_got,
+                   sizeof(istripe_t)-conn->dbc_got, 0);
+      if (bytes <= 0) {
+        return(bytes < 0 && errno == EAGAIN ? 1 : -1);
+      }
+      conn->dbc_wire += bytes;
+      conn->dbc_got += bytes;
+      if (conn->dbc_got < (long) sizeof(istripe_t)) {
+        break;
+      }
+      conn->dbc_got = 0;
+      conn->dbc_sleft = ntohl(conn->dbc_stripe.is_len);
+      conn->dbc_left -= ntohl(conn->dbc_stripe.is_rawlen);
+      if (conn->dbc_left < 0) {
+        return(-1);
+      }
+      conn->dbc_state = DHTCB_SDATA;
+      if (!conn->dbc_sleft) {
+        return(conn->dbc_left ? -1 : 0);
+      }
+      break;
+
+    case DHTCB_SDATA:
+      want = conn->dbc_sleft < DHTCB_BUFSIZE ? conn->dbc_sleft : DHTCB_BUFSIZE;
+      bytes = recv(conn->dbc_sd, buf, want, 0);
+      if (bytes <= 0) {
+        return(bytes < 0 && errno == EAGAIN ? 1 : -1);
+      }
+      conn->dbc_wire += bytes;
+      conn->dbc_sleft -= bytes;
+      if (!conn->dbc_sleft) {
+        if (!conn->dbc_left) {
+          return(0);
+        }
+        conn->dbc_state = DHTCB_SHDR;
+      }
+      break;
+
+    default:
+      return(-1);
+    }
+  }
+}
+
+/*
+ * dhtcb_pct: the "p"th percentile of the sorted "v", 0 if empty.
+ */
+static double
+dhtcb_pct(const vector<double> &v, double p)
+{
+  unsigned int i;
+
+  if (v.empty()) {
+    return(0.0);
+  }
+  i = (unsigned int) (p/100.0*(v.size()-1) + 0.5);
+  return(v[i < v.size() ? i : v.size()-1]);
+}
+
+static void
+dhtcb_report(dhtcb_stats *stats, double ms)
+{
+  long n = stats->dbs_ok+stats->dbs_missed+stats->dbs_failed;
+  double s = ms/1000.0;
+
+  sort(stats->dbs_imsgms.begin(), stats->dbs_imsgms.end());
+  sort(stats->dbs_lastms.begin(), stats->dbs_lastms.end());
+
+  printf("queries %ld (answered %ld, missed %ld, failed %ld) in %.3f s\n",
+         n, stats->dbs_ok, stats->dbs_missed, stats->dbs_failed, s);
+  printf("throughput %.2f queries/s, %.0f bytes/s\n",
+         s > 0.0 ? n/s : 0.0, s > 0.0 ? stats->dbs_wire/s : 0.0);
+  printf("time to imsg (ms): p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+         dhtcb_pct(stats->dbs_imsgms, 50), dhtcb_pct(stats->dbs_imsgms, 90),
+         dhtcb_pct(stats->dbs_imsgms, 99), dhtcb_pct(stats->dbs_imsgms, 100));
+  printf("time to last byte (ms): p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+         dhtcb_pct(stats->dbs_lastms, 50), dhtcb_pct(stats->dbs_lastms, 90),
+         dhtcb_pct(stats->dbs_lastms, 99), dhtcb_pct(stats->dbs_lastms, 100));
+}
+
+/*
+ * dhtc_bench: query the servers in "opts" without a display, keeping up
+ * to dcb_conns connections busy at once, the servers taking turns.
+ * Each connection carries one query, or with dcb_pipe, batches of up
+ * to dcb_pipe queries pipelined on one kept-alive connection until the
+ * queries run out; latencies are then from when the batch was sent.
+ * A reply not in full within dcb_timeout ms of the one before it, or
+ * of the batch being sent, fails its query and the rest of its batch,
+ * and its connection is closed.  The names queried are those of
+ * dcb_trace, in order, or dcb_queries names drawn from dcb_names.  Reports
+ * throughput, and latency percentiles to the imsg_t and to the last
+ * byte of each image, on stdout.  Pixels are counted, not decoded.
+ * Returns 0 if every query was answered, found or not, else 1.
+ * Terminates process if a server can't be resolved.
+ */
+int
+dhtc_bench(dhtc_benchopts *opts)
+{
+  vector<string> names, queries;
+  vector<struct sockaddr_in> srvs(opts->dcb_nsrvs);
+  vector<dhtcb_conn> conns(opts->dcb_conns);
+  vector<struct pollfd> pfds(opts->dcb_conns);
+  vector<int> active(opts->dcb_conns);
+  struct hostent *sp;
+  dhtcb_stats stats;
+  char *buf = new char[DHTCB_BUFSIZE];
+  double start, now, wake;
+  long next = 0, busy = 0;
+  int i, n, status, wait;
+  dhtcb_conn *conn;
+
+  for (i = 0; i < opts->dcb_nsrvs; i++) {
+    memset(&srvs[i], 0, sizeof(struct sockaddr_in));
+    srvs[i].sin_family = AF_INET;
+    srvs[i].sin_port = opts->dcb_ports[i];
+    sp = gethostbyname(opts->dcb_snames[i]);
+    net_assert((sp == 0), "dhtc_bench: gethostbyname");
+    memcpy(&srvs[i].sin_addr, sp->h_addr, sp->h_length);
+  }
+
+  if (opts->dcb_trace) {
+    dhtcb_readnames(opts->dcb_trace, &queries);
+  } else {
+    dhtcb_readnames(opts->dcb_names, &names);
+    dhtcb_zipf(names, opts->dcb_alpha, opts->dcb_queries, &queries);
+  }
+  stats.dbs_ok = stats.dbs_missed = stats.dbs_failed = stats.dbs_wire = 0;
+
+  start = dhtcb_now();
+  for (;;) {
+    /* keep every connection busy while there are queries left */
+    for (i = 0; i < opts->dcb_conns; i++) {
+      while (conns[i].dbc_state == DHTCB_IDLE && next < (long) queries.size()) {
+        if (dhtcb_start(&conns[i], &srvs[next % opts->dcb_nsrvs]) < 0) {
+          stats.dbs_failed++;
+          next++;
+        } else {
+          dhtcb_batch(&conns[i], queries, &next, opts->dcb_pipe);
+          conns[i].dbc_deadline = conns[i].dbc_start + opts->dcb_timeout;
+          busy++;
+        }
+      }
+    }
+    if (!busy) {
+      break;
+    }
+
+    /* wake up for the earliest deadline at the latest */
+    wake = 0.0;
+    for (i = n = 0; i < opts->dcb_conns; i++) {
+      if (conns[i].dbc_state != DHTCB_IDLE) {
+        pfds[n].fd = conns[i].dbc_sd;
+        pfds[n].events = conns[i].dbc_state <= DHTCB_QUERY ? POLLOUT : POLLIN;
+        pfds[n].revents = 0;
+        active[n++] = i;
+        wake = n == 1 || conns[i].dbc_deadline < wake ? conns[i].dbc_deadline : wake;
+      }
+    }
+    now = dhtcb_now();
+    wait = wake > now ? (int) (wake-now) + 1 : 0;
+    if (poll(&pfds[0], n, wait) < 0) {
+      net_assert((errno != EINTR), "dhtc_bench: poll");
+      continue;
+    }
+
+    for (i = 0; i < n; i++) {
+      conn = &conns[active[i]];
+      status = 1;
+      while (pfds[i].revents && !(status = dhtcb_io(conn, buf))) {
+        dhtcb_answered(conn, &stats);
+        conn->dbc_deadline = dhtcb_now() + opts->dcb_timeout;
+        if (conn->dbc_done < conn->dbc_nq) {
+          continue;
+        }
+        if (!opts->dcb_pipe || next >= (long) queries.size()) {
+          break;
+        }
+        dhtcb_batch(conn, queries, &next, opts->dcb_pipe);
+        conn->dbc_deadline = conn->dbc_start + opts->dcb_timeout;
+        conn->dbc_state = DHTCB_QUERY;
+      }
+      if (status > 0 && dhtcb_now() >= conn->dbc_deadline) {
+        status = -1;    // overdue
+      }
+      if (status <= 0) {
+        dhtcb_finish(conn, &stats);
+        busy--;
+      }
+    }
+  }
+
+  dhtcb_report(&stats, dhtcb_now()-start);
+  delete [] buf;
+  return(stats.dbs_failed ? 1 : 0);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __DHTCBENCH_H__
+#define __DHTCBENCH_H__
+
+#include <sys/types.h>     // u_short
+
+#include "netimg.h"
+
+#define DHTCB_MAXSRVS  16
+#define DHTCB_CONNS     8     // default concurrent connections
+#define DHTCB_QUERIES 1000    // default queries drawn from a name list
+#define DHTCB_ALPHA   1.0     // default Zipf exponent
+#define DHTCB_SEED      1     // names are drawn the same way on every run
+#define DHTCB_MAXPIPE  64     // queries pipelined on a connection at most
+#define DHTCB_TIMEOUT 30000   // default ms a reply may take before its query fails
+
+/*
+ * Headless load generation, see dhtc_bench().  Either dcb_trace or
+ * dcb_names is set.
+ */
+typedef struct {
+  int dcb_on;                          // -b
+  int dcb_nsrvs;                       // -s, one or more
+  char *dcb_snames[DHTCB_MAXSRVS];
+  u_short dcb_ports[DHTCB_MAXSRVS];    // network byte order
+  char *dcb_trace;                     // -t: file of names to query, in order
+  char *dcb_names;                     // -z: file of names to draw from, most popular first
+  double dcb_alpha;                    // -a: Zipf exponent for dcb_names
+  long dcb_queries;                    // -n: queries drawn from dcb_names
+  int dcb_conns;                       // -c: concurrent connections
+  int dcb_pipe;                        // -p: queries per batch on kept-alive connections, 0 for
+                                       //   one query per connection
+  int dcb_timeout;                     // -w: ms each reply may take, from the one before it
+} dhtc_benchopts;
+
+extern void dhtc_mkquery(iqry_t *iqry, char *imagename, unsigned int tag, long offset);
+extern int dhtc_bench(dhtc_benchopts *opts);
+
+#endif /* __DHTCBENCH_H__ */
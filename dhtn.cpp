@@ -21,6 +21,7 @@
 #include <stdlib.h>		// atoi()
 #include <assert.h>		// assert()
 #include <limits.h>		// LONG_MAX
+#include <pthread.h>
 #include <iostream>
 using namespace std;
 #ifdef _WIN32
@@ -45,6 +46,11 @@ using namespace std;
 
 #include "ltga.h"
 #include "imgdb.h"
+#include "imgcodec.h"
+#include "imgsend.h"
+#include "metrics.h"
+#include "trace.h"
+#include "nlog.h"
 
 #ifdef __APPLE__
 #include <GLUT/glut.h>
@@ -55,16 +61,19 @@ using namespace std;
 /**************************TOOL FUNCTIONS***************************/
 void dhtn_usage(char *progname) {
 	//TODO
-	fprintf(stderr, "Usage: %s [-p <FQDN:port> -I <nodeID> -i <imagefolder>]\n", progname);
+	fprintf(stderr, "Usage: %s [-p <FQDN:port> -I <nodeID> -i <imagefolder> -m <statsport> -t <every> -v]\n", progname);
 	exit(1);
 }
 
 /*
  * dhtn_args: parses command line args.
+ * With -m, *statsport is the port of the stats socket, see
+ * dhtn::statsinit(), else it is left alone.  Likewise *traceevery
+ * with -t, see dhtn::traceinit().  -v logs at NLOG_DEBUG, see nlog.h.
  */
 int dhtn_args(int argc, char * argv[], 
 	char ** cli_fqdn, u_short * cli_port, int * id,
-	char ** imgdb_folder) {
+	char ** imgdb_folder, int * statsport, int * traceevery) {
 	char c, *p;
 	extern char *optarg;
 	
@@ -74,7 +83,7 @@ int dhtn_args(int argc, char * argv[],
 	
 	*id = ((int) NETIMG_IDMAX) + 1;
 	
-	while ((c = getopt(argc, argv, "p:I:i:")) != EOF) {
+	while ((c = getopt(argc, argv, "p:I:i:m:t:v")) != EOF) {
 		switch (c) {
 		case 'p':
 			for ( p = optarg + strlen(optarg) - 1;
@@ -94,6 +103,17 @@ int dhtn_args(int argc, char * argv[],
 		case 'i':
 			*imgdb_folder = optarg;
 			break;
+		case 'm':
+			*statsport = atoi(optarg);
+			net_assert((*statsport < 0 || *statsport > 65535), "dhtn_args: stats port out of range");
+			break;
+		case 't':
+			*traceevery = atoi(optarg);
+			net_assert((*traceevery <= 0), "dhtn_args: trace sampling must be positive");
+			break;
+		case 'v':
+			nlog_setlevel(NLOG_DEBUG);
+			break;
 		default:
 			return 1;
 			break;
@@ -116,78 +136,8 @@ int recvbysize(int sd, char * buffer, unsigned int size) {
 	return recvd;
 }
 
-// Caller is responsible to release memory of md!
-unsigned char * getimgMD(char * fname) {
-	unsigned char * md = new unsigned char [SHA1_MDLEN];
-	SHA1((unsigned char *) fname, strlen(fname), md);
-	return md;
-}
-
-unsigned char getimgID(char * fname) {
-	unsigned char * md = getimgMD(fname);
-	unsigned char id = ID(md);
-	delete [] md;
-	return id;
-}
-
-void mkmsg(dhtmsg_t * msg, int type, dhtnode_t * node, u_short ttl = DHTM_TTL) {
-	msg->dhtm_vers = NETIMG_VERS;
-	msg->dhtm_type = type;
-	msg->dhtm_ttl = htons(ttl);
-	if ( node ) {
-		memcpy((char *) &msg->dhtm_node, (char *) node, sizeof(dhtnode_t));
-	} else {
-		memset((char *) &msg->dhtm_node, 0, sizeof(dhtnode_t));
-	}
-	return;
-}
-
-void mksrch(dhtsrch_t * srch, int type, dhtnode_t * node, char * imgname) {
-	dhtmsg_t * msg = (dhtmsg_t *) srch;
-	mkmsg(msg, type, node);
-	
-	unsigned char imgID = getimgID(imgname);
-	srch->dhts_imgID = imgID;
-	
-	memcpy((char *) srch->dhts_name, imgname, NETIMG_MAXFNAME);
-	return;
-}
-
-void initFingers(dhtnode_t *self, dhtnode_t fingers[]) {
-	for ( int i = 0; i < DHTN_FINGERS+1; i++ ) {
-		memcpy((char *) &(fingers[i]), (char *) self, sizeof(dhtnode_t));
-	}
-	return;
-}
-
-void calcfID(unsigned char id, unsigned char fID[]) {
-	unsigned char pow = 1;
-	for ( int i = 0; i < DHTN_FINGERS; i++ ) {
-		fID[i] = (id + pow) % (NETIMG_IDMAX+1);
-		pow *= 2;
-	}
-	return;
-}
-
-int getForwardIdx(unsigned char selfID, unsigned char fID[], int joinID) {
-	int found = 0;
-	int idx = 0;
-	for ( int i = DHTN_FINGERS-1; i > 0 && !found; i-- ) {
-		if (ID_inrange(fID[i], selfID, joinID)) {
-			idx = i;
-			found = 1;
-		}
-	}
-	return idx;
-}
-
-void printFingers(dhtnode_t * self, dhtnode_t fingers[]) {
-	printf("***FINGER TABLE***\n");
-	printf("  self:\t\t%d\n", self->dhtn_ID);
-	for ( int i = 0; i < DHTN_FINGERS+1; i++ ) {
-		printf("  %d:\t\t%d\n", i, fingers[i].dhtn_ID);
-	}
-	return;
+unsigned long long tracestart(dhttrace_t * trace) {
+	return ((unsigned long long) ntohl(trace->dhtt_start[0]) << 32) | ntohl(trace->dhtt_start[1]);
 }
 
 /*********************IMPLEMENTATION OF DHTN************************/
@@ -243,6 +193,7 @@ void dhtn::setID(int id) {
 	net_assert(err, "dhtn::setID: gethostname");
 	
 	/* store the host's address and assigned port number in the "self" member variable */
+	self.dhtn_rsvd = 0;
 	self.dhtn_port = node.sin_port;
 	hp = gethostbyname(sname);
 	net_assert((hp == 0), "dhtn::setID: gethostbyname");
@@ -275,15 +226,32 @@ void dhtn::setID(int id) {
  * uninitialized (dhtn_port == 0).
  * Initialize member variables fqdn and port to provide command-line interface (cli) values.
  */
-dhtn::dhtn(int id, char *cli_fqdn, u_short cli_port, char * imagefolder) {
+dhtn::dhtn(int id, char *cli_fqdn, u_short cli_port, char * imagefolder) : dhtring(this) {
 	fqdn = cli_fqdn;
 	port = cli_port;
 	setID(id);
 	for ( int i = 0; i < DHTN_FINGERS+1; i++ ) {
 		fingers[i].dhtn_port = 0;
 	}
+	
+	nslots = dhtn_imgdb.bfsize();
+	for ( int i = 0; i < DHTN_NBRS; i++ ) {
+		nbrs[i].nbs_time = 0;
+		nbrs[i].nbs_bits = new unsigned char [nslots/8];
+	}
+	smry_last = 0;
+	smry_gen = dhtn_imgdb.generation();
+	memset(&search_req, 0, sizeof(imgsend_req));
+	search_req.isr_codecs = NETIMG_CODEC_RAW;
+	search_sd = -1;
+	nclients = 0;
+	nwaiting = 0;
+	metrics_sd = -1;
+	trace_every = trace_count = 0;
+	wake_us = 0;
 
 	//dhtn_imgdb.setfolder(imagefolder);
+	dhtn_imgdb.watch();
 	
 	return;
 }
@@ -315,9 +283,10 @@ void dhtn::reID() {
  * to connect to the known host whose fqdn is stored as a member variable. The port given
  * must be in network byte order.
  *
- * Upon successful return, return the connected socket.
+ * Upon successful return, return the connected socket. If the connection fails, terminate
+ * the process, unless "mustconn" is 0, in which case return -1.
  */
-int dhtn::connremote(struct in_addr *addr, u_short portnum) {
+int dhtn::connremote(struct in_addr *addr, u_short portnum, int mustconn) {
 	int err, sd;
 	struct sockaddr_in remote;
 	struct hostent *rp;
@@ -341,6 +310,10 @@ int dhtn::connremote(struct in_addr *addr, u_short portnum) {
 	
 	/* connect to remote host */
 	err = connect(sd, (struct sockaddr *) &remote, sizeof(struct sockaddr_in));
+	if ( err && !mustconn ) {
+		close(sd);
+		return -1;
+	}
 	net_assert(err, "dhtn::connremote: connect");
 	
 	return sd;
@@ -394,209 +367,373 @@ int dhtn:: acceptconn() {
 	net_assert(err, "dhtn::acceptconn: setsockopt SO_LINGER");
 	
 	/* inform user of connection */
-	cp = gethostbyaddr((char *) &sender.sin_addr, sizeof(struct in_addr), AF_INET);
-	fprintf(stderr, "Connected from node %s:%d\n",
-		((cp && cp->h_name) ? cp->h_name : inet_ntoa(sender.sin_addr)),
-		ntohs(sender.sin_port));
+	if ( nlog_on(NLOG_DEBUG) ) {
+		cp = gethostbyaddr((char *) &sender.sin_addr, sizeof(struct in_addr), AF_INET);
+		nlog(NLOG_DEBUG, "Connected from node %s:%d\n",
+			((cp && cp->h_name) ? cp->h_name : inet_ntoa(sender.sin_addr)),
+			ntohs(sender.sin_port));
+	}
 	
 	return td;
 }
 
-/* forward based on provided id (which is either node ID for a
- * join message or image ID for a searcj message). The second
- * argument could actually be a pointer to a dhtsrch_t that is cast
- * to a dhtmsg_t. So the third argument tells the actual size of
- * the packet pointed to by the second argument.
+/*
+ * xsend: send "msg" to node "to" on a new connection, see dhtxport.
+ * Terminates process if the message can't be sent once connected.
  */
-void dhtn::forward(unsigned char id, dhtmsg_t * dhtmsg, int size) {
-	//cout << "entering dhtn::forward()...\n";
-	//TODO: subject to change
-	/* First check whether we expect the joining node's ID, as contained
-	 * in the JOIN message, to fall within the range (self.dhtn_ID, 
-	 * fingers[0].dhtn_ID]. If so, we inform the node we are sending
-	 * the JOIN message to that we expect it to be our successor. We do
-	 * this by setting the highest bit in the type field of the message
-	 * using DHTM_ATLOC. */
-	if ( ntohs(dhtmsg->dhtm_ttl) == 0 ) {
-		printf("ttl = 0, canceling forward...\n");
-		return;
-	}
-	
-	int err;
+int dhtn::xsend(dhtnode_t * to, void * msg, int len, dhtmsg_t * redrt) {
+	int err, recvd = 0;
 	
-	dhtmsg->dhtm_ttl = htons(ntohs(dhtmsg->dhtm_ttl)-1);
-	
-	int j = 0;
-	if (ID_inrange(id, self.dhtn_ID, fingers[0].dhtn_ID)) {
-		dhtmsg->dhtm_type |= DHTM_ATLOC;
-	} else {
-		//TODO
-		/* instead of simply forwarding to the successor node, first find the 
-		 * largetst index, j, for which joining node's ID <= fID[j] < the node's
-		 * ID, in modulo arithmetic */
-		j = getForwardIdx(self.dhtn_ID, fID, id);
-	}
-	printf("forwarding to node %d...\n", fingers[j].dhtn_ID);
-	int sd = connremote(&(fingers[j].dhtn_addr), fingers[j].dhtn_port);
-	err = send(sd, (char *) dhtmsg, (unsigned int) size, 0);
-	net_assert((err != (unsigned int) size), "dhtn::forward: send");
-	
-	/* After we've forwarded the message along, we don't immediately close
-	 * the connection as usual. Instead, we wait for any DHTM_REDRT message
-	 * telling us that we have overshot in our range expectation (see the
-	 * third case in dhtn::handlejoin()). Such a message comes with a 
-	 * suggested new successor, we copy this suggested new successor to 
-	 * our fingers[0] and try to forward the JOIN message again to the 
-	 * new successor. We repeat this until we stop getting DHTM_REDRT
-	 * message. */
-	dhtmsg_t redrtmsg;
-	int recvd = recvbysize(sd, (char *) &redrtmsg, sizeof(dhtmsg_t));
-	close(sd);
-	if ( recvd > 0 ) {
-		printf("receive redrtmsg...\n");
-		//TODO
-		/* instead of saving the returned node as the new successor, we save it 
-		 * in finger[j] */
-		memcpy((char *) &fingers[j], (char *) &redrtmsg.dhtm_node, sizeof(dhtnode_t));
-		fixup(j);
-		fixdn(j);
-		
-		//printFingers(&self, fingers);
-		forward(id, dhtmsg, size);
+	int sd = connremote(&to->dhtn_addr, to->dhtn_port, 0);
+	if ( sd < 0 ) {
+		return -1;
 	}
-	
+	err = send(sd, (char *) msg, len, 0);
+	net_assert((err != len), "dhtn::xsend: send");
+	if ( redrt ) {
+		recvd = recvbysize(sd, (char *) redrt, sizeof(dhtmsg_t));
+		if ( recvd <= 0 ) {
+			return 0;	// recvbysize() closed sd
+		}
+	}
+	close(sd);
+	return recvd > 0;
+}
+
+/* xreply: answer on the connection "sender" the message came in on */
+void dhtn::xreply(int sender, dhtmsg_t * msg) {
+	int err = send(sender, (char *) msg, sizeof(dhtmsg_t), 0);
+	net_assert((err != sizeof(dhtmsg_t)), "dhtn::xreply: send");
 	return;
 }
 
-void dhtn::handlejoin(int sender, dhtmsg_t *dhtmsg) {
-	//cout << "entering dhtn::handlejoin()...\n";
-	//printFingers(&self, fingers);
+void dhtn::xrelease(int sender) {
+	close(sender);
+	return;
+}
+
+/* have: whether the image is in our local database or has been cached */
+int dhtn::have(dhtsrch_t * srch) {
+	return dhtn_imgdb.searchdb(srch->dhts_name) > 0;
+}
+
+/*
+ * shortcut: before forwarding, see whether our neighbors' summaries
+ * already tell us the answer or who has the image.
+ */
+int dhtn::shortcut(int sender, dhtsrch_t * dhtsrch) {
+	dhtnode_t * originator = &(dhtsrch->dhts_msg.dhtm_node);
+	dhtnode_t * holder;
 	
-	/* First check if the joining node's ID collides with predecessor or
-	 * self. If so, send back to joining node a REID message. */
-	int err;
-	dhtnode_t * joining = &(dhtmsg->dhtm_node);
-	dhtnode_t * pred = &(fingers[DHTN_FINGERS]);
-	if ( joining->dhtn_ID == self.dhtn_ID || joining->dhtn_ID == pred->dhtn_ID ) {
+	switch ( nbrsearch(dhtsrch->dhts_imgID, dhtsrch->dhts_name, &holder) ) {
+	case DHTN_NBRMISS:
 		close(sender);
-		
-		dhtmsg_t reidmsg;
-		mkmsg( &reidmsg, DHTM_REID, NULL );
-		
-		int sd = connremote(&(joining->dhtn_addr), joining->dhtn_port);
-		err = send(sd, (char *) &reidmsg, sizeof(dhtmsg_t), 0);
-		net_assert((err != sizeof(dhtmsg_t)), "dhtn::reud: send");
-		close(sd);
-		return;
+		nlog(NLOG_DEBUG, "sending rplymsg(MISS) from owner's summary...\n");
+		sendsrch(originator, DHTM_MISS, dhtsrch->dhts_name, ntohs(dhtsrch->dhts_msg.dhtm_ttl), dhtsrch);
+		return 1;
+	case DHTN_NBRHIT:
+		if ( !(originator->dhtn_rsvd & DHTN_JUMPED) ) {
+			close(sender);
+			tracebusy(dhtsrch);
+			jump(holder, dhtsrch);
+			return 1;
+		}
+		break;
+	default:
+		break;
 	}
+	return 0;
+}
+
+void dhtn::passing(dhtsrch_t * srch) {
+	tracebusy(srch);
+	return;
+}
+
+/* newrange: serve the images in our new range */
+void dhtn::newrange() {
+	dhtn_imgdb.reloaddb(fingers[DHTN_FINGERS].dhtn_ID, self.dhtn_ID);
+	return;
+}
+
+/*
+ * traceinit: trace one in "every" DHT searches we start, writing the
+ * traces to DHTN_TRACEFILE in the current folder when the search is
+ * answered.  Terminates process on error.
+ */
+void dhtn::traceinit(int every) {
+	char path[NETIMG_MAXFNAME];
 	
-	// wlcm the joining node
-	if ( ID_inrange(joining->dhtn_ID, pred->dhtn_ID, self.dhtn_ID) ) {
-		close(sender);
-		
-		dhtmsg_t wlcmmsg;
-		mkmsg( &wlcmmsg, DHTM_WLCM, &self );
-		
-		int sd = connremote( &joining->dhtn_addr, joining->dhtn_port);
-		printf("sending wlcmmsg...\n");
-		err = send(sd, (char *) &wlcmmsg, sizeof(dhtmsg_t), 0);
-		net_assert((err != sizeof(dhtmsg_t)), "dhtn:wlcm: send");
-		printf("sending pred node...\n");
-		err = send(sd, (char *) pred, sizeof(dhtnode_t), 0);
-		net_assert((err != sizeof(dhtnode_t)), "dhtn:wlcm: send");
-		
-		// updating predecessor, call fixdn
-		printf("updating pred node...\n");
-		memcpy((char *) pred, (char *) joining, sizeof(dhtnode_t));	
-		if ( self.dhtn_ID == fingers[0].dhtn_ID ) {
-			printf("updating succ node...\n");
-			memcpy((char *) &(fingers[0]), (char *) joining, sizeof(dhtnode_t));
-			fixup(0);
-		}
-		fixdn(DHTN_FINGERS);
-		
-		//printFingers(&self, fingers);
-		close(sd);
+	snprintf(path, sizeof(path), DHTN_TRACEFILE, self.dhtn_ID);
+	net_assert(trace_open(path), "dhtn::traceinit: trace_open");
+	trace_every = every;
+	fprintf(stderr, "Tracing 1 in %d DHT searches to %s\n", every, path);
+	return;
+}
+
+/*
+ * tracehop: add us to the hops of the traced QUERY "dhtsrch", as
+ * having read it just now, after it waited since select() returned.
+ */
+void dhtn::tracehop(dhtsrch_t * dhtsrch) {
+	dhttrace_t * trace = srchtrace(dhtsrch);
+	if ( !trace || trace->dhtt_nhops >= DHTT_MAXHOPS ) {
 		return;
 	}
 	
-	// redrt the sender
-	if ( dhtmsg->dhtm_type & DHTM_ATLOC ) {
-		dhtmsg_t redrtmsg;
-		mkmsg( &redrtmsg, DHTM_REDRT, pred );
-		err = send(sender, (char *) &redrtmsg, sizeof(dhtmsg_t), 0);
-		net_assert((err != sizeof(dhtmsg_t)), "dhtn:redrt: send");
-		close(sender);
+	unsigned long long now = trace_now();
+	dhthop_t * hop = &trace->dhtt_hops[trace->dhtt_nhops++];
+	memset((char *) hop, 0, sizeof(dhthop_t));
+	hop->dhth_ID = self.dhtn_ID;
+	hop->dhth_recv = htonl((int) (now - tracestart(trace)));
+	hop->dhth_queue = htonl((unsigned int) (now - wake_us));
+	return;
+}
+
+/*
+ * tracebusy: record how long we have had the traced QUERY "dhtsrch",
+ * just before passing it on or answering it.  A forward() retried
+ * after a REDRT isn't included.
+ */
+void dhtn::tracebusy(dhtsrch_t * dhtsrch) {
+	dhttrace_t * trace = srchtrace(dhtsrch);
+	if ( !trace || !trace->dhtt_nhops ) {
 		return;
 	}
 	
-	// subject to change
-	close(sender);
-	forward(joining->dhtn_ID, dhtmsg, sizeof(dhtmsg_t));
+	dhthop_t * hop = &trace->dhtt_hops[trace->dhtt_nhops-1];
+	if ( hop->dhth_ID == self.dhtn_ID ) {
+		unsigned long long recv = tracestart(trace) + (int) ntohl(hop->dhth_recv);
+		hop->dhth_busy = htonl((unsigned int) (trace_now() - recv));
+	}
+	return;
+}
+
+/*
+ * writetrace: the traced search whose REPLY or MISS is "dhtsrch" is
+ * done, write it out: the search as a whole on thread 1 of our
+ * process, and, on thread 0 of each hop's node, how long the QUERY
+ * waited there and how long the node had it.  Each node is a process
+ * named after its ID.  The nodes' clocks may disagree.
+ */
+void dhtn::writetrace(dhtsrch_t * dhtsrch) {
+	dhttrace_t * trace = srchtrace(dhtsrch);
+	if ( !trace ) {
+		return;
+	}
 	
+	char name[NETIMG_MAXFNAME+16], args[128];
+	unsigned long long start = tracestart(trace), end = trace_now();
+	unsigned int id = ntohl(trace->dhtt_id);
+	int nhops = trace->dhtt_nhops < DHTT_MAXHOPS ? trace->dhtt_nhops : DHTT_MAXHOPS;
+	const char * result = dhtsrch->dhts_msg.dhtm_type == DHTM_REPLY ? "REPLY" : "MISS";
+	
+	dhtsrch->dhts_name[NETIMG_MAXFNAME-1] = '\0';
+	snprintf(name, sizeof(name), "node %d", self.dhtn_ID);
+	trace_process(self.dhtn_ID, name);
+	snprintf(name, sizeof(name), "search %s", dhtsrch->dhts_name);
+	snprintf(args, sizeof(args), "\"trace\":%u,\"result\":\"%s\",\"hops\":%d", id, result, nhops);
+	trace_span(name, self.dhtn_ID, 1, start, (long long) (end - start), args);
+	
+	snprintf(name, sizeof(name), "QUERY %s", dhtsrch->dhts_name);
+	for ( int i = 0; i < nhops; i++ ) {
+		dhthop_t * hop = &trace->dhtt_hops[i];
+		unsigned long long recv = start + (int) ntohl(hop->dhth_recv);
+		unsigned int queue = ntohl(hop->dhth_queue);
+		char pname[16];
+		
+		snprintf(pname, sizeof(pname), "node %d", hop->dhth_ID);
+		trace_process(hop->dhth_ID, pname);
+		snprintf(args, sizeof(args), "\"trace\":%u,\"hop\":%d", id, i+1);
+		trace_span("queue", hop->dhth_ID, 0, recv - queue, queue, args);
+		trace_span(name, hop->dhth_ID, 0, recv, ntohl(hop->dhth_busy), args);
+	}
+	trace_flush();
 	return;
 }
 
-// TODO
-void dhtn::handlesearch(int sender, dhtsrch_t * dhtsrch) {
+/*
+ * nbrsearch: look up imgname, whose ID is "id", in the summaries our
+ * neighbors have pushed to us in the last DHTN_SMRYTTL seconds.
+ * Returns DHTN_NBRHIT, with *holder pointing to the neighbor, if a
+ * summary may contain the image, preferring the neighbor whose range
+ * covers id.  Returns DHTN_NBRMISS if the summary of the neighbor whose
+ * range covers id says it doesn't have the image and no other summary
+ * does.  Otherwise returns DHTN_NBRUNKN, and the search goes on.
+ * Neighbors push a new summary as soon as their images change, see
+ * pushsmry(), else every DHTN_SMRYIVL seconds.  So only a summary from
+ * the last DHTN_MISSTTL seconds is taken to be the owner's current one
+ * and may answer a MISS; an older one may predate an image just added.
+ */
+int dhtn::nbrsearch(unsigned char id, char * imgname, dhtnode_t ** holder) {
+	int owner = 0, hit = -1;
+	time_t now = time(NULL);
+	unsigned char * md = getimgMD(imgname);
+	
+	for ( int i = 0; i < DHTN_NBRS; i++ ) {
+		if ( !nbrs[i].nbs_time || now - nbrs[i].nbs_time > DHTN_SMRYTTL ||
+		     nbrs[i].nbs_node.dhtn_ID == self.dhtn_ID ) {
+			continue;
+		}
+		int inrange = ID_inrange(id, nbrs[i].nbs_beg, nbrs[i].nbs_end);
+		if ( cbfilter::bmquery(nbrs[i].nbs_bits, nslots, md) ) {
+			if ( hit < 0 || inrange ) {
+				hit = i;
+			}
+		} else if ( inrange && now - nbrs[i].nbs_time <= DHTN_MISSTTL ) {
+			owner = 1;
+		}
+	}
+	delete [] md;
 	
-	//cout << "entering dhtn::handlesearch()...\n";
+	if ( hit >= 0 ) {
+		*holder = &nbrs[hit].nbs_node;
+		return DHTN_NBRHIT;
+	}
+	return owner ? DHTN_NBRMISS : DHTN_NBRUNKN;
+}
+
+/*
+ * pushsmry: send a summary of our imgdb and our ID range to each of
+ * our distinct fingers and our predecessor.  The summary is sent as a
+ * list of set slots when that is smaller than the bit vector, which
+ * is the usual case for small image DBs.  Neighbors that can't be
+ * reached are skipped.  Besides every DHTN_SMRYIVL seconds, it is
+ * called as soon as dhtn_imgdb.generation() changes, so that no
+ * neighbor answers a MISS for an image we have just been given.
+ */
+void dhtn::pushsmry() {
+	smry_last = time(NULL);
+	smry_gen = dhtn_imgdb.generation();
+	if ( !fingers[0].dhtn_port || self.dhtn_ID == fingers[0].dhtn_ID ) {
+		return;	// not on the circle yet, or alone on it
+	}
 	
-	int err;
-	unsigned char imgID = dhtsrch->dhts_imgID;
-	char * imgname = dhtsrch->dhts_name;
-	dhtnode_t * originator = &(dhtsrch->dhts_msg.dhtm_node);
-	dhtnode_t * pred = &(fingers[DHTN_FINGERS]);	
+	unsigned int nbytes = nslots/8, len, nset = 0;
+	unsigned char * bits = new unsigned char [nbytes];
+	unsigned char * payload = bits;
+	dhtn_imgdb.bfbitmap(bits);
+	for ( unsigned int i = 0; i < nslots; i++ ) {
+		nset += (bits[i >> 3] >> (i & 7)) & 1;
+	}
 	
-	printf("searching for image %s(%d)...\n", imgname, imgID);
-	if ( dhtn_imgdb.searchdb(imgname) > 0 ) {
-		// queried image is in local database or has been cached
-		close(sender);
-		
-		dhtsrch_t rplymsg;
-		mksrch( &rplymsg, DHTM_REPLY, NULL, imgname );
-		
-		int sd = connremote( &originator->dhtn_addr, originator->dhtn_port);
-		printf("sending rplymsg(REPLY)...\n");
-		err = send(sd, (char *) &rplymsg, sizeof(dhtsrch_t), 0);
-		net_assert((err != sizeof(dhtsrch_t)), "dhtn:reply: send");
-		
-		close(sd);
-		return;
+	dhtsmry_t smry;
+	mkmsg((dhtmsg_t *) &smry, DHTM_SMRY, &self);
+	smry.dhtb_beg = fingers[DHTN_FINGERS].dhtn_ID;
+	smry.dhtb_end = self.dhtn_ID;
+	smry.dhtb_flags = 0;
+	smry.dhtb_rsvd = 0;
+	smry.dhtb_nslots = htonl(nslots);
+	len = nbytes;
+	if ( nset*sizeof(u_int) < nbytes ) {
+		u_int * slots = (u_int *) new unsigned char [nset*sizeof(u_int)+1];
+		for ( unsigned int i = 0, j = 0; i < nslots; i++ ) {
+			if ( (bits[i >> 3] >> (i & 7)) & 1 ) {
+				slots[j++] = htonl(i);
+			}
+		}
+		payload = (unsigned char *) slots;
+		len = nset*sizeof(u_int);
+		smry.dhtb_flags |= DHTB_SPARSE;
 	}
+	smry.dhtb_len = htonl(len);
+	smry.dhtb_gen = htonl(smry_gen);
 	
-	if ( ID_inrange(imgID, pred->dhtn_ID, self.dhtn_ID) ) {
-		// queried image is within range but not found
-		close(sender);
-		
-		dhtsrch_t rplymsg;
-		mksrch( &rplymsg, DHTM_MISS, NULL, imgname );
-		
-		int sd = connremote( &originator->dhtn_addr, originator->dhtn_port);
-		printf("sending rplymsg(MISS)...\n");
-		err = send(sd, (char *) &rplymsg, sizeof(dhtsrch_t), 0);
-		net_assert((err != sizeof(dhtsrch_t)), "dhtn:reply: send");
-		
+	for ( int i = 0; i < DHTN_FINGERS+1; i++ ) {
+		int dup = (fingers[i].dhtn_ID == self.dhtn_ID || !fingers[i].dhtn_port);
+		for ( int j = 0; j < i && !dup; j++ ) {
+			dup = (fingers[j].dhtn_ID == fingers[i].dhtn_ID);
+		}
+		if ( dup ) {
+			continue;
+		}
+		int sd = connremote(&fingers[i].dhtn_addr, fingers[i].dhtn_port, 0);
+		if ( sd < 0 ) {
+			continue;
+		}
+		if ( send(sd, (char *) &smry, sizeof(dhtsmry_t), 0) == sizeof(dhtsmry_t) && len ) {
+			send(sd, (char *) payload, len, 0);
+		}
 		close(sd);
-		return;
 	}
 	
-	if ( dhtsrch->dhts_msg.dhtm_type & DHTM_ATLOC ) {
-		/* if the queried image ID is not within range, but the sender expected
-		 * it to be within range, send back a DHTM_REDRT message */
-		dhtmsg_t redrtmsg;
-		mkmsg( &redrtmsg, DHTM_REDRT, pred );
-		printf("sending redrtmsg...\n");
-		err = send(sender, (char *) &redrtmsg, sizeof(dhtmsg_t), 0);
-		net_assert((err != sizeof(dhtmsg_t)), "dhtn:redrt: send");
-		
+	if ( payload != bits ) {
+		delete [] payload;
+	}
+	delete [] bits;
+	return;
+}
+
+/*
+ * handlesmry: receive the rest of a SMRY message and keep it as the
+ * sender's summary, replacing its previous one, or the stalest one
+ * if we have no room.  Summaries of a different size than ours, or
+ * older than the sender's summary we have, e.g., a periodic one that
+ * was overtaken by one pushed on a change, are dropped.
+ */
+void dhtn::handlesmry(int sender, dhtmsg_t * dhtmsg) {
+	dhtsmry_t smry;
+	memcpy((char *) &smry, (char *) dhtmsg, sizeof(dhtmsg_t));
+	
+	int recvd = recvbysize(sender, (char *) &smry+sizeof(dhtmsg_t), sizeof(dhtsmry_t)-sizeof(dhtmsg_t));
+	if ( recvd <= 0 ) {
+		return;	// recvbysize has closed sender
+	}
+	
+	unsigned int nbytes = nslots/8;
+	unsigned int len = ntohl(smry.dhtb_len);
+	int sparse = smry.dhtb_flags & DHTB_SPARSE;
+	if ( ntohl(smry.dhtb_nslots) != nslots || len > nbytes ||
+	     (sparse ? len % sizeof(u_int) : len != nbytes) ) {
 		close(sender);
 		return;
 	}
 	
+	unsigned char * payload = new unsigned char [nbytes];
+	if ( len ) {
+		recvd = recvbysize(sender, (char *) payload, len);
+		if ( recvd <= 0 ) {
+			delete [] payload;
+			return;
+		}
+	}
 	close(sender);
-	forward(imgID, (dhtmsg_t *) dhtsrch, sizeof(dhtsrch_t));
 	
+	unsigned int gen = ntohl(smry.dhtb_gen);
+	int slot = 0;
+	for ( int i = 0; i < DHTN_NBRS; i++ ) {
+		if ( nbrs[i].nbs_time && nbrs[i].nbs_node.dhtn_ID == smry.dhtb_msg.dhtm_node.dhtn_ID ) {
+			if ( (int) (gen - nbrs[i].nbs_gen) < 0 ) {
+				delete [] payload;
+				return;
+			}
+			slot = i;
+			break;
+		}
+		if ( nbrs[i].nbs_time < nbrs[slot].nbs_time ) {
+			slot = i;
+		}
+	}
+	
+	dhtnbs_t * nbr = &nbrs[slot];
+	memcpy((char *) &nbr->nbs_node, (char *) &smry.dhtb_msg.dhtm_node, sizeof(dhtnode_t));
+	nbr->nbs_beg = smry.dhtb_beg;
+	nbr->nbs_end = smry.dhtb_end;
+	nbr->nbs_time = time(NULL);
+	nbr->nbs_gen = gen;
+	if ( sparse ) {
+		memset(nbr->nbs_bits, 0, nbytes);
+		for ( unsigned int i = 0; i < len/sizeof(u_int); i++ ) {
+			unsigned int idx = ntohl(((u_int *) payload)[i]);
+			if ( idx < nslots ) {
+				nbr->nbs_bits[idx >> 3] |= 1 << (idx & 7);
+			}
+		}
+	} else {
+		memcpy(nbr->nbs_bits, payload, nbytes);
+	}
+	
+	delete [] payload;
 	return;
 }
 
@@ -616,91 +753,81 @@ void dhtn::handlepkt(int sender) {
 		if (dhtmsg.dhtm_type == DHTM_REID) {
 			/* an ID collision has occurred */
 			net_assert(!fqdn, "dhtn::handlepkt: received reID but no known node");
-			fprintf(stderr, "\tReceived REID from node %d\n", dhtmsg.dhtm_node.dhtn_ID);
+			metrics_count(METRICS_REID);
+			nlog(NLOG_INFO, "\tReceived REID from node %d\n", dhtmsg.dhtm_node.dhtn_ID);
 			close(sender);
 			reID();
 			join();
 			
 		} else if (dhtmsg.dhtm_type & DHTM_WLCM) {
-			fprintf(stderr, "\tReceived WLCM from node %d\n", dhtmsg.dhtm_node.dhtn_ID);
-			// store successor node
-			printf("updating succ node...\n");
-			memcpy((char *) &(fingers[0]), (char *) &(dhtmsg.dhtm_node), sizeof(dhtnode_t));
-			fixup(0);
+			metrics_count(METRICS_WLCM);
+			nlog(NLOG_INFO, "\tReceived WLCM from node %d\n", dhtmsg.dhtm_node.dhtn_ID);
 			// receive predecessor node
-			printf("updating pred node...\n");
-			recvd = recvbysize(sender, (char *) &(fingers[DHTN_FINGERS]), sizeof(dhtnode_t));
+			dhtnode_t pred;
+			recvd = recvbysize(sender, (char *) &pred, sizeof(dhtnode_t));
 			net_assert((recvd <= 0), "dhtn::handlepkt: welcome recv pred");
-			fixdn(DHTN_FINGERS);
 			close(sender);
+			handlewlcm(&dhtmsg.dhtm_node, &pred);
 			
 			//printFingers(&self, fingers);
 			
 		} else if (dhtmsg.dhtm_type & DHTM_JOIN) {
 			net_assert(!(fingers[DHTN_FINGERS].dhtn_port && fingers[0].dhtn_port),
 				"dhtn::handlepkt: receive a JOIN when not yet integrated into the DHT.");
-			fprintf(stderr, "\tReceived JOIN (%d) from node %d\n",
+			metrics_count(METRICS_JOIN);
+			nlog(NLOG_INFO, "\tReceived JOIN (%d) from node %d\n",
 				ntohs(dhtmsg.dhtm_ttl), dhtmsg.dhtm_node.dhtn_ID);
 			handlejoin(sender, &dhtmsg);	// handlejoin is responsible for closing sender
 			
 		} else if ( dhtmsg.dhtm_type & DHTM_FIND ) {
 			
-			//TODO
-			/* when you receive a DHTM_FIND packet from a client, you first
-			 * search your local database and cache for the image */
 			iqry_t iqry;
 			memcpy((char *) &iqry, (char *) &dhtmsg, sizeof(dhtmsg_t));
 			
 			recvd = recvbysize(sender, (char *) &iqry+sizeof(dhtmsg_t), sizeof(iqry_t)-sizeof(dhtmsg_t));
 			net_assert((recvd <= 0), "dhtn::handlepkt: recv iqry");
-			
-			fprintf(stderr, "\tReceived FIND %s(%d) from client \n", iqry.iq_name, getimgID(iqry.iq_name));
-			search_sd = sender;
-			int found = dhtn_imgdb.searchdb(iqry.iq_name);
-			if ( found > 0 ) {
-				
-				printf("target found in local database...\n");
-				sendimg(found);	// sendimg is responsible for closing sender
-			
-			} else if ( self.dhtn_ID != fingers[0].dhtn_ID ) {
-				
-				dhtsrch_t srch;
-				mksrch(&srch, DHTM_QUERY, &self, iqry.iq_name);
-				unsigned char id = getimgID(iqry.iq_name);
-				forward(id, (dhtmsg_t *)&srch, sizeof(dhtsrch_t));	
-				
-				/*
-				 * Do not close sender until we receive a response
-				 */
-				
+			if ( search_sd >= 0 ) {
+				waitfind(sender, &iqry);	// search_sd is still waiting for its reply
 			} else {
-				
-				sendimg(0);
+				handlefind(sender, &iqry);
 			}
 		
 		} else if ( dhtmsg.dhtm_type == DHTM_MISS ) {	
 			
 			//TODO
+			metrics_count(METRICS_MISS);
+			metrics_observe(METRICS_HOPS, DHTM_TTL - ntohs(dhtmsg.dhtm_ttl));
+			if ( dhtmsg.dhtm_node.dhtn_rsvd & DHTN_TRACED ) {
+				dhtxsrch_t miss;
+				memcpy((char *) &miss, (char *) &dhtmsg, sizeof(dhtmsg_t));
+				recvd = recvbysize(sender, (char *) &miss+sizeof(dhtmsg_t), sizeof(dhtxsrch_t)-sizeof(dhtmsg_t));
+				net_assert((recvd <= 0), "dhtn::handlepkt: recv miss");
+				writetrace(&miss.dhtx_srch);
+			}
 			close(sender);
 			sendimg(0);
 			
 		} else if ( dhtmsg.dhtm_type == DHTM_REPLY ) {
 			
 			//TODO
-			dhtsrch_t rply;
+			dhtxsrch_t xrply;
+			dhtsrch_t &rply = xrply.dhtx_srch;
 			memcpy((char *) &rply, (char *) &dhtmsg, sizeof(dhtmsg_t));
 			
-			recvd = recvbysize(sender, (char *) &rply+sizeof(dhtmsg_t), sizeof(dhtsrch_t)-sizeof(dhtmsg_t));
+			recvd = recvbysize(sender, (char *) &rply+sizeof(dhtmsg_t), srchlen(&rply)-sizeof(dhtmsg_t));
 			net_assert((recvd <= 0), "dhtn::handlepkt: recv reply");
 			
-			fprintf(stderr, "\tReceived REPLY of image %s\n", rply.dhts_name);
+			nlog(NLOG_INFO, "\tReceived REPLY of image %s\n", rply.dhts_name);
+			metrics_count(METRICS_REPLY);
+			metrics_observe(METRICS_HOPS, DHTM_TTL - ntohs(dhtmsg.dhtm_ttl));
 			close(sender);
+			writetrace(&rply);
 			
-			// cache the queried image into local database
-			//TODO How do you know that imgdb_size has not exceeded imgdb_maxdbsize?
+			// cache the queried image into local database, evicting the
+			// least recently used cached image if the cache is full
 			unsigned char * md = getimgMD(rply.dhts_name);
 			unsigned char id = getimgID(rply.dhts_name);
-			dhtn_imgdb.loadimg(id, md, rply.dhts_name);
+			dhtn_imgdb.cacheimg(id, md, rply.dhts_name);
 			dhtn_imgdb.readimg(rply.dhts_name);
 			delete [] md;
 			sendimg(1);
@@ -708,17 +835,24 @@ void dhtn::handlepkt(int sender) {
 		} else if ( dhtmsg.dhtm_type & DHTM_QUERY ) {
 			
 			//TODO
-			dhtsrch_t srch;
+			dhtxsrch_t srch;
 			memcpy((char *) &srch, (char *) &dhtmsg, sizeof(dhtmsg_t));
 			
-			recvd = recvbysize(sender, (char *) &srch+sizeof(dhtmsg_t), sizeof(dhtsrch_t)-sizeof(dhtmsg_t));
+			recvd = recvbysize(sender, (char *) &srch+sizeof(dhtmsg_t), srchlen(&srch.dhtx_srch)-sizeof(dhtmsg_t));
 			net_assert((recvd <= 0), "dhtn::handlepkt: recv dhtsrch");
 			
-			fprintf(stderr, "\tReceived QUERY(%d) from node %d\n",
+			metrics_count(METRICS_QUERY);
+			nlog(NLOG_INFO, "\tReceived QUERY(%d) from node %d\n",
 				ntohs(dhtmsg.dhtm_ttl), dhtmsg.dhtm_node.dhtn_ID);
-			handlesearch(sender, &srch);	// handlesearch is responsible for closing sender
+			tracehop(&srch.dhtx_srch);
+			handlesearch(sender, &srch.dhtx_srch);	// handlesearch is responsible for closing sender
 
 
+		} else if ( dhtmsg.dhtm_type == DHTM_SMRY ) {
+			
+			metrics_count(METRICS_SMRY);
+			handlesmry(sender, &dhtmsg);	// handlesmry is responsible for closing sender
+			
 		} else {
 			net_assert((dhtmsg.dhtm_type & DHTM_REDRT),
 				"dhtn::handlepkt: overshoot message received out of band");
@@ -729,116 +863,265 @@ void dhtn::handlepkt(int sender) {
 	return;
 }
 
-// TODO
-void dhtn::fixup(int idx) {
-	// just follow the instruction, totally no idea...
-	//cout << "entering dhtn::fixup()...\n";
-	int stop = 0;
-	for ( int k = idx+1; k < DHTN_FINGERS && !stop; k++ ) {
-		if (ID_inrange(fID[k], self.dhtn_ID, fingers[idx].dhtn_ID)) {
-			memcpy((char *) &(fingers[k]), (char *) &(fingers[idx]), sizeof(dhtnode_t));
+/* handlefind: handle the image query "iqry" from the client on socket
+ * "sender".  We first search our local database and cache for the
+ * image, then the DHT.  The socket is kept for the reply, see
+ * donesearch().
+ */
+void dhtn::handlefind(int sender, iqry_t *iqry) {
+	nlog(NLOG_INFO, "\tReceived FIND %s(%d) from client \n", iqry->iq_name, getimgID(iqry->iq_name));
+	metrics_count(METRICS_FIND);
+	search_sd = sender;
+	search_req.isr_codecs = iqry->iq_codecs;
+	search_req.isr_flags = iqry->iq_flags;
+	dhtn_imgdb.setfit(ntohs(iqry->iq_maxwidth), ntohs(iqry->iq_maxheight));
+	search_req.isr_tag = ntohl(iqry->iq_tag);
+	search_req.isr_off = ntohl(iqry->iq_offset);
+	search_req.isr_len = ntohl(iqry->iq_length);
+	search_req.isr_id = iqry->iq_id;
+	int found = dhtn_imgdb.searchdb(iqry->iq_name);
+	if ( found > 0 ) {
+		
+		nlog(NLOG_DEBUG, "target found in local database...\n");
+		sendimg(found);	// sendimg is responsible for closing sender, see donesearch()
+	
+	} else if ( self.dhtn_ID != fingers[0].dhtn_ID ) {
+		
+		dhtxsrch_t xsrch;
+		dhtsrch_t &srch = xsrch.dhtx_srch;
+		mksrch(&srch, DHTM_QUERY, &self, iqry->iq_name);
+		if ( trace_every && trace_count++ % trace_every == 0 ) {
+			/* sampled: IDs are unique per originator until they wrap */
+			unsigned long long now = trace_now();
+			memset((char *) &xsrch.dhtx_trace, 0, sizeof(dhttrace_t));
+			xsrch.dhtx_trace.dhtt_id = htonl(((unsigned int) self.dhtn_ID << 24) | (trace_count & 0xffffff));
+			xsrch.dhtx_trace.dhtt_start[0] = htonl((unsigned int) (now >> 32));
+			xsrch.dhtx_trace.dhtt_start[1] = htonl((unsigned int) now);
+			srch.dhts_msg.dhtm_node.dhtn_rsvd |= DHTN_TRACED;
+		}
+		unsigned char id = getimgID(iqry->iq_name);
+		dhtnode_t * holder;
+		int nbr = nbrsearch(id, iqry->iq_name, &holder);
+		if ( ID_inrange(id, fingers[DHTN_FINGERS].dhtn_ID, self.dhtn_ID) ) {
+			nlog(NLOG_DEBUG, "target in our own range but not found...\n");
+			sendimg(0);
+		} else if ( nbr == DHTN_NBRMISS ) {
+			nlog(NLOG_DEBUG, "owner's summary says target isn't on the DHT...\n");
+			sendimg(0);
+		} else if ( nbr == DHTN_NBRHIT ) {
+			jump(holder, &srch);
 		} else {
-			stop = 1;
+			forward(id, (dhtmsg_t *)&srch, srchlen(&srch));
 		}
+		
+		/*
+		 * Do not close sender until we receive a response
+		 */
+		
+	} else {
+		
+		sendimg(0);
 	}
-	//printFingers(&self, fingers);
+	
 	return;
 }
 
-// TODO
-void dhtn::fixdn(int idx) {
-	//cout << "entering dhtn::fixdn()...\n";
-	for ( int k = idx-1; k >= 0; k-- ) {
-		if (ID_inrange(fingers[idx].dhtn_ID, fID[k], fingers[k].dhtn_ID)) {
-			memcpy((char *) &(fingers[k]), (char *) &(fingers[idx]), sizeof(dhtnode_t));
-		}
+/* handleclient: receive the next query on kept-alive client socket
+ * clients[idx], see NETIMG_KEEPALIVE.  The client may have sent
+ * several queries back to back; they wait in the socket until the
+ * reply to the one before is sent.  A client closing the connection,
+ * or sending anything but a query, is dropped.
+ */
+void dhtn::handleclient(int idx) {
+	iqry_t iqry;
+	int sender = clients[idx];
+	
+	clients[idx] = clients[--nclients];
+	int recvd = recvbysize(sender, (char *) &iqry, sizeof(iqry_t));
+	if ( recvd <= 0 ) {
+		return;		// recvbysize() closed sender
 	}
-	if ( idx == DHTN_FINGERS ) {
-		dhtn_imgdb.reloaddb(fingers[idx].dhtn_ID, self.dhtn_ID);
+	if ( iqry.iq_vers != NETIMG_VERS || !(iqry.iq_type & DHTM_FIND) ) {
+		close(sender);
+		return;
 	}
-	//printFingers(&self, fingers);
+	iqry.iq_name[NETIMG_MAXFNAME-1] = '\0';
+	handlefind(sender, &iqry);
+	return;
+}
+
+/* waitfind: hold the query "iqry" from the new connection "sender"
+ * until the search in progress is done, see mainloop().  If
+ * DHTN_MAXWAITING queries are already waiting, answer it with a miss
+ * right away instead.
+ */
+void dhtn::waitfind(int sender, iqry_t *iqry) {
+	imsg_t imsg;
+	int bytes;
+	
+	if ( nwaiting < DHTN_MAXWAITING ) {
+		waiting[nwaiting].dw_sd = sender;
+		memcpy((char *) &waiting[nwaiting].dw_iqry, (char *) iqry, sizeof(iqry_t));
+		nwaiting++;
+		return;
+	}
+	
+	nlog(NLOG_WARN, "dhtn::waitfind: too many queries waiting, refusing %s\n", iqry->iq_name);
+	memset(&imsg, 0, sizeof(imsg_t));
+	imsg.im_vers = NETIMG_VERS;
+	imsg.im_id = iqry->iq_id;
+	bytes = send(sender, (char *) &imsg, sizeof(imsg_t), 0);
+	if ( bytes != sizeof(imsg_t) ) {
+		perror("dhtn::waitfind: send imsg");
+	}
+	close(sender);
+	return;
+}
+
+/* donesearch: the reply on search_sd has been sent.  Keep the
+ * connection for the client's next query if it asked for it and we
+ * have room, else close it.
+ */
+void dhtn::donesearch() {
+	if ( (search_req.isr_flags & NETIMG_KEEPALIVE) && nclients < DHTN_MAXCLIENTS ) {
+		clients[nclients++] = search_sd;
+	} else {
+		close(search_sd);
+	}
+	search_sd = -1;
 	return;
 }
 
 // TODO
 /*
- * sendimg: send the image to the client
- * First send the specifics of the iamges (width, height, etc.)
- * in an imsg_t packet to the client. The type imsg_t is defined in netimg.h.
- * If "found" is > 0, send the image contained in imgdb. Otherwise, set the
- * img_depth field of the imsg_t packet to 0 and send only the imsg_t packet.
- * For debugging purposes if an image is send, it is send in chunks of segsize
- * instead of as one single image. We're going to send the image slowly, one
- * chunk for every NETIMG_USLEEP microseconds.
+ * sendimg: send the image to the client on search_sd, as it asked in
+ * its query, see imgsend().  If "found" is > 0, send the image contained
+ * in imgdb, else only an imsg_t with im_depth 0.
+ * For debugging purposes the image is sent in chunks, one chunk for
+ * every NETIMG_USLEEP microseconds.  The connection is then closed, or
+ * kept for the client's next query, see donesearch().
  *
  * Terminate process upon encountering any error.
- * Doesn't otherwise modify anything
  */
 void dhtn::sendimg(int found) {
-	int segsize;
-	char * ip;
-	int bytes;
-	long left;
-	imsg_t imsg;
-	double imgdsize;
-	long imgsize = 0L;
-	
-	imsg.im_vers = NETIMG_VERS;
+	imgsend(search_sd, &search_req, &dhtn_imgdb, found, NETIMG_USLEEP);
+	donesearch();
+	return;
+}
+
+// TODO
+void dhtn::sendREDRT(int sender, dhtmsg_t * dhtmsg, int size) {
+
+}
+
+/*
+ * statsinit: serve our metrics, see metrics.h, on a socket bound to
+ * the loopback address at "port", or an ephemeral port if 0, from a
+ * thread of its own, see statsthread().
+ * Terminates process on error.
+ */
+void dhtn::statsinit(int port) {
+	int err, on = 1;
+	struct sockaddr_in stats;
+	socklen_t len = sizeof(struct sockaddr_in);
+	pthread_t tid;
+	
+	metrics_sd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	net_assert((metrics_sd < 0), "dhtn::statsinit: socket");
+	setsockopt(metrics_sd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on));
+	
+	memset((char *) &stats, 0, sizeof(struct sockaddr_in));
+	stats.sin_family = AF_INET;
+	stats.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	stats.sin_port = htons((u_short) port);
+	err = bind(metrics_sd, (struct sockaddr *) &stats, sizeof(struct sockaddr_in));
+	net_assert(err, "dhtn::statsinit: bind");
+	err = listen(metrics_sd, NETIMG_QLEN);
+	net_assert(err, "dhtn::statsinit: listen");
+	err = getsockname(metrics_sd, (struct sockaddr *) &stats, &len);
+	net_assert(err, "dhtn::statsinit: getsockname");
+	err = pthread_create(&tid, NULL, statsthread, this);
+	net_assert(err, "dhtn::statsinit: pthread_create");
+	pthread_detach(tid);
+	
+	fprintf(stderr, "Metrics at 127.0.0.1:%d\n", ntohs(stats.sin_port));
+	return;
+}
+
+/*
+ * statsthread: answer connections on the stats socket of dhtn "arg",
+ * one at a time, for as long as the node runs.  Scrapes, and waiting
+ * on clients that send nothing, never hold up mainloop(); the metrics
+ * themselves are safe to read from any thread.
+ */
+void * dhtn::statsthread(void * arg) {
+	dhtn * node = (dhtn *) arg;
 	
-	if ( found <= 0 ) {
-		if ( !found ) {
-			cerr << "Bloom filter missed." << endl;
-		} else {
-			cerr << "Bloom filter false positive." << endl;
+	for ( ;; ) {
+		node->servemetrics();
+	}
+	return NULL;
+}
+
+/*
+ * servemetrics: answer a connection on the stats socket with our
+ * metrics, in the Prometheus text format.  A scraper's HTTP GET gets
+ * an HTTP response; any other client, e.g., nc, that sends nothing
+ * within DHTN_STATSWAIT usecs gets the bare text.
+ */
+void dhtn::servemetrics() {
+	char req[1024], hdr[128];
+	int sd, bytes, got = 0;
+	long sent;
+	struct timeval tv;
+	string body, resp;
+	
+	sd = accept(metrics_sd, NULL, NULL);
+	if ( sd < 0 ) {
+		return;
+	}
+	tv.tv_sec = 0;
+	tv.tv_usec = DHTN_STATSWAIT;
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv));
+	req[0] = '\0';
+	while ( got < (int) sizeof(req)-1 &&
+		(bytes = recv(sd, req+got, sizeof(req)-1-got, 0)) > 0 ) {
+		got += bytes;
+		req[got] = '\0';
+		if ( strstr(req, "\r\n\r\n") || strstr(req, "\n\n") ) {
+			break;
 		}
-		imsg.im_depth = (unsigned char) 0;
-	} else {
-		imgdsize = dhtn_imgdb.marshall_imsg(&imsg);
-		net_assert((imgdsize > (double) LONG_MAX), "dhtn::sendimg: image too large");
-		imgsize = (long) imgdsize;
-		
-		imsg.im_width = htons(imsg.im_width);
-		imsg.im_height = htons(imsg.im_height);
-		imsg.im_format = htons(imsg.im_format);
 	}
 	
-	/*
-	 * Send the imsg packet to client connected to socket search_sd
-	 */
-	bytes = send(search_sd, (char *) &imsg, sizeof(imsg_t), 0);
-	net_assert((bytes != sizeof(imsg_t)), "dhtn::sendimg: send imsg");
-	
-	if ( found > 0 ) {
-		segsize = imgsize/NETIMG_NUMSEG;	/* compute segment size */
-		segsize = segsize < NETIMG_MSS ? NETIMG_MSS : segsize;	/* but don't let segment be too small */
-		ip = dhtn_imgdb.getimage();	/* ip points to the start of byte buffer holding image */
-		for ( left = imgsize; left; left -= bytes ) {
-			bytes = send(search_sd, (char *) ip, segsize > left ? left : segsize, 0);
-			net_assert((bytes < 0), "dhtn::sendimg: send image");
-			ip += bytes;
-			fprintf(stderr, "dhtn::sendimg: size %d, sent %d\n", (int) left, bytes);
-			usleep(NETIMG_USLEEP);
+	metrics_expose(&body);
+	if ( !strncmp(req, "GET ", 4) ) {
+		snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %lu\r\n\r\n", (unsigned long) body.size());
+		resp = hdr;
+	}
+	resp += body;
+	for ( sent = 0; sent < (long) resp.size(); sent += bytes ) {
+		bytes = send(sd, resp.data()+sent, resp.size()-sent, 0);
+		if ( bytes <= 0 ) {
+			break;
 		}
 	}
-	
-	close(search_sd);
+	close(sd);
 	return;
 }
 
-// TODO
-void dhtn::sendREDRT(int sender, dhtmsg_t * dhtmsg, int size) {
-
-}
-
 /*
  * This is main loop of dhtn node. It sets up the read set, call select,
  * and handles input on the stdin and connection and packet arriving on
- * the listen_sd socket.
+ * the listen_sd socket. Every DHTN_SMRYIVL seconds, and as soon as our
+ * images change, it also pushes our imgdb summary to our neighbors.
  */
 int dhtn::mainloop() {
 	char c;
 	fd_set rset;
 	int err, sender;
+	struct timeval timeout;
 	
 	/* set up and call select */
 	FD_ZERO(&rset);
@@ -846,9 +1129,32 @@ int dhtn::mainloop() {
 #ifndef _WIN32
 	FD_SET(STDIN_FILENO, &rset);	// wait for input from std input
 #endif
+	int maxsd = listen_sd;
+	for ( int i = 0; search_sd < 0 && i < nclients; i++ ) {
+		/* a kept-alive client's next query waits for the reply in progress */
+		FD_SET(clients[i], &rset);
+		maxsd = clients[i] > maxsd ? clients[i] : maxsd;
+	}
+	int watchfd = dhtn_imgdb.watchfd();	// image folder changes
+	if ( watchfd >= 0 ) {
+		FD_SET(watchfd, &rset);
+		maxsd = watchfd > maxsd ? watchfd : maxsd;
+	}
+	time_t due = smry_last + DHTN_SMRYIVL - time(NULL);	// next push, see nbrsearch()
+	timeout.tv_sec = due > 0 ? due : 0;
+	timeout.tv_usec = 0;
+	
+	err = select(maxsd+1, &rset, 0, 0, &timeout);
+	net_assert((err < 0), "dhtn::mainloop: select error");
+	wake_us = trace_now();
+	
+	if ( watchfd >= 0 && FD_ISSET(watchfd, &rset) ) {
+		dhtn_imgdb.handlewatch();
+	}
 	
-	err = select(listen_sd+1, &rset, 0, 0, 0);
-	net_assert((err <= 0), "dhtn::mainloop: select error");
+	if ( time(NULL) - smry_last >= DHTN_SMRYIVL || dhtn_imgdb.generation() != smry_gen ) {
+		pushsmry();
+	}
 	
 #ifndef _WIN32
 	if (FD_ISSET(STDIN_FILENO, &rset)) {
@@ -864,6 +1170,8 @@ int dhtn::mainloop() {
 					fID[i]%(NETIMG_IDMAX+1), fingers[i].dhtn_ID);
 			}
 			fprintf(stderr, "pred: %d\n", fingers[DHTN_FINGERS].dhtn_ID);
+		} else if (c == 'm') {
+			metrics_report(stderr);
 		}
 		fflush(stdin);
 	}
@@ -874,6 +1182,21 @@ int dhtn::mainloop() {
 		handlepkt(sender);
 	}
 	
+	/* clients are kept, or not, at the end of the list as their
+	   replies are sent, so going down visits each ready one once */
+	for ( int i = nclients-1; i >= 0; i-- ) {
+		if ( search_sd < 0 && i < nclients && FD_ISSET(clients[i], &rset) ) {
+			handleclient(i);
+		}
+	}
+	
+	/* queries that came on new connections during a search, in order */
+	while ( search_sd < 0 && nwaiting ) {
+		dhtwait_t next = waiting[0];
+		memmove((char *) &waiting[0], (char *) &waiting[1], (--nwaiting)*sizeof(dhtwait_t));
+		handlefind(next.dw_sd, &next.dw_iqry);
+	}
+	
 	return 1;
 }	
 
@@ -882,6 +1205,8 @@ int main( int argc, char * argv [] ) {
 	u_short cli_port;
 	char * imagefolder = NULL;
 	int id, status;
+	int statsport = -1;
+	int traceevery = 0;
 		
 #ifdef _WIN32
 	WSADATA wsa;
@@ -895,11 +1220,17 @@ int main( int argc, char * argv [] ) {
 #endif
 	
 	/* parse args */
-	if (dhtn_args( argc, argv, &cli_fqdn, &cli_port, &id, &imagefolder)) {
+	if (dhtn_args( argc, argv, &cli_fqdn, &cli_port, &id, &imagefolder, &statsport, &traceevery)) {
 		dhtn_usage(argv[0]);
 	}
 
 	dhtn node(id, cli_fqdn, cli_port, imagefolder);	// initialize node, create listen socket
+	if ( statsport >= 0 ) {
+		node.statsinit(statsport);
+	}
+	if ( traceevery ) {
+		node.traceinit(traceevery);
+	}
 	
 	if ( cli_fqdn ) {
 		node.join();	// join DHT if known host given
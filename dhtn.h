@@ -20,83 +20,110 @@
 #ifndef __DHTN_H__
 #define __DHTN_H__
 
+#include <time.h>
 #include "hash.h"
 #include "imgdb.h"
+#include "imgsend.h"
+#include "dhtring.h"
 
 #define DHTN_UNINIT -1
-#define DHTN_FINGERS 8  // reaches half of 2^8-1
-                        // with integer IDs, fingers[0] is immediate successor
+#define DHTN_NBRS  (DHTN_FINGERS+1)  // summaries kept, one per finger and pred
+#define DHTN_SMRYIVL   5  // seconds between pushing our summary to neighbors
+#define DHTN_SMRYTTL  15  // neighbor summaries older than this are ignored
+#define DHTN_MISSTTL  (DHTN_SMRYIVL+1)  // nor trusted to say an image isn't there
+#define DHTN_NBRUNKN   0  // nbrsearch(): no fresh summary says anything
+#define DHTN_NBRMISS  -1  //   the owner's current summary says the image isn't there
+#define DHTN_NBRHIT    1  //   some neighbor's summary says it may be there
+#define DHTN_MAXCLIENTS 16  // kept-alive client connections, see NETIMG_KEEPALIVE
+#define DHTN_MAXWAITING 16  // FINDs waiting for the search in progress, see dhtn::waitfind()
+#define DHTN_STATSWAIT 200000 // usecs to wait for a stats client's request
+#define DHTN_TRACEFILE "dhtn%d.trace.json"  // by node ID, see traceinit()
 
-#define DHTM_TTL   10
-#define DHTM_JOIN  0x01
-#define DHTM_REID  0x02
-#define DHTM_WLCM  0x04
-#define DHTM_FIND 0x08   // image query from client, see netimg.h for iqry_t packet
-#define DHTM_QUERY 0x10   // image search on the DHT
-#define DHTM_REPLY 0x20   // reply to image search on the DHT
-#define DHTM_MISS  0x22   // image not found on the DHT 
-#define DHTM_REDRT 0x40
-#define DHTM_ATLOC 0x80
+#define DHTB_SPARSE 0x01    // payload is a list of set slots, not a bit vector
 
 typedef struct {
-  unsigned char dhtn_rsvd;
-  unsigned char dhtn_ID;
-  u_short dhtn_port;        // port#, always stored in network byte order
-  struct in_addr dhtn_addr; // IPv4 address
-} dhtnode_t;
+  dhtmsg_t dhtb_msg;            // dhtm_node is the sender
+  unsigned char dhtb_beg;       // sender's ID range (dhtb_beg, dhtb_end]
+  unsigned char dhtb_end;
+  unsigned char dhtb_flags;     // DHTB_SPARSE
+  unsigned char dhtb_rsvd;
+  unsigned int dhtb_nslots;     // filter size in slots, network byte order
+  unsigned int dhtb_len;        // bytes of payload following, network byte order
+  unsigned int dhtb_gen;        // sender's imgdb::generation(), network byte order
+} dhtsmry_t;                // used by SMRY, followed by the payload:
+                            // nslots/8 bytes of bit vector, or, if DHTB_SPARSE,
+                            // the index of each set slot, 4 bytes each in network byte order
 
 typedef struct {
-  unsigned char dhtm_vers;  // must be NETIMG_VERS
-  unsigned char dhtm_type;  // one of DHTM_{REDRT,JOIN,REID,WLCM} type
-  u_short dhtm_ttl;         // currently used only by JOIN and QUERY messages
-  dhtnode_t dhtm_node;      // REDRT: new successor
-                            // JOIN: node attempting to join DHT
-                            // REID: not used
-                            // WLCM: successor node, to be followed by predecessor node
-} dhtmsg_t;
+  dhtnode_t nbs_node;
+  unsigned char nbs_beg, nbs_end;  // neighbor's ID range (nbs_beg, nbs_end]
+  time_t nbs_time;                 // when received, 0 if unused
+  unsigned int nbs_gen;            // neighbor's imgdb::generation() then
+  unsigned char *nbs_bits;         // bit vector, see cbfilter::bitmap()
+} dhtnbs_t;
 
 typedef struct {
-  dhtmsg_t dhts_msg;                
-  unsigned char dhts_imgID;
-  char dhts_name[NETIMG_MAXFNAME];
-} dhtsrch_t;                // used by QUERY, REPLY, and MISS
+  int dw_sd;                       // client socket
+  iqry_t dw_iqry;                  // and the query received on it
+} dhtwait_t;
 
-class dhtn {
+class dhtn : public dhtxport, public dhtring {
   char *fqdn;      // known host
   u_short port;    // known host's port
   int listen_sd;   // listen socket
-  int search_sd;   // client search image socket
+  int search_sd;   // client search image socket, -1 when no search is pending
+  imgsend_req search_req;  // what the client on search_sd asked for
+  int clients[DHTN_MAXCLIENTS]; // kept-alive client sockets, waiting for their next query
+  int nclients;
+  dhtwait_t waiting[DHTN_MAXWAITING]; // FINDs from new connections, oldest first
+  int nwaiting;
+  int metrics_sd;               // stats socket, see statsinit(), or -1
   imgdb dhtn_imgdb;
-  dhtnode_t self;
-  unsigned char fID[DHTN_FINGERS]; // = { 1, 2, 4, 8, 16, 32, 64, 128 };
-  dhtnode_t fingers[DHTN_FINGERS+1]; // fingers[0] is immediate successor
-                    // fingers[DHTN_FINGERS] is the immediate predecessor
+  unsigned int nslots;          // size of our and our neighbors' summaries
+  dhtnbs_t nbrs[DHTN_NBRS];     // neighbors' imgdb summaries
+  time_t smry_last;             // when we last pushed our summary
+  unsigned int smry_gen;        // dhtn_imgdb.generation() we last pushed
+  unsigned int trace_every;     // trace one in this many DHT searches, 0 for none
+  unsigned int trace_count;     // DHT searches started
+  unsigned long long wake_us;   // trace_now() when select() last returned
 
   void setID(int ID);
   void reID();
-  int connremote(struct in_addr *addr, u_short portnum);
+  int connremote(struct in_addr *addr, u_short portnum, int mustconn = 1);
   int acceptconn();
   void handlepkt(int sender);
-  void handlejoin(int sender, dhtmsg_t *dhtmsg);
-  void handlesearch(int sender, dhtsrch_t *dhtsrch);
-
-  /* forward based on the provided id (which is either node ID for a
-   * join message or image ID for a search message).  The second
-   * argument could actually be a pointer to a dhtsrch_t that is cast
-   * to a dhtmsg_t.  So the third argument tells the actual size of
-   * the packet pointed to by the second argument.
-   */
-  void forward(unsigned char id, dhtmsg_t *dhtmsg, int size);
-
-  void fixup(int idx);
-  void fixdn(int idx);
+  void handlefind(int sender, iqry_t *iqry);
+  void handleclient(int idx);
+  void waitfind(int sender, iqry_t *iqry);
+  void donesearch();
+  void tracehop(dhtsrch_t *dhtsrch);
+  void tracebusy(dhtsrch_t *dhtsrch);
+  void writetrace(dhtsrch_t *dhtsrch);
+  void handlesmry(int sender, dhtmsg_t *dhtmsg);
+  void pushsmry();
+  int nbrsearch(unsigned char id, char *imgname, dhtnode_t **holder);
   void sendimg(int found);
   void sendREDRT(int sender, dhtmsg_t *dhtmsg, int size);
+  void servemetrics();
+  static void *statsthread(void *arg);
+
+  /* dhtring */
+  int have(dhtsrch_t *srch);
+  int shortcut(int sender, dhtsrch_t *srch);
+  void passing(dhtsrch_t *srch);
+  void newrange();
 
 public:
+  /* dhtxport, over TCP */
+  int xsend(dhtnode_t *to, void *msg, int len, dhtmsg_t *redrt = NULL);
+  void xreply(int sender, dhtmsg_t *msg);
+  void xrelease(int sender);
+
   dhtn(int id, char *fqdn, u_short port, char *imagefolder); // default constructor
   void first(); // first node on circle
   void join();
+  void statsinit(int port);
+  void traceinit(int every);
   int mainloop();
 };  
 
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University 
+ * may not be used to endorse or promote products derived from this 
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * Author: Xingtong Zhou (xingtong@umich.edu)
+ *
+*/
+#include <stdio.h>		// printf()
+#include <string.h>		// memset(), memcpy(), strlen()
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>	// htons(), ntohs()
+#endif
+
+#include "netimg.h"
+#include "hash.h"
+#include "dhtring.h"
+#include "nlog.h"
+#include "metrics.h"
+
+/**************************TOOL FUNCTIONS***************************/
+// Caller is responsible to release memory of md!
+unsigned char * getimgMD(char * fname) {
+	unsigned char * md = new unsigned char [SHA1_MDLEN];
+	SHA1((unsigned char *) fname, strlen(fname), md);
+	return md;
+}
+
+unsigned char getimgID(char * fname) {
+	unsigned char * md = getimgMD(fname);
+	unsigned char id = ID(md);
+	delete [] md;
+	return id;
+}
+
+void mkmsg(dhtmsg_t * msg, int type, dhtnode_t * node, u_short ttl) {
+	msg->dhtm_vers = NETIMG_VERS;
+	msg->dhtm_type = type;
+	msg->dhtm_ttl = htons(ttl);
+	if ( node ) {
+		memcpy((char *) &msg->dhtm_node, (char *) node, sizeof(dhtnode_t));
+	} else {
+		memset((char *) &msg->dhtm_node, 0, sizeof(dhtnode_t));
+	}
+	return;
+}
+
+void mksrch(dhtsrch_t * srch, int type, dhtnode_t * node, char * imgname, u_short ttl) {
+	dhtmsg_t * msg = (dhtmsg_t *) srch;
+	mkmsg(msg, type, node, ttl);
+	
+	unsigned char imgID = getimgID(imgname);
+	srch->dhts_imgID = imgID;
+	
+	memcpy((char *) srch->dhts_name, imgname, NETIMG_MAXFNAME);
+	return;
+}
+
+/*
+ * srchtrace: the trace carried by the QUERY, REPLY or MISS "srch",
+ * which must then be the dhtx_srch of a dhtxsrch_t, or NULL if it
+ * isn't traced.
+ */
+dhttrace_t * srchtrace(dhtsrch_t * srch) {
+	if ( !(srch->dhts_msg.dhtm_node.dhtn_rsvd & DHTN_TRACED) ) {
+		return NULL;
+	}
+	return &((dhtxsrch_t *) srch)->dhtx_trace;
+}
+
+/* srchlen: bytes of "srch" on the wire, its trace included */
+int srchlen(dhtsrch_t * srch) {
+	return srchtrace(srch) ? sizeof(dhtxsrch_t) : sizeof(dhtsrch_t);
+}
+
+void initFingers(dhtnode_t *self, dhtnode_t fingers[]) {
+	for ( int i = 0; i < DHTN_FINGERS+1; i++ ) {
+		memcpy((char *) &(fingers[i]), (char *) self, sizeof(dhtnode_t));
+	}
+	return;
+}
+
+void calcfID(unsigned char id, unsigned char fID[]) {
+	unsigned char pow = 1;
+	for ( int i = 0; i < DHTN_FINGERS; i++ ) {
+		fID[i] = (id + pow) % (NETIMG_IDMAX+1);
+		pow *= 2;
+	}
+	return;
+}
+
+int getForwardIdx(unsigned char selfID, unsigned char fID[], int joinID) {
+	int found = 0;
+	int idx = 0;
+	for ( int i = DHTN_FINGERS-1; i > 0 && !found; i-- ) {
+		if (ID_inrange(fID[i], selfID, joinID)) {
+			idx = i;
+			found = 1;
+		}
+	}
+	return idx;
+}
+
+void printFingers(dhtnode_t * self, dhtnode_t fingers[]) {
+	printf("***FINGER TABLE***\n");
+	printf("  self:\t\t%d\n", self->dhtn_ID);
+	for ( int i = 0; i < DHTN_FINGERS+1; i++ ) {
+		printf("  %d:\t\t%d\n", i, fingers[i].dhtn_ID);
+	}
+	return;
+}
+
+/*********************IMPLEMENTATION OF DHTRING*********************/
+/* forward based on provided id (which is either node ID for a
+ * join message or image ID for a searcj message). The second
+ * argument could actually be a pointer to a dhtsrch_t that is cast
+ * to a dhtmsg_t. So the third argument tells the actual size of
+ * the packet pointed to by the second argument.
+ */
+void dhtring::forward(unsigned char id, dhtmsg_t * dhtmsg, int size) {
+	//cout << "entering dhtring::forward()...\n";
+	//TODO: subject to change
+	/* First check whether we expect the joining node's ID, as contained
+	 * in the JOIN message, to fall within the range (self.dhtn_ID, 
+	 * fingers[0].dhtn_ID]. If so, we inform the node we are sending
+	 * the JOIN message to that we expect it to be our successor. We do
+	 * this by setting the highest bit in the type field of the message
+	 * using DHTM_ATLOC. */
+	if ( ntohs(dhtmsg->dhtm_ttl) == 0 ) {
+		nlog(NLOG_WARN, "ttl = 0, canceling forward...\n");
+		return;
+	}
+	
+	dhtmsg->dhtm_ttl = htons(ntohs(dhtmsg->dhtm_ttl)-1);
+	
+	int j = 0;
+	if (ID_inrange(id, self.dhtn_ID, fingers[0].dhtn_ID)) {
+		dhtmsg->dhtm_type |= DHTM_ATLOC;
+	} else {
+		//TODO
+		/* instead of simply forwarding to the successor node, first find the 
+		 * largetst index, j, for which joining node's ID <= fID[j] < the node's
+		 * ID, in modulo arithmetic */
+		j = getForwardIdx(self.dhtn_ID, fID, id);
+	}
+	nlog(NLOG_DEBUG, "forwarding to node %d...\n", fingers[j].dhtn_ID);
+	
+	/* After we've forwarded the message along, we don't immediately close
+	 * the connection as usual. Instead, we wait for any DHTM_REDRT message
+	 * telling us that we have overshot in our range expectation (see the
+	 * third case in dhtring::handlejoin()). Such a message comes with a 
+	 * suggested new successor, we copy this suggested new successor to 
+	 * our fingers[0] and try to forward the JOIN message again to the 
+	 * new successor. We repeat this until we stop getting DHTM_REDRT
+	 * message. */
+	dhtmsg_t redrtmsg;
+	int redrt = xport->xsend(&fingers[j], dhtmsg, size, &redrtmsg);
+	net_assert((redrt < 0), "dhtring::forward: xsend");
+	if ( redrt > 0 ) {
+		metrics_count(METRICS_REDRT);
+		nlog(NLOG_DEBUG, "receive redrtmsg...\n");
+		//TODO
+		/* instead of saving the returned node as the new successor, we save it 
+		 * in finger[j] */
+		memcpy((char *) &fingers[j], (char *) &redrtmsg.dhtm_node, sizeof(dhtnode_t));
+		fixup(j);
+		fixdn(j);
+		
+		//printFingers(&self, fingers);
+		forward(id, dhtmsg, size);
+	}
+	
+	return;
+}
+
+void dhtring::handlejoin(int sender, dhtmsg_t *dhtmsg) {
+	//cout << "entering dhtring::handlejoin()...\n";
+	//printFingers(&self, fingers);
+	
+	/* First check if the joining node's ID collides with predecessor or
+	 * self. If so, send back to joining node a REID message. */
+	int err;
+	dhtnode_t * joining = &(dhtmsg->dhtm_node);
+	dhtnode_t * pred = &(fingers[DHTN_FINGERS]);
+	if ( joining->dhtn_ID == self.dhtn_ID || joining->dhtn_ID == pred->dhtn_ID ) {
+		xport->xrelease(sender);
+		
+		dhtmsg_t reidmsg;
+		mkmsg( &reidmsg, DHTM_REID, NULL );
+		
+		err = xport->xsend(joining, &reidmsg, sizeof(dhtmsg_t));
+		net_assert((err < 0), "dhtring::reid: xsend");
+		return;
+	}
+	
+	// wlcm the joining node
+	if ( ID_inrange(joining->dhtn_ID, pred->dhtn_ID, self.dhtn_ID) ) {
+		xport->xrelease(sender);
+		
+		struct {
+			dhtmsg_t msg;
+			dhtnode_t pred;	// WLCM is followed by our predecessor
+		} wlcmmsg;
+		mkmsg( &wlcmmsg.msg, DHTM_WLCM, &self );
+		memcpy((char *) &wlcmmsg.pred, (char *) pred, sizeof(dhtnode_t));
+		
+		nlog(NLOG_DEBUG, "sending wlcmmsg and pred node...\n");
+		err = xport->xsend(joining, &wlcmmsg, sizeof(wlcmmsg));
+		net_assert((err < 0), "dhtring:wlcm: xsend");
+		
+		// updating predecessor, call fixdn
+		nlog(NLOG_DEBUG, "updating pred node...\n");
+		memcpy((char *) pred, (char *) joining, sizeof(dhtnode_t));	
+		if ( self.dhtn_ID == fingers[0].dhtn_ID ) {
+			nlog(NLOG_DEBUG, "updating succ node...\n");
+			memcpy((char *) &(fingers[0]), (char *) joining, sizeof(dhtnode_t));
+			fixup(0);
+		}
+		fixdn(DHTN_FINGERS);
+		
+		//printFingers(&self, fingers);
+		return;
+	}
+	
+	// redrt the sender
+	if ( dhtmsg->dhtm_type & DHTM_ATLOC ) {
+		dhtmsg_t redrtmsg;
+		mkmsg( &redrtmsg, DHTM_REDRT, pred );
+		xport->xreply(sender, &redrtmsg);
+		xport->xrelease(sender);
+		return;
+	}
+	
+	// subject to change
+	xport->xrelease(sender);
+	forward(joining->dhtn_ID, dhtmsg, sizeof(dhtmsg_t));
+	
+	return;
+}
+
+// TODO
+void dhtring::handlesearch(int sender, dhtsrch_t * dhtsrch) {
+	
+	//cout << "entering dhtring::handlesearch()...\n";
+	
+	unsigned char imgID = dhtsrch->dhts_imgID;
+	char * imgname = dhtsrch->dhts_name;
+	dhtnode_t * originator = &(dhtsrch->dhts_msg.dhtm_node);
+	dhtnode_t * pred = &(fingers[DHTN_FINGERS]);	
+	
+	nlog(NLOG_DEBUG, "searching for image %s(%d)...\n", imgname, imgID);
+	if ( have(dhtsrch) ) {
+		// queried image is in local database or has been cached
+		xport->xrelease(sender);
+		nlog(NLOG_DEBUG, "sending rplymsg(REPLY)...\n");
+		sendsrch(originator, DHTM_REPLY, imgname, ntohs(dhtsrch->dhts_msg.dhtm_ttl), dhtsrch);
+		return;
+	}
+	
+	if ( ID_inrange(imgID, pred->dhtn_ID, self.dhtn_ID) ) {
+		// queried image is within range but not found
+		xport->xrelease(sender);
+		nlog(NLOG_DEBUG, "sending rplymsg(MISS)...\n");
+		sendsrch(originator, DHTM_MISS, imgname, ntohs(dhtsrch->dhts_msg.dhtm_ttl), dhtsrch);
+		return;
+	}
+	
+	if ( dhtsrch->dhts_msg.dhtm_type & DHTM_ATLOC ) {
+		/* if the queried image ID is not within range, but the sender expected
+		 * it to be within range, send back a DHTM_REDRT message */
+		dhtmsg_t redrtmsg;
+		mkmsg( &redrtmsg, DHTM_REDRT, pred );
+		nlog(NLOG_DEBUG, "sending redrtmsg...\n");
+		xport->xreply(sender, &redrtmsg);
+		xport->xrelease(sender);
+		return;
+	}
+	
+	if ( shortcut(sender, dhtsrch) ) {
+		return;
+	}
+	
+	xport->xrelease(sender);
+	passing(dhtsrch);
+	forward(imgID, (dhtmsg_t *) dhtsrch, srchlen(dhtsrch));
+	
+	return;
+}
+
+/*
+ * sendsrch: send a dhtsrch_t of the given type (REPLY or MISS) for
+ * imgname to node "to".  The reply carries the
+ * "ttl" the query had left, so "to" can tell how many hops it took,
+ * and, if the query "traced" is traced, its trace.
+ */
+void dhtring::sendsrch(dhtnode_t * to, int type, char * imgname, u_short ttl, dhtsrch_t * traced) {
+	int err, len;
+	dhtxsrch_t rplymsg;
+	mksrch( &rplymsg.dhtx_srch, type, NULL, imgname, ttl );
+	if ( traced && srchtrace(traced) ) {
+		passing(traced);
+		rplymsg.dhtx_srch.dhts_msg.dhtm_node.dhtn_rsvd |= DHTN_TRACED;
+		memcpy((char *) &rplymsg.dhtx_trace, (char *) srchtrace(traced), sizeof(dhttrace_t));
+	}
+	len = srchlen(&rplymsg.dhtx_srch);
+	
+	err = xport->xsend(to, &rplymsg, len);
+	net_assert((err < 0), "dhtring:reply: xsend");
+	
+	return;
+}
+
+/*
+ * jump: send a QUERY straight to node "to", whose summary says it may
+ * have the image, instead of forwarding it along the fingers.  The
+ * originator is marked DHTN_JUMPED so that, should the summary have
+ * been a false positive, no node short-cuts the query again and it
+ * can't bounce between summaries.  Falls back to forward() if "to"
+ * can't be reached.
+ */
+void dhtring::jump(dhtnode_t * to, dhtsrch_t * dhtsrch) {
+	dhtmsg_t * dhtmsg = (dhtmsg_t *) dhtsrch;
+	
+	if ( ntohs(dhtmsg->dhtm_ttl) == 0 ) {
+		nlog(NLOG_WARN, "ttl = 0, canceling forward...\n");
+		return;
+	}
+	dhtmsg->dhtm_node.dhtn_rsvd |= DHTN_JUMPED;
+	dhtmsg->dhtm_type &= ~DHTM_ATLOC;
+	
+	dhtmsg->dhtm_ttl = htons(ntohs(dhtmsg->dhtm_ttl)-1);
+	nlog(NLOG_DEBUG, "jumping to node %d from its summary...\n", to->dhtn_ID);
+	if ( xport->xsend(to, dhtsrch, srchlen(dhtsrch)) < 0 ) {
+		dhtmsg->dhtm_ttl = htons(ntohs(dhtmsg->dhtm_ttl)+1);
+		forward(dhtsrch->dhts_imgID, dhtmsg, srchlen(dhtsrch));
+	}
+	
+	return;
+}
+
+/*
+ * handlewlcm: we have been welcomed onto the circle, between "pred"
+ * and our new successor "succ".
+ */
+void dhtring::handlewlcm(dhtnode_t * succ, dhtnode_t * pred) {
+	// store successor node
+	nlog(NLOG_DEBUG, "updating succ node...\n");
+	memcpy((char *) &(fingers[0]), (char *) succ, sizeof(dhtnode_t));
+	fixup(0);
+	// store predecessor node
+	nlog(NLOG_DEBUG, "updating pred node...\n");
+	memcpy((char *) &(fingers[DHTN_FINGERS]), (char *) pred, sizeof(dhtnode_t));
+	fixdn(DHTN_FINGERS);
+	return;
+}
+
+// TODO
+void dhtring::fixup(int idx) {
+	// just follow the instruction, totally no idea...
+	//cout << "entering dhtring::fixup()...\n";
+	int stop = 0;
+	for ( int k = idx+1; k < DHTN_FINGERS && !stop; k++ ) {
+		if (ID_inrange(fID[k], self.dhtn_ID, fingers[idx].dhtn_ID)) {
+			memcpy((char *) &(fingers[k]), (char *) &(fingers[idx]), sizeof(dhtnode_t));
+		} else {
+			stop = 1;
+		}
+	}
+	//printFingers(&self, fingers);
+	return;
+}
+
+// TODO
+void dhtring::fixdn(int idx) {
+	//cout << "entering dhtring::fixdn()...\n";
+	for ( int k = idx-1; k >= 0; k-- ) {
+		if (ID_inrange(fingers[idx].dhtn_ID, fID[k], fingers[k].dhtn_ID)) {
+			memcpy((char *) &(fingers[k]), (char *) &(fingers[idx]), sizeof(dhtnode_t));
+		}
+	}
+	if ( idx == DHTN_FINGERS ) {
+		newrange();
+	}
+	//printFingers(&self, fingers);
+	return;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __DHTRING_H__
+#define __DHTRING_H__
+
+#include <sys/types.h>     // u_short
+#ifndef _WIN32
+#include <netinet/in.h>    // struct in_addr
+#endif
+
+#include "netimg.h"
+
+#define DHTN_FINGERS 8  // reaches half of 2^8-1
+                        // with integer IDs, fingers[0] is immediate successor
+#define DHTN_JUMPED 0x01  // dhtn_rsvd flag of a QUERY's originator: don't short-cut again
+#define DHTN_TRACED 0x02  // dhtn_rsvd flag of a QUERY's, REPLY's or MISS's dhtm_node: traced,
+                          //   see dhtxsrch_t
+
+#define DHTM_TTL   10
+#define DHTM_JOIN  0x01
+#define DHTM_REID  0x02
+#define DHTM_WLCM  0x04
+#define DHTM_FIND 0x08   // image query from client, see netimg.h for iqry_t packet
+#define DHTM_QUERY 0x10   // image search on the DHT
+#define DHTM_REPLY 0x20   // reply to image search on the DHT
+#define DHTM_MISS  0x22   // image not found on the DHT 
+#define DHTM_REDRT 0x40
+#define DHTM_SMRY  0x42   // Bloom filter summary of a node's imgdb
+#define DHTM_ATLOC 0x80
+
+typedef struct {
+  unsigned char dhtn_rsvd;
+  unsigned char dhtn_ID;
+  u_short dhtn_port;        // port#, always stored in network byte order
+  struct in_addr dhtn_addr; // IPv4 address
+} dhtnode_t;
+
+typedef struct {
+  unsigned char dhtm_vers;  // must be NETIMG_VERS
+  unsigned char dhtm_type;  // one of DHTM_{REDRT,JOIN,REID,WLCM} type
+  u_short dhtm_ttl;         // currently used only by JOIN and QUERY messages
+  dhtnode_t dhtm_node;      // REDRT: new successor
+                            // JOIN: node attempting to join DHT
+                            // REID: not used
+                            // WLCM: successor node, to be followed by predecessor node
+} dhtmsg_t;
+
+typedef struct {
+  dhtmsg_t dhts_msg;                
+  unsigned char dhts_imgID;
+  char dhts_name[NETIMG_MAXFNAME];
+} dhtsrch_t;                // used by QUERY, REPLY, and MISS
+
+#define DHTT_MAXHOPS DHTM_TTL  // a QUERY is handled by at most this many nodes
+
+typedef struct {
+  unsigned char dhth_ID;      // node that handled the QUERY
+  unsigned char dhth_rsvd[3];
+  int dhth_recv;              // usecs from dhtt_start until it read the QUERY, by its clock
+  unsigned int dhth_queue;    // usecs the QUERY waited there before being read
+  unsigned int dhth_busy;     // usecs from reading the QUERY until first passing it on or answering
+} dhthop_t;
+
+typedef struct {
+  unsigned int dhtt_id;       // trace ID, see dhtn::handlefind()
+  unsigned int dhtt_start[2]; // originator's trace_now() when it started the search, high word first
+  unsigned char dhtt_nhops;
+  unsigned char dhtt_rsvd[3];
+  dhthop_t dhtt_hops[DHTT_MAXHOPS];  // in the order the QUERY visited the nodes
+} dhttrace_t;               // all fields in network byte order
+
+/*
+ * A traced QUERY, and its REPLY or MISS, carries its trace after the
+ * dhtsrch_t.  Only sampled searches are traced, so the others stay as
+ * small as they were.
+ */
+typedef struct {
+  dhtsrch_t dhtx_srch;      // DHTN_TRACED set in dhtx_srch.dhts_msg.dhtm_node.dhtn_rsvd
+  dhttrace_t dhtx_trace;
+} dhtxsrch_t;
+
+/*
+ * dhtxport: how a node's ring logic reaches other nodes.  dhtn sends
+ * each message on a new TCP connection; the simulator, see dhtsim.cpp,
+ * hands it to the receiving node in the same process.  A message being
+ * handled comes with an opaque "sender", that the receiving node may
+ * answer on, e.g., with a REDRT, and must release once done with it.
+ */
+class dhtxport {
+public:
+  virtual ~dhtxport() {}
+
+  /* send the "len" bytes at "msg" to node "to".  With "redrt", wait
+   * for "to" to either answer with a REDRT, copied to *redrt, or
+   * release us.  Returns 1 if a REDRT came back, 0 if not, and -1 if
+   * "to" can't be reached.
+   */
+  virtual int xsend(dhtnode_t *to, void *msg, int len, dhtmsg_t *redrt = NULL) = 0;
+  virtual void xreply(int sender, dhtmsg_t *msg) = 0;
+  virtual void xrelease(int sender) = 0;
+};
+
+/*
+ * dhtring: a node's place on the ID circle, its fingers, and the
+ * routing of JOIN and QUERY messages, independent of how messages
+ * travel.  Subclasses say what the node holds, see have(), and may
+ * short-cut searches, see shortcut().
+ */
+class dhtring {
+protected:
+  dhtxport *xport;
+  dhtnode_t self;
+  unsigned char fID[DHTN_FINGERS]; // = { 1, 2, 4, 8, 16, 32, 64, 128 };
+  dhtnode_t fingers[DHTN_FINGERS+1]; // fingers[0] is immediate successor
+                    // fingers[DHTN_FINGERS] is the immediate predecessor
+
+  /* whether this node holds the image "srch" looks for */
+  virtual int have(dhtsrch_t *srch) { return 0; }
+  /* before forwarding "srch" along the fingers: answer or pass it on
+   * some other way, releasing "sender", and return 1, or return 0 */
+  virtual int shortcut(int sender, dhtsrch_t *srch) { return 0; }
+  /* the traced QUERY "srch" is about to leave us, see dhttrace_t */
+  virtual void passing(dhtsrch_t *srch) {}
+  /* our predecessor, hence our range, has changed */
+  virtual void newrange() {}
+
+  void sendsrch(dhtnode_t *to, int type, char *imgname, u_short ttl = DHTM_TTL,
+                dhtsrch_t *traced = NULL);
+  void jump(dhtnode_t *to, dhtsrch_t *dhtsrch);
+
+  /* forward based on the provided id (which is either node ID for a
+   * join message or image ID for a search message).  The second
+   * argument could actually be a pointer to a dhtsrch_t that is cast
+   * to a dhtmsg_t.  So the third argument tells the actual size of
+   * the packet pointed to by the second argument.
+   */
+  void forward(unsigned char id, dhtmsg_t *dhtmsg, int size);
+
+  void fixup(int idx);
+  void fixdn(int idx);
+
+public:
+  dhtring(dhtxport *xport) : xport(xport) {}
+  virtual ~dhtring() {}
+  void handlejoin(int sender, dhtmsg_t *dhtmsg);
+  void handlewlcm(dhtnode_t *succ, dhtnode_t *pred);
+  void handlesearch(int sender, dhtsrch_t *dhtsrch);
+};
+
+extern unsigned char *getimgMD(char *fname);
+extern unsigned char getimgID(char *fname);
+extern void mkmsg(dhtmsg_t *msg, int type, dhtnode_t *node, u_short ttl = DHTM_TTL);
+extern void mksrch(dhtsrch_t *srch, int type, dhtnode_t *node, char *imgname, u_short ttl = DHTM_TTL);
+extern dhttrace_t *srchtrace(dhtsrch_t *srch);
+extern int srchlen(dhtsrch_t *srch);
+extern void initFingers(dhtnode_t *self, dhtnode_t fingers[]);
+extern void calcfID(unsigned char id, unsigned char fID[]);
+extern int getForwardIdx(unsigned char selfID, unsigned char fID[], int joinID);
+extern void printFingers(dhtnode_t *self, dhtnode_t fingers[]);
+
+#endif /* __DHTRING_H__ */
@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>         // printf(), fprintf()
+#include <stdlib.h>        // atoi(), lrand48()
+#include <string.h>        // memset(), memcpy()
+#include <unistd.h>        // getopt()
+#include <arpa/inet.h>     // htons(), ntohs(), htonl()
+#include <string>
+#include <set>
+#include <vector>
+#include <algorithm>       // sort(), lower_bound()
+using namespace std;
+
+#include "netimg.h"
+#include "hash.h"
+#include "dhtring.h"
+#include "dhtsim.h"
+#include "nlog.h"
+
+/*
+ * dhtsim_pct: the "p"th percentile of the sorted "v", 0 if empty.
+ */
+static double
+dhtsim_pct(const vector<double> &v, double p)
+{
+  unsigned int i;
+
+  if (v.empty()) {
+    return(0.0);
+  }
+  i = (unsigned int) (p/100.0*(v.size()-1) + 0.5);
+  return(v[i < v.size() ? i : v.size()-1]);
+}
+
+static double
+dhtsim_mean(const vector<double> &v)
+{
+  double sum = 0.0;
+  unsigned int i;
+
+  for (i = 0; i < v.size(); i++) {
+    sum += v[i];
+  }
+  return(v.empty() ? 0.0 : sum/v.size());
+}
+
+simnode::
+simnode(dhtsim *sim, int idx, unsigned char id) : dhtring(this), sim(sim), idx(idx), joined(0)
+{
+  memset(&self, 0, sizeof(dhtnode_t));
+  self.dhtn_port = htons((u_short) (idx+1));
+  self.dhtn_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setid(id);
+  initFingers(&self, fingers);
+}
+
+void simnode::
+setid(unsigned char id)
+{
+  self.dhtn_ID = id;
+  calcfID(id, fID);
+}
+
+/*
+ * have: whether the image is on the DHT and in our range.
+ */
+int simnode::
+have(dhtsrch_t *srch)
+{
+  return(sim->holds(srch->dhts_name) &&
+         ID_inrange(srch->dhts_imgID, fingers[DHTN_FINGERS].dhtn_ID, self.dhtn_ID));
+}
+
+/*
+ * first: start the circle, alone on it.
+ */
+void simnode::
+first()
+{
+  initFingers(&self, fingers);
+  joined = 1;
+}
+
+/*
+ * join: join the circle through "known", as dhtn::join() does.
+ */
+void simnode::
+join(simnode *known)
+{
+  dhtmsg_t msg;
+
+  initFingers(&self, fingers);
+  joined = 0;
+  mkmsg(&msg, DHTM_JOIN, &self);
+  xsend(known->node(), &msg, sizeof(dhtmsg_t));
+}
+
+/*
+ * search: look "imgname" up on behalf of a client, as
+ * dhtn::handlefind() does.  "imgname" must be NETIMG_MAXFNAME long.
+ */
+void simnode::
+search(char *imgname)
+{
+  dhtsrch_t srch;
+
+  mksrch(&srch, DHTM_QUERY, &self, imgname);
+  if (have(&srch)) {
+    sim->answered(DHTM_REPLY, 0);
+  } else if (self.dhtn_ID == fingers[0].dhtn_ID ||
+             ID_inrange(srch.dhts_imgID, fingers[DHTN_FINGERS].dhtn_ID, self.dhtn_ID)) {
+    sim->answered(DHTM_MISS, 0);
+  } else {
+    forward(srch.dhts_imgID, (dhtmsg_t *) &srch, sizeof(dhtsrch_t));
+  }
+}
+
+/*
+ * handle: the "len"-byte message "msg" has arrived from "sender", see
+ * dhtn::handlepkt().
+ */
+void simnode::
+handle(int sender, char *msg, int len)
+{
+  dhtmsg_t *dhtmsg = (dhtmsg_t *) msg;
+
+  if (dhtmsg->dhtm_type == DHTM_REID) {
+    xrelease(sender);
+    sim->reid(this);
+  } else if (dhtmsg->dhtm_type & DHTM_WLCM) {
+    xrelease(sender);
+    net_assert((len < (int) (sizeof(dhtmsg_t)+sizeof(dhtnode_t))), "simnode::handle: WLCM");
+    handlewlcm(&dhtmsg->dhtm_node, (dhtnode_t *) (msg+sizeof(dhtmsg_t)));
+    joined = 1;
+  } else if (dhtmsg->dhtm_type & DHTM_JOIN) {
+    handlejoin(sender, dhtmsg);
+  } else if (dhtmsg->dhtm_type == DHTM_REPLY || dhtmsg->dhtm_type == DHTM_MISS) {
+    xrelease(sender);
+    sim->answered(dhtmsg->dhtm_type, DHTM_TTL-ntohs(dhtmsg->dhtm_ttl));
+  } else if (dhtmsg->dhtm_type & DHTM_QUERY) {
+    handlesearch(sender, (dhtsrch_t *) msg);
+  } else {
+    xrelease(sender);
+  }
+}
+
+/*
+ * right: how many of our fingers point where they would on the
+ * circle "ring", the sorted IDs of its nodes.  *succ and *pred are set
+ * to whether our successor and predecessor are right.
+ */
+int simnode::
+right(const vector<unsigned char> &ring, int *succ, int *pred)
+{
+  vector<unsigned char>::const_iterator it;
+  int k, n = 0;
+
+  for (k = 0; k < DHTN_FINGERS; k++) {
+    /* the node fID[k] falls to is the first at or after it */
+    it = lower_bound(ring.begin(), ring.end(), fID[k]);
+    if (fingers[k].dhtn_ID == (it == ring.end() ? ring[0] : *it)) {
+      n++;
+    }
+  }
+  it = upper_bound(ring.begin(), ring.end(), self.dhtn_ID);
+  *succ = fingers[0].dhtn_ID == (it == ring.end() ? ring[0] : *it);
+  it = lower_bound(ring.begin(), ring.end(), self.dhtn_ID);
+  *pred = fingers[DHTN_FINGERS].dhtn_ID == (it == ring.begin() ? ring.back() : *(it-1));
+  return(n);
+}
+
+int simnode::
+xsend(dhtnode_t *to, void *msg, int len, dhtmsg_t *redrt)
+{
+  return(sim->deliver(this, to, msg, len, redrt));
+}
+
+void simnode::
+xreply(int sender, dhtmsg_t *msg)
+{
+  sim->redirect(sender, msg);
+}
+
+void simnode::
+xrelease(int sender)
+{
+}
+
+/*
+ * The nodes take distinct IDs, shuffled with dso_seed; the circle is
+ * built in run().
+ */
+dhtsim::
+dhtsim(dhtsim_opts *opts) : opts(opts), now(0), msgs(0), reids(0)
+{
+  vector<int> ids;
+  char name[NETIMG_MAXFNAME];
+  int i;
+
+  srand48(opts->dso_seed);
+  for (i = 0; i <= NETIMG_IDMAX; i++) {
+    ids.push_back(i);
+  }
+  for (i = NETIMG_IDMAX; i > 0; i--) {
+    swap(ids[i], ids[lrand48() % (i+1)]);
+  }
+  for (i = 0; i < opts->dso_nodes; i++) {
+    nodes.push_back(new simnode(this, i, (unsigned char) ids[i]));
+  }
+  for (i = 0; i < opts->dso_images; i++) {
+    snprintf(name, sizeof(name), "img%d.tga", i);
+    images.insert(name);
+  }
+  memset(&cur, 0, sizeof(cur));
+}
+
+dhtsim::
+~dhtsim()
+{
+  unsigned int i;
+
+  for (i = 0; i < nodes.size(); i++) {
+    delete nodes[i];
+  }
+}
+
+/*
+ * latency: one-way latency between two nodes, in usecs: between half
+ * and one and a half times dso_latency, fixed per pair of nodes.
+ */
+unsigned long long dhtsim::
+latency(simnode *from, simnode *to)
+{
+  unsigned int a = from->id(), b = to->id(), h;
+
+  h = ((a < b ? a : b)*(NETIMG_IDMAX+1) + (a < b ? b : a) + 1)*2654435761U;
+  h ^= h >> 15;
+  return(opts->dso_latency/2 + h % (opts->dso_latency+1));
+}
+
+/*
+ * ring: the sorted IDs of the nodes on the circle.
+ */
+void dhtsim::
+ring(vector<unsigned char> *ids)
+{
+  unsigned int i;
+
+  ids->clear();
+  for (i = 0; i < nodes.size(); i++) {
+    if (nodes[i]->joined) {
+      ids->push_back(nodes[i]->id());
+    }
+  }
+  sort(ids->begin(), ids->end());
+}
+
+/*
+ * deliver: hand "msg" from "from" to the node at "to", which handles
+ * it before deliver() returns, advancing the virtual clock by the
+ * latency between them.  A REDRT the receiver answers with costs the
+ * latency back.  Returns as dhtxport::xsend() does.
+ */
+int dhtsim::
+deliver(simnode *from, dhtnode_t *to, void *msg, int len, dhtmsg_t *redrt)
+{
+  dhtxsrch_t buf;       // the largest message there is
+  simnode *dst;
+  dhtmsg_t reply;
+  int i, sender, back;
+
+  i = ntohs(to->dhtn_port)-1;
+  if (i < 0 || i >= (int) nodes.size()) {
+    return(-1);
+  }
+  dst = nodes[i];
+  net_assert((len > (int) sizeof(buf)), "dhtsim::deliver: message too long");
+  memcpy(&buf, msg, len);
+
+  msgs++;
+  now += latency(from, dst);
+
+  /* the receiver knows us by our slot */
+  sender = redrts.size();
+  redrts.resize(sender+1);
+  redirected.push_back(0);
+  dst->handle(sender, (char *) &buf, len);
+  back = redirected[sender];
+  reply = redrts[sender];
+  redrts.pop_back();
+  redirected.pop_back();
+
+  if (!back) {
+    return(0);
+  }
+  msgs++;
+  now += latency(dst, from);
+  if (!redrt) {
+    return(0);
+  }
+  *redrt = reply;
+  return(1);
+}
+
+void dhtsim::
+redirect(int sender, dhtmsg_t *msg)
+{
+  redrts[sender] = *msg;
+  redirected[sender] = 1;
+}
+
+void dhtsim::
+answered(int type, int hops)
+{
+  cur.dsl_type = type;
+  cur.dsl_hops = hops;
+  cur.dsl_at = now;
+}
+
+/*
+ * reid: "node" collides with a node on the circle; it takes a free ID
+ * and joins again, as dhtn::reID() does.
+ */
+void dhtsim::
+reid(simnode *node)
+{
+  vector<unsigned char> ids;
+  unsigned char id;
+  unsigned int i;
+
+  reids++;
+  ring(&ids);
+  do {
+    id = (unsigned char) (lrand48() % (NETIMG_IDMAX+1));
+  } while (binary_search(ids.begin(), ids.end(), id));
+  node->setid(id);
+
+  do {
+    i = lrand48() % nodes.size();
+  } while (nodes[i] == node || !nodes[i]->joined);
+  node->join(nodes[i]);
+}
+
+/*
+ * Accuracy of the nodes' fingers against the circle.
+ */
+typedef struct {
+  double dsa_fingers, dsa_succ, dsa_pred;   // percent right
+} dhtsim_accuracy;
+
+static void
+dhtsim_check(vector<simnode *> &nodes, const vector<unsigned char> &ring, dhtsim_accuracy *acc)
+{
+  long fingers = 0, succs = 0, preds = 0, n = 0;
+  int succ, pred;
+  unsigned int i;
+
+  for (i = 0; i < nodes.size(); i++) {
+    if (nodes[i]->joined) {
+      fingers += nodes[i]->right(ring, &succ, &pred);
+      succs += succ;
+      preds += pred;
+      n++;
+    }
+  }
+  acc->dsa_fingers = n ? 100.0*fingers/(n*DHTN_FINGERS) : 0.0;
+  acc->dsa_succ = n ? 100.0*succs/n : 0.0;
+  acc->dsa_pred = n ? 100.0*preds/n : 0.0;
+}
+
+static void
+dhtsim_accreport(const char *when, dhtsim_accuracy *acc)
+{
+  printf("  %s: fingers right %.1f%%, successors %.1f%%, predecessors %.1f%%\n",
+         when, acc->dsa_fingers, acc->dsa_succ, acc->dsa_pred);
+}
+
+/*
+ * run: build the circle, one node joining at a time through a random
+ * node already on it, then look images up from random nodes, in
+ * dso_rounds rounds of dso_lookups, and report how the routing did.
+ * Fingers are only ever fixed by the REDRTs lookups run into, so the
+ * rounds show how the circle settles.  Returns 0, or 1 if a join or
+ * lookup was lost.
+ */
+int dhtsim::
+run()
+{
+  vector<double> joinms, joinmsgs, hops, lookmsgs, lookms;
+  vector<long> hist(DHTM_TTL+1, 0);
+  vector<unsigned char> ids;
+  dhtsim_accuracy acc;
+  char name[NETIMG_MAXFNAME];
+  unsigned long long t0;
+  long m0, found, missed, lost, failed = 0, totlost = 0, total = 0;
+  int i, r, q;
+  simnode *origin;
+
+  nodes[0]->first();
+  for (i = 1; i < (int) nodes.size(); i++) {
+    t0 = now;
+    m0 = msgs;
+    nodes[i]->join(nodes[lrand48() % i]);
+    if (!nodes[i]->joined) {
+      failed++;
+      continue;
+    }
+    joinms.push_back((now-t0)/1000.0);
+    joinmsgs.push_back((double) (msgs-m0));
+  }
+  ring(&ids);
+  dhtsim_check(nodes, ids, &acc);
+
+  sort(joinms.begin(), joinms.end());
+  sort(joinmsgs.begin(), joinmsgs.end());
+  printf("%d nodes, %d images, %d%% of lookups miss, %.1f ms mean one-way latency\n",
+         (int) nodes.size(), opts->dso_images, opts->dso_misspct, opts->dso_latency/1000.0);
+  printf("joins %d (failed %ld, reids %ld)\n", (int) joinms.size(), failed, reids);
+  printf("  latency (ms): p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+         dhtsim_pct(joinms, 50), dhtsim_pct(joinms, 90),
+         dhtsim_pct(joinms, 99), dhtsim_pct(joinms, 100));
+  printf("  messages: mean %.2f p50 %.0f p99 %.0f max %.0f\n", dhtsim_mean(joinmsgs),
+         dhtsim_pct(joinmsgs, 50), dhtsim_pct(joinmsgs, 99), dhtsim_pct(joinmsgs, 100));
+  dhtsim_accreport("after joins", &acc);
+
+  memset(name, 0, sizeof(name));
+  for (r = 1; r <= opts->dso_rounds; r++) {
+    hops.clear();
+    lookmsgs.clear();
+    lookms.clear();
+    found = missed = lost = 0;
+
+    for (q = 0; q < opts->dso_lookups; q++) {
+      origin = nodes[lrand48() % nodes.size()];
+      if (!origin->joined) {
+        q--;
+        continue;
+      }
+      if (lrand48() % 100 < opts->dso_misspct || !opts->dso_images) {
+        snprintf(name, sizeof(name), "miss%ld.tga", lrand48() % 1000000);
+      } else {
+        snprintf(name, sizeof(name), "img%ld.tga", lrand48() % opts->dso_images);
+      }
+
+      memset(&cur, 0, sizeof(cur));
+      t0 = now;
+      m0 = msgs;
+      origin->search(name);
+      if (!cur.dsl_type) {
+        lost++;
+        continue;
+      }
+      if (cur.dsl_type == DHTM_REPLY) {
+        found++;
+      } else {
+        missed++;
+      }
+      hops.push_back((double) cur.dsl_hops);
+      hist[cur.dsl_hops]++;
+      lookmsgs.push_back((double) (msgs-m0));
+      lookms.push_back((cur.dsl_at-t0)/1000.0);
+    }
+    total += found+missed;
+    totlost += lost;
+    dhtsim_check(nodes, ids, &acc);
+
+    sort(hops.begin(), hops.end());
+    sort(lookmsgs.begin(), lookmsgs.end());
+    sort(lookms.begin(), lookms.end());
+    printf("round %d: lookups %d (found %ld, missed %ld, lost %ld)\n",
+           r, opts->dso_lookups, found, missed, lost);
+    printf("  hops: mean %.2f p50 %.0f p90 %.0f p99 %.0f max %.0f\n", dhtsim_mean(hops),
+           dhtsim_pct(hops, 50), dhtsim_pct(hops, 90), dhtsim_pct(hops, 99), dhtsim_pct(hops, 100));
+    printf("  messages: mean %.2f p50 %.0f p99 %.0f max %.0f\n", dhtsim_mean(lookmsgs),
+           dhtsim_pct(lookmsgs, 50), dhtsim_pct(lookmsgs, 99), dhtsim_pct(lookmsgs, 100));
+    printf("  latency (ms): p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+           dhtsim_pct(lookms, 50), dhtsim_pct(lookms, 90),
+           dhtsim_pct(lookms, 99), dhtsim_pct(lookms, 100));
+    dhtsim_accreport("after round", &acc);
+  }
+
+  printf("hops over all rounds:\n");
+  for (i = 0; i <= DHTM_TTL; i++) {
+    if (hist[i]) {
+      printf("  %2d %8ld %5.1f%%\n", i, hist[i], 100.0*hist[i]/total);
+    }
+  }
+
+  return(failed || totlost ? 1 : 0);
+}
+
+static void
+dhtsim_usage(char *progname)
+{
+  fprintf(stderr, "Usage: %s [-n <nodes> -k <images> -q <lookups> -r <rounds> "
+          "-m <miss%%> -l <latency usecs> -s <seed> -v]\n", progname);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  dhtsim_opts opts;
+  extern char *optarg;
+  int c;
+
+  opts.dso_nodes = DHTSIM_NODES;
+  opts.dso_images = DHTSIM_IMAGES;
+  opts.dso_lookups = DHTSIM_LOOKUPS;
+  opts.dso_rounds = DHTSIM_ROUNDS;
+  opts.dso_misspct = DHTSIM_MISSPCT;
+  opts.dso_latency = DHTSIM_LATENCY;
+  opts.dso_seed = DHTSIM_SEED;
+  opts.dso_verbose = 0;
+
+  while ((c = getopt(argc, argv, "n:k:q:r:m:l:s:v")) != EOF) {
+    switch (c) {
+    case 'n':
+      opts.dso_nodes = atoi(optarg);
+      /* node IDs are 8 bits */
+      net_assert((opts.dso_nodes < 1 || opts.dso_nodes > NETIMG_IDMAX+1),
+                 "dhtsim: nodes out of range");
+      break;
+    case 'k':
+      opts.dso_images = atoi(optarg);
+      net_assert((opts.dso_images < 0), "dhtsim: images must not be negative");
+      break;
+    case 'q':
+      opts.dso_lookups = atoi(optarg);
+      net_assert((opts.dso_lookups < 0), "dhtsim: lookups must not be negative");
+      break;
+    case 'r':
+      opts.dso_rounds = atoi(optarg);
+      net_assert((opts.dso_rounds < 0), "dhtsim: rounds must not be negative");
+      break;
+    case 'm':
+      opts.dso_misspct = atoi(optarg);
+      net_assert((opts.dso_misspct < 0 || opts.dso_misspct > 100), "dhtsim: miss% out of range");
+      break;
+    case 'l':
+      opts.dso_latency = atoi(optarg);
+      net_assert((opts.dso_latency < 0), "dhtsim: latency must not be negative");
+      break;
+    case 's':
+      opts.dso_seed = atol(optarg);
+      break;
+    case 'v':
+      opts.dso_verbose = 1;
+      break;
+    default:
+      dhtsim_usage(argv[0]);
+      break;
+    }
+  }
+
+  nlog_setlevel(opts.dso_verbose ? NLOG_DEBUG : NLOG_ERROR);
+  dhtsim sim(&opts);
+  return(sim.run());
+}
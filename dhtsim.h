@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __DHTSIM_H__
+#define __DHTSIM_H__
+
+#include <string>
+#include <set>
+#include <vector>
+using namespace std;
+
+#include "dhtring.h"
+
+#define DHTSIM_NODES     64     // default nodes on the circle, at most NETIMG_IDMAX+1
+#define DHTSIM_IMAGES  1000     // default images on the DHT
+#define DHTSIM_LOOKUPS 1000     // default lookups per round
+#define DHTSIM_ROUNDS     5     // default rounds of lookups
+#define DHTSIM_MISSPCT   10     // default percentage of lookups of images not on the DHT
+#define DHTSIM_LATENCY 20000    // default mean one-way latency, in usecs
+#define DHTSIM_SEED       1
+
+typedef struct {
+  int dso_nodes;        // -n
+  int dso_images;       // -k
+  int dso_lookups;      // -q
+  int dso_rounds;       // -r
+  int dso_misspct;      // -m
+  int dso_latency;      // -l
+  long dso_seed;        // -s
+  int dso_verbose;      // -v: show the nodes' own messages
+} dhtsim_opts;
+
+class dhtsim;
+
+/*
+ * simnode: a node of the simulated circle.  It is its own transport:
+ * its messages are handed by the dhtsim to the receiving simnode,
+ * see dhtsim::deliver().  It holds the images of dhtsim::images in its
+ * range and nothing else; it has no summaries and caches nothing.
+ */
+class simnode : public dhtxport, public dhtring {
+  dhtsim *sim;
+  int idx;                      // in dhtsim::nodes
+
+  int have(dhtsrch_t *srch);
+
+public:
+  int joined;                   // we have been welcomed
+
+  simnode(dhtsim *sim, int idx, unsigned char id);
+  unsigned char id() { return self.dhtn_ID; }
+  dhtnode_t *node() { return &self; }
+  void setid(unsigned char id);
+  void first();
+  void join(simnode *known);
+  void search(char *imgname);
+  void handle(int sender, char *msg, int len);
+  int right(const vector<unsigned char> &ring, int *succ, int *pred);
+
+  /* dhtxport, in memory */
+  int xsend(dhtnode_t *to, void *msg, int len, dhtmsg_t *redrt = NULL);
+  void xreply(int sender, dhtmsg_t *msg);
+  void xrelease(int sender);
+};
+
+/* the lookup in progress, see dhtsim::answered() */
+typedef struct {
+  int dsl_type;                 // DHTM_REPLY or DHTM_MISS once answered, 0 before
+  int dsl_hops;
+  unsigned long long dsl_at;    // virtual time of the answer
+} dhtsim_lookup;
+
+class dhtsim {
+  dhtsim_opts *opts;
+  vector<simnode *> nodes;      // by dhtn_port-1
+  set<string> images;           // on the DHT
+  vector<dhtmsg_t> redrts;      // per message being delivered, the REDRT it was answered with
+  vector<int> redirected;       //   and whether it was
+  dhtsim_lookup cur;
+
+  unsigned long long latency(simnode *from, simnode *to);
+  void ring(vector<unsigned char> *ids);
+
+public:
+  unsigned long long now;       // virtual time, in usecs
+  long msgs;                    // messages delivered, REDRTs included
+  long reids;
+
+  dhtsim(dhtsim_opts *opts);
+  ~dhtsim();
+  int holds(const char *imgname) { return images.count(imgname) > 0; }
+  int deliver(simnode *from, dhtnode_t *to, void *msg, int len, dhtmsg_t *redrt);
+  void redirect(int sender, dhtmsg_t *msg);
+  void answered(int type, int hops);
+  void reid(simnode *node);
+  int run();
+};
+
+#endif /* __DHTSIM_H__ */
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <string>
+#include <map>
+using namespace std;
+
+#include "ltga.h"
+#include "netimg.h"
+#include "imgcache.h"
+#include "metrics.h"
+
+imgcache::
+imgcache(long maxbytes)
+{
+  int i;
+
+  setbudget(maxbytes);
+  ic_bytes = 0L;
+  ic_clock = 0UL;
+  for (i = 0; i < IMGCACHE_NSHARDS; i++) {
+    pthread_mutex_init(&ic_shards[i].ics_lock, NULL);
+    pthread_cond_init(&ic_shards[i].ics_ready, NULL);
+    ic_shards[i].ics_head = ic_shards[i].ics_tail = NULL;
+  }
+}
+
+imgcache::
+~imgcache()
+{
+  int i;
+  imgcache_ent *ent, *next;
+
+  for (i = 0; i < IMGCACHE_NSHARDS; i++) {
+    for (ent = ic_shards[i].ics_head; ent; ent = next) {
+      next = ent->ice_next;
+      delete ent;
+    }
+    pthread_cond_destroy(&ic_shards[i].ics_ready);
+    pthread_mutex_destroy(&ic_shards[i].ics_lock);
+  }
+}
+
+/*
+ * unlink, pushfront: maintain the shard's LRU list.  Entries pushed
+ * to the front are stamped with the cache-wide clock, so that the
+ * lists of all shards can be compared by evict().
+ * Caller must hold the shard lock.
+ */
+void imgcache::
+unlink(imgcache_shard *shard, imgcache_ent *ent)
+{
+  if (ent->ice_prev) {
+    ent->ice_prev->ice_next = ent->ice_next;
+  } else {
+    shard->ics_head = ent->ice_next;
+  }
+  if (ent->ice_next) {
+    ent->ice_next->ice_prev = ent->ice_prev;
+  } else {
+    shard->ics_tail = ent->ice_prev;
+  }
+  ent->ice_prev = ent->ice_next = NULL;
+}
+
+void imgcache::
+pushfront(imgcache_shard *shard, imgcache_ent *ent)
+{
+  ent->ice_used = __sync_add_and_fetch(&ic_clock, 1UL);
+  ent->ice_prev = NULL;
+  ent->ice_next = shard->ics_head;
+  if (shard->ics_head) {
+    shard->ics_head->ice_prev = ent;
+  } else {
+    shard->ics_tail = ent;
+  }
+  shard->ics_head = ent;
+}
+
+/*
+ * coldest: the least recently used entry of the shard that can be
+ * dropped, i.e., is neither referenced nor being decoded, or NULL.
+ * Caller must hold the shard lock.
+ */
+imgcache_ent *imgcache::
+coldest(imgcache_shard *shard)
+{
+  imgcache_ent *ent;
+
+  for (ent = shard->ics_tail; ent; ent = ent->ice_prev) {
+    if (!ent->ice_refcnt && ent->ice_ready) {
+      return(ent);
+    }
+  }
+  return(NULL);
+}
+
+/*
+ * evict: drop unreferenced entries, least recently used first across
+ * all shards, until the cache is within its budget.  The budget is
+ * shared by the shards, so that an image larger than a shard's share
+ * of it can stay cached.  Referenced entries are skipped, so the cache
+ * can run over budget while images are being sent.
+ * Caller must hold no shard lock; only one is taken at a time.
+ */
+void imgcache::
+evict()
+{
+  imgcache_shard *shard, *victim;
+  imgcache_ent *ent;
+  unsigned long oldest;
+  int i;
+
+  while (ic_bytes > ic_budget) {
+    victim = NULL;
+    oldest = 0UL;
+    for (i = 0; i < IMGCACHE_NSHARDS; i++) {
+      shard = &ic_shards[i];
+      pthread_mutex_lock(&shard->ics_lock);
+      ent = coldest(shard);
+      if (ent && (!victim || ent->ice_used < oldest)) {
+        victim = shard;
+        oldest = ent->ice_used;
+      }
+      pthread_mutex_unlock(&shard->ics_lock);
+    }
+    if (!victim) {
+      return;
+    }
+
+    /* it may have been used since, then try again */
+    pthread_mutex_lock(&victim->ics_lock);
+    ent = coldest(victim);
+    if (ent && ent->ice_used == oldest) {
+      unlink(victim, ent);
+      victim->ics_index.erase(ent->ice_name);
+      __sync_sub_and_fetch(&ic_bytes, ent->ice_bytes);
+      delete ent;
+    }
+    pthread_mutex_unlock(&victim->ics_lock);
+  }
+}
+
+/*
+ * acquire: return a referenced handle on the decoded image "imgname",
+ * decoding it from "pathname" if it is not already cached.  If another
+ * thread is already decoding the same image, wait for its result
+ * instead of decoding it a second time.  The decode itself is done
+ * without holding the shard lock.  An RLE image is decoded in parallel
+ * if an earlier decode left its checkpoints, see setindex().
+ *
+ * Returns NULL if the image cannot be decoded.
+ */
+imgcache_ent *imgcache::
+acquire(unsigned char id, const char *imgname, const string &pathname)
+{
+  imgcache_shard *shard = &ic_shards[id % IMGCACHE_NSHARDS];
+  map<string, imgcache_ent *>::iterator it;
+  map<string, LTGAIndex>::iterator iit;
+  imgcache_ent *ent;
+  LTGAIndex index;
+  int failed;
+  unsigned long long start;
+
+  pthread_mutex_lock(&shard->ics_lock);
+  it = shard->ics_index.find(imgname);
+  if (it != shard->ics_index.end()) {
+    ent = it->second;
+    ent->ice_refcnt++;
+    unlink(shard, ent);
+    pushfront(shard, ent);
+    while (!ent->ice_ready) {
+      pthread_cond_wait(&shard->ics_ready, &shard->ics_lock);
+    }
+    failed = ent->ice_failed;
+    pthread_mutex_unlock(&shard->ics_lock);
+    if (failed) {
+      release(ent);
+      return(NULL);
+    }
+    return(ent);
+  }
+
+  /* miss: publish a placeholder so concurrent callers wait on our decode */
+  ent = new imgcache_ent;
+  strncpy(ent->ice_name, imgname, NETIMG_MAXFNAME-1);
+  ent->ice_name[NETIMG_MAXFNAME-1] = '\0';
+  ent->ice_ID = id;
+  ent->ice_bytes = 0L;
+  ent->ice_refcnt = 1;
+  ent->ice_ready = ent->ice_failed = ent->ice_stale = 0;
+  shard->ics_index[ent->ice_name] = ent;
+  pushfront(shard, ent);
+  iit = shard->ics_rleidx.find(imgname);
+  if (iit != shard->ics_rleidx.end()) {
+    index = iit->second;
+  }
+  pthread_mutex_unlock(&shard->ics_lock);
+
+  start = metrics_now();
+  failed = !ent->ice_img.ReadFile(pathname, &index);
+  if (!failed) {
+    metrics_since(METRICS_DECODE, start);
+  }
+
+  pthread_mutex_lock(&shard->ics_lock);
+  if (!failed && !ent->ice_stale && index.checkpoints.size() > 1) {
+    shard->ics_rleidx[ent->ice_name] = index;
+  }
+  ent->ice_ready = 1;
+  ent->ice_failed = failed;
+  if (failed) {
+    /* don't cache failures, the file may show up later */
+    if (!ent->ice_stale) {
+      unlink(shard, ent);
+      shard->ics_index.erase(ent->ice_name);
+      ent->ice_stale = 1;
+    }
+  } else {
+    ent->ice_bytes = (long) ent->ice_img.GetImageWidth() *
+      ent->ice_img.GetImageHeight() * (ent->ice_img.GetPixelDepth()/8);
+    if (!ent->ice_stale) {
+      __sync_add_and_fetch(&ic_bytes, ent->ice_bytes);
+    }
+  }
+  pthread_cond_broadcast(&shard->ics_ready);
+  pthread_mutex_unlock(&shard->ics_lock);
+
+  if (failed) {
+    release(ent);
+    return(NULL);
+  }
+  evict();
+  return(ent);
+}
+
+/*
+ * release: drop a reference obtained from acquire().
+ */
+void imgcache::
+release(imgcache_ent *ent)
+{
+  imgcache_shard *shard;
+  int unused = 0;
+
+  if (!ent) {
+    return;
+  }
+  shard = &ic_shards[ent->ice_ID % IMGCACHE_NSHARDS];
+
+  pthread_mutex_lock(&shard->ics_lock);
+  if (--ent->ice_refcnt == 0) {
+    if (ent->ice_stale) {
+      delete ent;
+    } else {
+      unused = 1;
+    }
+  }
+  pthread_mutex_unlock(&shard->ics_lock);
+
+  if (unused) {
+    evict();
+  }
+}
+
+/*
+ * invalidate: forget the decoded copy of "imgname", e.g., because the
+ * file has changed on disk.  Holders of a handle keep using their copy;
+ * it is freed when the last of them releases it.
+ */
+void imgcache::
+invalidate(unsigned char id, const char *imgname)
+{
+  imgcache_shard *shard = &ic_shards[id % IMGCACHE_NSHARDS];
+  map<string, imgcache_ent *>::iterator it;
+  imgcache_ent *ent;
+
+  pthread_mutex_lock(&shard->ics_lock);
+  it = shard->ics_index.find(imgname);
+  if (it != shard->ics_index.end()) {
+    ent = it->second;
+    shard->ics_index.erase(it);
+    unlink(shard, ent);
+    if (ent->ice_ready && !ent->ice_failed) {
+      __sync_sub_and_fetch(&ic_bytes, ent->ice_bytes);
+    }
+    if (ent->ice_refcnt) {
+      ent->ice_stale = 1;
+    } else {
+      delete ent;
+    }
+  }
+  shard->ics_rleidx.erase(imgname);
+  pthread_mutex_unlock(&shard->ics_lock);
+}
+
+/*
+ * setindex: remember the checkpoints of RLE image "imgname", e.g., as
+ * recorded by another decode of it, so that acquire() can decode it in
+ * parallel.  Ignored unless there are at least two checkpoints.
+ */
+void imgcache::
+setindex(unsigned char id, const char *imgname, const LTGAIndex &index)
+{
+  imgcache_shard *shard = &ic_shards[id % IMGCACHE_NSHARDS];
+
+  if (index.checkpoints.size() < 2) {
+    return;
+  }
+  pthread_mutex_lock(&shard->ics_lock);
+  shard->ics_rleidx[imgname] = index;
+  pthread_mutex_unlock(&shard->ics_lock);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __IMGCACHE_H__
+#define __IMGCACHE_H__
+
+#include <pthread.h>
+#include <string>
+#include <map>
+using namespace std;
+
+#include "ltga.h"
+#include "netimg.h"
+
+#define IMGCACHE_NSHARDS     8                  // shard picked by image ID
+#define IMGCACHE_MAXBYTES  (64L*1024L*1024L)    // default budget, shared by all shards
+
+/*
+ * A decoded image.  Entries are handed out by imgcache::acquire()
+ * with their reference count bumped and must be given back with
+ * imgcache::release().  An entry is never freed while referenced.
+ */
+typedef struct imgcache_ent {
+  char ice_name[NETIMG_MAXFNAME];
+  unsigned char ice_ID;
+  LTGA ice_img;
+  long ice_bytes;        // bytes charged against the budget
+  unsigned long ice_used;  // imgcache clock when last put at the LRU head
+  int ice_refcnt;
+  int ice_ready;         // decode finished (successfully or not)
+  int ice_failed;        // decode failed, ice_img is not loaded
+  int ice_stale;         // no longer in the index, free on last release
+  struct imgcache_ent *ice_prev, *ice_next;  // LRU list, head is most recent
+} imgcache_ent;
+
+typedef struct {
+  pthread_mutex_t ics_lock;
+  pthread_cond_t ics_ready;     // signalled when a decode finishes
+  map<string, imgcache_ent *> ics_index;
+  imgcache_ent *ics_head, *ics_tail;
+  map<string, LTGAIndex> ics_rleidx;  // of RLE images, kept across evictions
+} imgcache_shard;
+
+class imgcache {
+  long ic_budget;                 // byte budget of the whole cache
+  volatile long ic_bytes;         // charged by all shards, see evict()
+  volatile unsigned long ic_clock;  // stamps LRU heads, see pushfront()
+  imgcache_shard ic_shards[IMGCACHE_NSHARDS];
+
+  void unlink(imgcache_shard *shard, imgcache_ent *ent);
+  void pushfront(imgcache_shard *shard, imgcache_ent *ent);
+  imgcache_ent *coldest(imgcache_shard *shard);
+  void evict();
+
+public:
+  imgcache(long maxbytes = IMGCACHE_MAXBYTES);
+  ~imgcache();
+  void setbudget(long maxbytes) { ic_budget = maxbytes; }
+  imgcache_ent *acquire(unsigned char id, const char *imgname, const string &pathname);
+  void release(imgcache_ent *ent);
+  void invalidate(unsigned char id, const char *imgname);
+  void setindex(unsigned char id, const char *imgname, const LTGAIndex &index);
+};
+
+#endif /* __IMGCACHE_H__ */
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <string.h>
+#ifdef NETIMG_LZ4
+#include <lz4.h>
+#endif
+#ifdef NETIMG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "netimg.h"
+#include "imgcodec.h"
+
+/*
+ * imgcodec_supported: the codecs this binary can encode and decode.
+ */
+unsigned char
+imgcodec_supported()
+{
+  unsigned char codecs = NETIMG_CODEC_RLE;
+
+#ifdef NETIMG_LZ4
+  codecs |= NETIMG_CODEC_LZ4;
+#endif
+#ifdef NETIMG_ZSTD
+  codecs |= NETIMG_CODEC_ZSTD;
+#endif
+  return(codecs);
+}
+
+/*
+ * imgcodec_pick: the best codec out of those "offered" by the peer
+ * that we also support, by compression ratio, or NETIMG_CODEC_RAW.
+ */
+unsigned char
+imgcodec_pick(unsigned char offered)
+{
+  offered &= imgcodec_supported();
+
+  if (offered & NETIMG_CODEC_ZSTD) {
+    return(NETIMG_CODEC_ZSTD);
+  }
+  if (offered & NETIMG_CODEC_LZ4) {
+    return(NETIMG_CODEC_LZ4);
+  }
+  if (offered & NETIMG_CODEC_RLE) {
+    return(NETIMG_CODEC_RLE);
+  }
+  return(NETIMG_CODEC_RAW);
+}
+
+/*
+ * imgcodec_striperows: rows per stripe, so that a stripe holds about
+ * NETIMG_STRIPE bytes of pixels, but at least one row.
+ */
+int
+imgcodec_striperows(int width, int depth)
+{
+  int rows = NETIMG_STRIPE/(width*depth);
+
+  return(rows > 0 ? rows : 1);
+}
+
+static inline int
+imgcodec_pxeq(const char *a, const char *b, int depth)
+{
+  switch (depth) {
+  case 1:
+    return(a[0] == b[0]);
+  case 3:
+    return(a[0] == b[0] && a[1] == b[1] && a[2] == b[2]);
+  case 4:
+    return(!memcmp(a, b, 4));
+  default:
+    return(!memcmp(a, b, depth));
+  }
+}
+
+/*
+ * imgcodec_rleenc: same packets as RLE TGA files: a count byte with the
+ * high bit set is followed by one pixel repeated (count&0x7f)+1 times,
+ * otherwise by count+1 literal pixels.  Returns the encoded length, or
+ * -1 if it would exceed "cap".
+ */
+static long
+imgcodec_rleenc(int depth, const char *src, long rawlen, char *dst, long cap)
+{
+  long npx = rawlen/depth, i, j, lit;
+  char *d = dst, *end = dst+cap;
+
+  for (i = 0; i < npx; ) {
+    /* run of identical pixels starting at i */
+    for (j = i+1; j < npx && j-i < 128 &&
+           imgcodec_pxeq(src+j*depth, src+i*depth, depth); j++);
+    if (j-i > 1) {
+      if (end-d < 1+depth) {
+        return(-1);
+      }
+      *d++ = (char) (0x80 | (j-i-1));
+      memcpy(d, src+i*depth, depth);
+      d += depth;
+      i = j;
+      continue;
+    }
+
+    /* literals up to the next run of at least 2 */
+    for (lit = i+1; lit < npx && lit-i < 128 &&
+           !(lit+1 < npx && imgcodec_pxeq(src+lit*depth, src+(lit+1)*depth, depth)); lit++);
+    if (end-d < 1+(lit-i)*depth) {
+      return(-1);
+    }
+    *d++ = (char) (lit-i-1);
+    memcpy(d, src+i*depth, (lit-i)*depth);
+    d += (lit-i)*depth;
+    i = lit;
+  }
+
+  return(d-dst);
+}
+
+/*
+ * imgcodec_rledec: inverse of imgcodec_rleenc().  Returns "rawlen",
+ * or -1 if "src" doesn't decode to exactly "rawlen" bytes.
+ */
+static long
+imgcodec_rledec(int depth, const char *src, long len, char *dst, long rawlen)
+{
+  const char *s = src, *send = src+len;
+  char *d = dst, *dend = dst+rawlen;
+  long n, k;
+
+  while (s < send) {
+    n = ((unsigned char) *s & 0x7f) + 1;
+    if (*s++ & 0x80) {
+      if (send-s < depth || dend-d < n*depth) {
+        return(-1);
+      }
+      if (depth == 1) {
+        memset(d, *s, n);
+        d += n;
+      } else {
+        for (k = 0; k < n; k++, d += depth) {
+          memcpy(d, s, depth);
+        }
+      }
+      s += depth;
+    } else {
+      if (send-s < n*depth || dend-d < n*depth) {
+        return(-1);
+      }
+      memcpy(d, s, n*depth);
+      s += n*depth;
+      d += n*depth;
+    }
+  }
+
+  return(d == dend ? rawlen : -1);
+}
+
+/*
+ * imgcodec_encode: compress the "rawlen"-byte stripe at "src" into at
+ * most "cap" bytes at "dst" with "codec".  Returns the compressed
+ * length, or -1 if it doesn't fit or isn't smaller than the stripe,
+ * in which case the stripe should be sent raw.
+ */
+long
+imgcodec_encode(unsigned char codec, int depth, const char *src, long rawlen,
+                char *dst, long cap)
+{
+  long len = -1;
+
+  switch (codec) {
+  case NETIMG_CODEC_RLE:
+    len = imgcodec_rleenc(depth, src, rawlen, dst, cap);
+    break;
+#ifdef NETIMG_LZ4
+  case NETIMG_CODEC_LZ4:
+    len = LZ4_compress_default(src, dst, (int) rawlen, (int) cap);
+    len = len > 0 ? len : -1;
+    break;
+#endif
+#ifdef NETIMG_ZSTD
+  case NETIMG_CODEC_ZSTD:
+    len = (long) ZSTD_compress(dst, cap, src, rawlen, IMGCODEC_ZSTDLVL);
+    len = ZSTD_isError((size_t) len) ? -1 : len;
+    break;
+#endif
+  default:
+    break;
+  }
+
+  return(len < rawlen ? len : -1);
+}
+
+/*
+ * imgcodec_decode: decompress the "len"-byte stripe at "src", encoded
+ * with "codec", into the "rawlen" bytes at "dst".  Returns "rawlen", or
+ * -1 if the stripe is malformed or the codec isn't supported.
+ */
+long
+imgcodec_decode(unsigned char codec, int depth, const char *src, long len,
+                char *dst, long rawlen)
+{
+  long got = -1;
+
+  switch (codec) {
+  case NETIMG_CODEC_RAW:
+    if (len == rawlen) {
+      memcpy(dst, src, rawlen);
+      got = rawlen;
+    }
+    break;
+  case NETIMG_CODEC_RLE:
+    got = imgcodec_rledec(depth, src, len, dst, rawlen);
+    break;
+#ifdef NETIMG_LZ4
+  case NETIMG_CODEC_LZ4:
+    got = LZ4_decompress_safe(src, dst, (int) len, (int) rawlen);
+    break;
+#endif
+#ifdef NETIMG_ZSTD
+  case NETIMG_CODEC_ZSTD:
+    got = (long) ZSTD_decompress(dst, rawlen, src, len);
+    got = ZSTD_isError((size_t) got) ? -1 : got;
+    break;
+#endif
+  default:
+    break;
+  }
+
+  return(got == rawlen ? rawlen : -1);
+}
+
+/* Adam7: where each pass starts, its pixel spacing, and the block
+   each of its pixels stands for until later passes fill it in */
+static const int imgcodec_x0[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int imgcodec_y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int imgcodec_dx[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const int imgcodec_dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+static const int imgcodec_bw[7] = { 8, 4, 4, 2, 2, 1, 1 };
+static const int imgcodec_bh[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+/*
+ * imgcodec_interlace: reorder the "width" by "height" image at "src"
+ * into the Adam7 pass order at "dst": every 8th pixel of every 8th row
+ * first, and so on, the pixels of each pass row by row.  The first 1/64
+ * of the stream already covers the whole image, and the first 1/4 of
+ * it every other pixel of every other row.
+ */
+void
+imgcodec_interlace(const char *src, char *dst, int width, int height, int depth)
+{
+  int p, x, y;
+  long rowlen = (long) width*depth;
+
+  for (p = 0; p < 7; p++) {
+    for (y = imgcodec_y0[p]; y < height; y += imgcodec_dy[p]) {
+      for (x = imgcodec_x0[p]; x < width; x += imgcodec_dx[p]) {
+        memcpy(dst, src+y*rowlen+(long) x*depth, depth);
+        dst += depth;
+      }
+    }
+  }
+
+  return;
+}
+
+/*
+ * imgcodec_startpass: point "cur" at the first pixel of pass "p", or
+ * of the first pass after it that isn't empty for small images.
+ */
+static void
+imgcodec_startpass(imgcodec_cursor *cur, int width, int height, int p)
+{
+  for (; p < 7 && (imgcodec_x0[p] >= width || imgcodec_y0[p] >= height); p++);
+  cur->icc_pass = p;
+  if (p < 7) {
+    cur->icc_x = imgcodec_x0[p];
+    cur->icc_y = imgcodec_y0[p];
+  }
+}
+
+/*
+ * imgcodec_cursorinit: point "cur" at the first pixel of the
+ * interlaced stream.
+ */
+void
+imgcodec_cursorinit(imgcodec_cursor *cur, int width, int height)
+{
+  imgcodec_startpass(cur, width, height, 0);
+}
+
+/*
+ * imgcodec_deinterlace: put the next "npx" pixels of the interlaced
+ * stream, at "src", in place in the image at "dst", advancing "cur".
+ * Each pixel is replicated over the block it stands for, so the image
+ * is complete, if coarse, after each pass.
+ */
+void
+imgcodec_deinterlace(imgcodec_cursor *cur, const char *src, long npx,
+                     char *dst, int width, int height, int depth)
+{
+  int p, bw, bh, i, j;
+  long rowlen = (long) width*depth;
+  char *d;
+
+  for (; npx > 0 && cur->icc_pass < 7; npx--, src += depth) {
+    p = cur->icc_pass;
+    bw = width-cur->icc_x < imgcodec_bw[p] ? width-cur->icc_x : imgcodec_bw[p];
+    bh = height-cur->icc_y < imgcodec_bh[p] ? height-cur->icc_y : imgcodec_bh[p];
+    d = dst+cur->icc_y*rowlen+(long) cur->icc_x*depth;
+    for (j = 0; j < bh; j++, d += rowlen) {
+      for (i = 0; i < bw; i++) {
+        memcpy(d+i*depth, src, depth);
+      }
+    }
+
+    cur->icc_x += imgcodec_dx[p];
+    if (cur->icc_x >= width) {
+      cur->icc_y += imgcodec_dy[p];
+      cur->icc_x = imgcodec_x0[p];
+      if (cur->icc_y >= height) {
+        imgcodec_startpass(cur, width, height, p+1);
+      }
+    }
+  }
+
+  return;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __IMGCODEC_H__
+#define __IMGCODEC_H__
+
+#include "netimg.h"
+
+#define IMGCODEC_ZSTDLVL  3     // zstd's default, fast enough to compress per request
+
+/*
+ * Stripe codecs shared by dhtn and dhtc, see istripe_t in netimg.h.
+ * A stripe holds whole "depth"-byte pixels.
+ */
+extern unsigned char imgcodec_supported();
+extern unsigned char imgcodec_pick(unsigned char offered);
+extern int imgcodec_striperows(int width, int depth);
+extern long imgcodec_encode(unsigned char codec, int depth, const char *src, long rawlen,
+                            char *dst, long cap);
+extern long imgcodec_decode(unsigned char codec, int depth, const char *src, long len,
+                            char *dst, long rawlen);
+
+/*
+ * Adam7 interlacing, see imgcodec_interlace().  The cursor tracks the
+ * next pixel of the interlaced stream to be put in place.
+ */
+typedef struct {
+  int icc_pass;             // 0 to 6, 7 once all pixels are placed
+  int icc_x, icc_y;         // image coordinates of the next pixel
+} imgcodec_cursor;
+
+extern void imgcodec_interlace(const char *src, char *dst, int width, int height, int depth);
+extern void imgcodec_cursorinit(imgcodec_cursor *cur, int width, int height);
+extern void imgcodec_deinterlace(imgcodec_cursor *cur, const char *src, long npx,
+                                 char *dst, int width, int height, int depth);
+
+#endif /* __IMGCODEC_H__ */
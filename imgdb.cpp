@@ -21,11 +21,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>          // time()
 #include <limits.h>        // LONG_MAX
 #include <iostream>
-#include <iomanip>         // setw()
 #include <fstream>
+#include <set>
+#include <vector>
 using namespace std;
+#include <errno.h>
+#include <fcntl.h>         // open(), faccessat()
+#include <pthread.h>
+#include <sys/stat.h>      // stat()
+#include <arpa/inet.h>     // htons(), ntohl()
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -36,16 +46,37 @@ using namespace std;
 #include "netimg.h"
 #include "hash.h"
 #include "imgdb.h"
+#include "metrics.h"
+#include "nlog.h"
   
 
 imgdb::
-imgdb()
+imgdb() : imgdb_bloomfilter(IMGDB_MAXDBSIZE+IMGDB_MAXCACHED)
 {
   imgdb_folder = "images";
   imgdb_IDrange[IMGDB_IDRBEG] = 0;
   imgdb_IDrange[IMGDB_IDREND] = 0;
   imgdb_size = 0;
-  imgdb_bloomfilter = 0L;
+  imgdb_ncached = 0;
+  imgdb_clock = 0L;
+  imgdb_gen = (unsigned int) time(NULL);  // still ahead after a restart
+  imgdb_curimg = NULL;
+  imgdb_blobfd = -1;
+  imgdb_bloboff = 0;
+  imgdb_bloblen = 0L;
+  imgdb_fitw = imgdb_fith = 0;
+  imgdb_scaledw = imgdb_scaledh = 0;
+  memset(&imgdb_curstat, 0, sizeof(imgdb_curstat));
+  imgdb_watchfd = -1;
+}
+
+imgdb::
+~imgdb()
+{
+  imgdb_cache.release(imgdb_curimg);
+  if (imgdb_watchfd >= 0) {
+    close(imgdb_watchfd);
+  }
 }
 
 /*
@@ -69,25 +100,142 @@ loadimg(unsigned char id, unsigned char *md, char *fname)
   net_assert(img_fs.fail(), "imgdb::loadimg: fail to open image file");
   img_fs.close();
 
+  addimg(id, md, fname);
+
+  return;
+}
+
+/*
+ * readable: whether image fname can be read from imgdb_folder.  Unlike
+ * loadimg(), doesn't terminate the process if it can't, for images the
+ * folder watch reported, which may be gone by now.
+ */
+int imgdb::
+readable(char *fname)
+{
+  string pathname = imgdb_folder+IMGDB_DIRSEP+fname;
+
+  return(access(pathname.c_str(), R_OK) == 0);
+}
+
+/*
+ * addimg: the part of loadimg() after the image file has been found.
+ */
+void imgdb::
+addimg(unsigned char id, unsigned char *md, char *fname)
+{
   /* if the file can be opened, store the image name, without the folder name,
      into the database */
   strcpy(imgdb_db[imgdb_size].img_name, fname);
 
   /* store its ID also */
   imgdb_db[imgdb_size].img_ID = id;
+  imgdb_db[imgdb_size].img_cached = 0;
+  imgdb_db[imgdb_size].img_atime = imgdb_clock;
 
   /* update the bloom filter to record the presence of the image in the DB. */
-  imgdb_bloomfilter |= (1L << (int) bfIDX(BFIDX1, md)) |
-    (1L << (int) bfIDX(BFIDX2, md)) | (1L << (int) bfIDX(BFIDX3, md));
+  imgdb_bloomfilter.add(md);
 
   imgdb_size++;
 
   return;
 }
 
+/*
+ * removeimg: remove the idx-th image from imgdb_db, taking it out
+ * of the Bloom Filter and dropping its decoded copy, if any.
+ * The last image in the DB takes its place.
+ */
+void imgdb::
+removeimg(int idx)
+{
+  unsigned char md[SHA1_MDLEN];
+
+  SHA1((unsigned char *) imgdb_db[idx].img_name, strlen(imgdb_db[idx].img_name), md);
+  imgdb_bloomfilter.remove(md);
+  imgdb_cache.invalidate(imgdb_db[idx].img_ID, imgdb_db[idx].img_name);
+  if (imgdb_db[idx].img_cached) {
+    imgdb_ncached--;
+  }
+
+  imgdb_size--;
+  if (idx != imgdb_size) {
+    memcpy(&imgdb_db[idx], &imgdb_db[imgdb_size], sizeof(image_t));
+  }
+
+  return;
+}
+
+/*
+ * cacheimg:
+ * like loadimg(), but for an image this node got a REPLY for from
+ * the DHT.  At most IMGDB_MAXCACHED such images are kept; when full,
+ * the least recently hit cached image is evicted to make room.
+ * Images already in the DB are left alone.
+ */
+void imgdb::
+cacheimg(unsigned char id, unsigned char *md, char *fname)
+{
+  int i, lru = -1;
+
+  for (i = 0; i < imgdb_size; i++) {
+    if (imgdb_db[i].img_ID == id && !strcmp(imgdb_db[i].img_name, fname)) {
+      imgdb_db[i].img_atime = ++imgdb_clock;
+      return;
+    }
+    if (imgdb_db[i].img_cached &&
+        (lru < 0 || imgdb_db[i].img_atime < imgdb_db[lru].img_atime)) {
+      lru = i;
+    }
+  }
+
+  if (imgdb_ncached >= IMGDB_MAXCACHED) {
+    removeimg(lru);
+  }
+
+  loadimg(id, md, fname);
+  imgdb_db[imgdb_size-1].img_cached = 1;
+  imgdb_db[imgdb_size-1].img_atime = ++imgdb_clock;
+  imgdb_ncached++;
+
+  return;
+}
+
+/*
+ * imgdb_probe: worker of loaddb().  Claim IMGDB_LDCHUNK names of
+ * FILELIST.txt at a time and, for each, compute its SHA1 and object ID
+ * and, if the ID is in range, check that the image file is readable.
+ * Workers only write to their own entries of ld_ents, so the results
+ * don't depend on how the names were split among workers.
+ */
+static void *
+imgdb_probe(void *arg)
+{
+  imgdb_ldjob_t *job = (imgdb_ldjob_t *) arg;
+  imgdb_ldent_t *ent;
+  int i, n;
+
+  while ((i = __sync_fetch_and_add(&job->ld_next, IMGDB_LDCHUNK)) < job->ld_n) {
+    n = i+IMGDB_LDCHUNK < job->ld_n ? i+IMGDB_LDCHUNK : job->ld_n;
+    for (; i < n; i++) {
+      ent = &job->ld_ents[i];
+      SHA1((unsigned char *) (*job->ld_names)[i].c_str(), (*job->ld_names)[i].size(), ent->le_md);
+      ent->le_ID = ID(ent->le_md);
+      ent->le_inrange = ID_inrange(ent->le_ID, job->ld_beg, job->ld_end);
+      ent->le_readable = ent->le_inrange &&
+        !faccessat(job->ld_dirfd, (*job->ld_names)[i].c_str(), R_OK, 0);
+    }
+  }
+
+  return(NULL);
+}
+
 /*
  * loaddb(): load the image database with the ID and name of all images whose ID are
  * within the ID range of this node.
+ * FILELIST.txt is read in whole first.  Hashing the names and probing the
+ * image files is then split across up to IMGDB_LOADERS threads, and the
+ * results are added to the DB in FILELIST.txt order, as if done serially.
  * See inline comments below
  */
 void
@@ -98,6 +246,10 @@ loaddb()
   char fname[NETIMG_MAXFNAME];
   string pathname;
   unsigned char id, md[SHA1_MDLEN];
+  vector<string> names;
+  imgdb_ldjob_t job;
+  pthread_t tids[IMGDB_LOADERS];
+  int i, nthreads;
 
   /* imgdb_folder contains the name of the folder where the image files are, e.g.,
      "images".  We assume there's a file in that folder whose name is specified by
@@ -111,39 +263,218 @@ loaddb()
   /* After FILELIST.txt is open for reading, we parse it one line at a time,
      each line is assumed to contain the name of one image file.
   */
-  cerr << "Loading DB IDs in (" << (int) imgdb_IDrange[IMGDB_IDRBEG] <<
-    ", " << (int) imgdb_IDrange[IMGDB_IDREND] << "]\n";
-  do {
+  nlog(NLOG_INFO, "Loading DB IDs in (%d, %d]\n",
+       (int) imgdb_IDrange[IMGDB_IDRBEG], (int) imgdb_IDrange[IMGDB_IDREND]);
+  while (1) {
     list_fs.getline(fname, NETIMG_MAXFNAME);
     if (list_fs.eof()) break;
     net_assert(list_fs.fail(), "imgdb::loaddb: image file name longer than NETIMG_MAXFNAME");
 
-    /* for each image, we compute its SHA1 from its file name, without the image folder path. */
-    SHA1((unsigned char *) fname, strlen(fname), md);
+    /* images that came or went while we watched imgdb_folder are handled below */
+    if (imgdb_removed.count(fname) || imgdb_added.count(fname)) continue;
 
-    /* from the SHA1, we compute an object ID */
-    id = ID(md);
-    cerr << "  (" << setw(3) << (int) id << ") " << fname;
+    names.push_back(fname);
+  }
+  list_fs.close();
+
+  /* for each image, we compute its SHA1 from its file name, without the image folder path,
+     and from the SHA1, we compute an object ID.  If the object ID is in the range of this
+     node, check that its file is there. */
+  job.ld_names = &names;
+  job.ld_ents = new imgdb_ldent_t[names.size()+1];
+  job.ld_n = names.size();
+  job.ld_next = 0;
+  job.ld_beg = imgdb_IDrange[IMGDB_IDRBEG];
+  job.ld_end = imgdb_IDrange[IMGDB_IDREND];
+  job.ld_dirfd = open(imgdb_folder.c_str(), O_RDONLY);
+  net_assert((job.ld_dirfd < 0), "imgdb::loaddb: fail to open image folder");
 
-    /* if the object ID is in the range of this node, add its ID and name to the database */
-    if (ID_inrange(id, imgdb_IDrange[IMGDB_IDRBEG], imgdb_IDrange[IMGDB_IDREND])) {
-      cerr << " *in range*";
-      loadimg(id, md, fname);
+  nthreads = (job.ld_n + IMGDB_LDCHUNK-1)/IMGDB_LDCHUNK;
+  i = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = nthreads < i ? nthreads : i;
+  nthreads = nthreads < IMGDB_LOADERS ? nthreads : IMGDB_LOADERS;
+  for (i = 1; i < nthreads; i++) {
+    if (pthread_create(&tids[i], NULL, imgdb_probe, &job)) {
+      break;
     }
-    cerr << endl;
-  } while (imgdb_size < IMGDB_MAXDBSIZE);
+  }
+  nthreads = i;
+  imgdb_probe(&job);     // this thread works too
+  for (i = 1; i < nthreads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  close(job.ld_dirfd);
+
+  /* add the images in range to the database, in FILELIST.txt order */
+  for (i = 0; i < job.ld_n && imgdb_size < IMGDB_MAXDBSIZE; i++) {
+    nlog(NLOG_DEBUG, "  (%3d) %s%s\n", (int) job.ld_ents[i].le_ID, names[i].c_str(),
+         job.ld_ents[i].le_inrange ? " *in range*" : "");
+    if (job.ld_ents[i].le_inrange) {
+      if (!job.ld_ents[i].le_readable) {
+        errno = ENOENT;
+        net_assert(1, "imgdb::loadimg: fail to open image file");
+      }
+      strcpy(fname, names[i].c_str());
+      addimg(job.ld_ents[i].le_ID, job.ld_ents[i].le_md, fname);
+    }
+  }
+  delete [] job.ld_ents;
+
+  /* images added to imgdb_folder since we started watching it */
+  for (set<string>::iterator it = imgdb_added.begin();
+       it != imgdb_added.end() && imgdb_size < IMGDB_MAXDBSIZE; it++) {
+    strcpy(fname, it->c_str());
+    SHA1((unsigned char *) fname, strlen(fname), md);
+    id = ID(md);
+    if (ID_inrange(id, imgdb_IDrange[IMGDB_IDRBEG], imgdb_IDrange[IMGDB_IDREND]) &&
+        readable(fname)) {      // else its removal is yet to be handled
+      nlog(NLOG_DEBUG, "  (%3d) %s *in range* *added*\n", (int) id, fname);
+      addimg(id, md, fname);
+    }
+  }
 
-  cerr << imgdb_size << " images loaded." << endl;
+  nlog(NLOG_INFO, "%d images loaded.\n", imgdb_size);
   if (imgdb_size == IMGDB_MAXDBSIZE) {
-    cerr << "Image DB full, some image could have been left out." << endl;
+    nlog(NLOG_WARN, "Image DB full, some image could have been left out.\n");
   }
-  cerr << endl;
-  
-  list_fs.close();
+
+  ingest();
   
   return;
 }
 
+/*
+ * halve: downscale the "width" by "height" image at "src" to half its
+ * size, rounded up, at "dst", averaging each 2x2 block of pixels.  The
+ * last column and row of an odd-sized image are averaged with themselves.
+ */
+void
+imgdb::
+halve(const char *src, int width, int height, int depth, char *dst)
+{
+  const unsigned char *r0, *r1;
+  unsigned char *d = (unsigned char *) dst;
+  int x, y, c, x1, dw = (width+1)/2, dh = (height+1)/2;
+  long rowlen = (long) width*depth;
+
+  for (y = 0; y < dh; y++) {
+    r0 = (const unsigned char *) src + 2*y*rowlen;
+    r1 = 2*y+1 < height ? r0+rowlen : r0;
+    for (x = 0; x < dw; x++) {
+      x1 = 2*x+1 < width ? (2*x+1)*depth : 2*x*depth;
+      for (c = 0; c < depth; c++) {
+        *d++ = (unsigned char) ((r0[2*x*depth+c] + r0[x1+c] +
+                                 r1[2*x*depth+c] + r1[x1+c] + 2) >> 2);
+      }
+    }
+  }
+
+  return;
+}
+
+/*
+ * ingest: make sure every image in the DB has a wire-ready blob in
+ * imgdb_store, so that serving it needs no decoding.  Only images
+ * whose blob is missing or older than their image file are decoded.
+ * Each image also gets downscaled variants, each half the size of the
+ * one before, down to IMGDB_MINVARIANT pixels, for clients with small
+ * displays, see setfit().  The checkpoints of RLE images found along
+ * the way go to the image cache, should it ever have to decode them.
+ * If the store can't be written, e.g., the image folder is read-only,
+ * images are served from the image cache instead, and only indexed
+ * here, so that the cache's first decode of each can be parallel.
+ */
+void
+imgdb::
+ingest()
+{
+  int i, n, level, w, h, depth;
+  LTGA img;
+  LTGAIndex index;
+  imsg_t imsg;
+  double imgsize;
+  vector<char> cur, next;
+  unsigned long long start;
+
+  imgdb_store.open(imgdb_folder);
+
+  for (i = n = 0; i < imgdb_size; i++) {
+    n += !imgdb_db[i].img_cached && !imgdb_store.fresh(imgdb_db[i].img_name);
+  }
+  if (!n) {
+    return;
+  }
+
+  if (imgdb_store.begin() < 0) {
+    perror("imgdb::ingest: cannot create " IMGSTORE_FILE);
+    for (i = 0; i < imgdb_size; i++) {
+      if (!imgdb_db[i].img_cached &&
+          img.IndexFile(imgdb_folder+IMGDB_DIRSEP+imgdb_db[i].img_name, index)) {
+        imgdb_cache.setindex(imgdb_db[i].img_ID, imgdb_db[i].img_name, index);
+      }
+    }
+    return;
+  }
+
+  /* another node sharing the folder may have done some of the work
+     while we waited for the store, see imgstore::begin() */
+  for (i = n = 0; i < imgdb_size; i++) {
+    n += !imgdb_db[i].img_cached && !imgdb_store.fresh(imgdb_db[i].img_name);
+  }
+  if (!n) {
+    imgdb_store.abort();
+    return;
+  }
+  for (i = 0; i < imgdb_size; i++) {
+    if (imgdb_db[i].img_cached || imgdb_store.fresh(imgdb_db[i].img_name)) {
+      continue;
+    }
+    start = metrics_now();
+    if (!img.LoadFromFile(imgdb_folder+IMGDB_DIRSEP+imgdb_db[i].img_name, &index)) {
+      nlog(NLOG_WARN, "imgdb::ingest: cannot decode %s\n", imgdb_db[i].img_name);
+      n--;
+      continue;
+    }
+    metrics_since(METRICS_DECODE, start);
+    imgdb_cache.setindex(imgdb_db[i].img_ID, imgdb_db[i].img_name, index);
+    memset(&imsg, 0, sizeof(imsg_t));
+    imgsize = marshall_img(&img, &imsg);
+    imsg.im_vers = NETIMG_VERS;
+    w = imsg.im_width;
+    h = imsg.im_height;
+    depth = imsg.im_depth;
+    cur.assign((char *) img.GetPixels(), (char *) img.GetPixels() + (long) imgsize);
+
+    for (level = 0; ; level++) {
+      imsg.im_width = htons(w);
+      imsg.im_height = htons(h);
+      imsg.im_format = htons(imsg.im_format);
+      if (imgdb_store.put(imgdb_db[i].img_name, level, &imsg, &cur[0], (long) w*h*depth) < 0) {
+        perror("imgdb::ingest: write " IMGSTORE_FILE);
+        imgdb_store.abort();
+        return;
+      }
+      imsg.im_format = ntohs(imsg.im_format);
+      if ((w+1)/2 < IMGDB_MINVARIANT || (h+1)/2 < IMGDB_MINVARIANT) {
+        break;
+      }
+      next.resize((long) ((w+1)/2)*((h+1)/2)*depth);
+      halve(&cur[0], w, h, depth, &next[0]);
+      cur.swap(next);
+      w = (w+1)/2;
+      h = (h+1)/2;
+    }
+  }
+  if (imgdb_store.commit() < 0) {
+    perror("imgdb::ingest: commit " IMGSTORE_FILE);
+    return;
+  }
+  nlog(NLOG_INFO, "Transcoded %d images into %s" IMGDB_DIRSEP IMGSTORE_FILE "\n",
+       n, imgdb_folder.c_str());
+
+  return;
+}
+
 /*
  * reloaddb:
  * reload the imgdb_db with only images whose IDs are in (begin, end].
@@ -156,19 +487,144 @@ reloaddb(unsigned char begin, unsigned char end)
   imgdb_IDrange[IMGDB_IDRBEG] = begin;
   imgdb_IDrange[IMGDB_IDREND] = end;
   imgdb_size = 0;
-  imgdb_bloomfilter = 0L;
+  imgdb_ncached = 0;
+  imgdb_bloomfilter.clear();
+  imgdb_gen++;
   loaddb();
 }
 
+/*
+ * watch: start watching imgdb_folder for images being added, replaced,
+ * or removed, so that handlewatch() can keep the DB up to date without
+ * rereading FILELIST.txt.  Only supported on Linux (inotify).
+ * Returns the descriptor to wait on for events, or -1 if the folder
+ * can't be watched.
+ */
+int
+imgdb::
+watch()
+{
+#ifdef __linux__
+  if (imgdb_watchfd < 0) {
+    imgdb_watchfd = inotify_init();
+    if (imgdb_watchfd >= 0 &&
+        inotify_add_watch(imgdb_watchfd, imgdb_folder.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+      perror("imgdb::watch: inotify_add_watch");
+      close(imgdb_watchfd);
+      imgdb_watchfd = -1;
+    }
+  }
+#endif
+  return(imgdb_watchfd);
+}
+
+/*
+ * handlewatch: read the pending events on watchfd() and apply them to
+ * the DB one image at a time.  Call when watchfd() is readable.
+ * If the folder itself goes away, stop watching.
+ */
+void
+imgdb::
+handlewatch()
+{
+#ifdef __linux__
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  char *p;
+  int len;
+  size_t namelen, extlen = strlen(IMGDB_IMGEXT);
+
+  len = read(imgdb_watchfd, buf, sizeof(buf));
+  if (len <= 0) {
+    return;
+  }
+
+  for (p = buf; p < buf+len; p += sizeof(struct inotify_event)+ev->len) {
+    ev = (struct inotify_event *) p;
+    if (ev->mask & IN_IGNORED) {
+      close(imgdb_watchfd);
+      imgdb_watchfd = -1;
+      return;
+    }
+    if (!ev->len || (ev->mask & IN_ISDIR)) {
+      continue;
+    }
+    namelen = strlen(ev->name);
+    if (namelen >= NETIMG_MAXFNAME || namelen <= extlen ||
+        strcasecmp(ev->name+namelen-extlen, IMGDB_IMGEXT)) {
+      continue;
+    }
+    updateimg(ev->name, (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0);
+  }
+#endif
+  return;
+}
+
+/*
+ * updateimg: image fname has been written to ("present" is 1) or
+ * removed from ("present" is 0) imgdb_folder.  Add, refresh, or remove
+ * its DB entry and Bloom Filter counters, and drop any decoded copy,
+ * which may be out of date.  The change is remembered so that a later
+ * reloaddb() agrees with it, and an image added or removed changes
+ * generation(), so that our neighbors are told.  An image written to
+ * but gone by now, as when it is removed right after, is taken as
+ * removed.
+ */
+void
+imgdb::
+updateimg(char *fname, int present)
+{
+  int i;
+  unsigned char id, md[SHA1_MDLEN];
+
+  SHA1((unsigned char *) fname, strlen(fname), md);
+  id = ID(md);
+  present = present && readable(fname);
+
+  if (present) {
+    imgdb_removed.erase(fname);
+    imgdb_added.insert(fname);
+  } else {
+    imgdb_added.erase(fname);
+    imgdb_removed.insert(fname);
+  }
+
+  imgdb_cache.invalidate(id, fname);
+  imgdb_store.forget(fname);
+  for (i = 0; i < imgdb_size; i++) {
+    if (imgdb_db[i].img_ID == id && !strcmp(imgdb_db[i].img_name, fname)) {
+      break;
+    }
+  }
+
+  if (!present) {
+    if (i < imgdb_size) {
+      nlog(NLOG_INFO, "  (%3d) %s *removed*\n", (int) id, fname);
+      removeimg(i);
+      imgdb_gen++;
+    }
+  } else if (i < imgdb_size) {
+    nlog(NLOG_INFO, "  (%3d) %s *refreshed*\n", (int) id, fname);
+  } else if (ID_inrange(id, imgdb_IDrange[IMGDB_IDRBEG], imgdb_IDrange[IMGDB_IDREND]) &&
+             imgdb_size-imgdb_ncached < IMGDB_MAXDBSIZE) {
+    nlog(NLOG_INFO, "  (%3d) %s *in range* *added*\n", (int) id, fname);
+    addimg(id, md, fname);
+    imgdb_gen++;
+  }
+
+  return;
+}
+
 /*
  * searchdb(imgname): search for imgname in the DB.  To search for the
  * imagename, first compute its SHA1, then compute its object ID from
  * its SHA1.  Next check whether there is a hit for the image in the
  * Bloom Filter.  If it is a miss, return 0.  Otherwise, search the
  * database for a match to BOTH the image ID and its name (so a hash
- * collision on the ID is resolved here).  If a match is found, return
- * IMGDB_FOUND, otherwise return IMGDB_MISS if there's a Bloom Filter
- * miss else IMGDB_FALSE.
+ * collision on the ID is resolved here).  If a match is found, and it
+ * can be loaded, see loadcur(), return IMGDB_FOUND, otherwise return
+ * IMGDB_MISS if there's a Bloom Filter miss else IMGDB_FALSE.
 */
 int
 imgdb::
@@ -177,6 +633,7 @@ searchdb(char *imgname)
   int i;
   string pathname;
   unsigned char id = 0;
+  unsigned long long start = metrics_now();
 
   /* Task 2:
    * Compute SHA1 and object ID.
@@ -187,52 +644,172 @@ searchdb(char *imgname)
 	unsigned char md[SHA1_MDLEN];
 	SHA1((unsigned char *) imgname, strlen(imgname), md);
 	id = ID(md);
-	unsigned long tmp = (1L << (int) bfIDX(BFIDX1, md)) |
-		(1L << (int) bfIDX(BFIDX2, md)) | (1L << (int) bfIDX(BFIDX3, md));
-	if ((imgdb_bloomfilter | tmp) != imgdb_bloomfilter) return 0;
+	if (!imgdb_bloomfilter.query(md)) {
+	  metrics_count(METRICS_BFMISS);
+	  metrics_since(METRICS_LOOKUP, start);
+	  return 0;
+	}
 
   /* To get here means that you've got a hit at the Bloom Filter.
    * Search the DB for a match to BOTH the image ID and name.
   */
   for (i = 0; i < imgdb_size; i++) {
     if ((id == imgdb_db[i].img_ID) && !strcmp(imgname, imgdb_db[i].img_name)) {
-      /* load image given pathname relative to current working directory. */
-      readimg(imgname);
+      imgdb_db[i].img_atime = ++imgdb_clock;
+      metrics_count(METRICS_BFHIT);
+      metrics_since(METRICS_LOOKUP, start);
+      /* load image given pathname relative to current working directory;
+         one that can't be decoded can't be served, as if it weren't here */
+      if (!loadcur(id, imgname)) {
+        nlog(NLOG_WARN, "imgdb::searchdb: %s can't be loaded\n", imgname);
+        return(IMGDB_FALSE);
+      }
       return(IMGDB_FOUND);
     }
   }
 
+  metrics_count(METRICS_BFFALSE);
+  metrics_since(METRICS_LOOKUP, start);
   return(IMGDB_FALSE);
 }
 
+/*
+ * loadcur: make image "imgname" with object ID "id" the current image.
+ * If the image has a blob in imgdb_store, the variant that best fits
+ * the client's display, see setfit(), is served as is.  Otherwise the
+ * decoded image comes from the image cache; it is only read from disk
+ * if it isn't cached, and downscaled here if the client's display is
+ * small.  The handle on the previous current image is released.
+ * Returns 1 on success, 0 if the image can't be decoded, in which case
+ * there is no current image.
+ */
+int
+imgdb::
+loadcur(unsigned char id, char *imgname)
+{
+  imgcache_ent *ent;
+  vector<char> next;
+  int w, h, depth;
+
+  imgdb_cache.release(imgdb_curimg);
+  imgdb_curimg = NULL;
+  imgdb_scaled.clear();
+
+  imgdb_blobfd = imgdb_store.lookup(imgname, imgdb_fitw, imgdb_fith, &imgdb_bloboff, &imgdb_bloblen);
+  if (imgdb_blobfd >= 0) {
+    return(1);
+  }
+
+  ent = imgdb_cache.acquire(id, imgname, imgdb_folder+IMGDB_DIRSEP+imgname);
+  imgdb_curimg = ent;
+  if (!ent) {
+    return(0);
+  }
+
+  /* same variants as ingest() would have made */
+  w = ent->ice_img.GetImageWidth();
+  h = ent->ice_img.GetImageHeight();
+  depth = ent->ice_img.GetPixelDepth()/8;
+  while ((w+1)/2 >= IMGDB_MINVARIANT && (h+1)/2 >= IMGDB_MINVARIANT &&
+         imgstore_covers((w+1)/2, (h+1)/2, imgdb_fitw, imgdb_fith)) {
+    next.resize((long) ((w+1)/2)*((h+1)/2)*depth);
+    halve(imgdb_scaled.empty() ? (char *) ent->ice_img.GetPixels() : &imgdb_scaled[0],
+          w, h, depth, &next[0]);
+    imgdb_scaled.swap(next);
+    w = (w+1)/2;
+    h = (h+1)/2;
+  }
+  imgdb_scaledw = w;
+  imgdb_scaledh = h;
+
+  if (stat((imgdb_folder+IMGDB_DIRSEP+imgname).c_str(), &imgdb_curstat)) {
+    memset(&imgdb_curstat, 0, sizeof(imgdb_curstat));
+  }
+
+  return(1);
+}
+
+int
+imgdb::
+readimg(char *imgname)
+{
+  unsigned char md[SHA1_MDLEN];
+
+  SHA1((unsigned char *) imgname, strlen(imgname), md);
+  return(loadcur(ID(md), imgname));
+}
+
 /*
  * marshall_imsg: Initialize *imsg with image's specifics.
- * Upon return, the *imsg fields are in host-byte order.
+ * Upon return, the *imsg fields are in host-byte order,
+ * im_tag included.
  * Return value is the size of the image in bytes.
+ * If the current image is served from imgdb_store, its
+ * imsg_t is read back from its blob.  A downscaled image,
+ * see loadcur(), has the size of its variant.
+ * If there is no current image, im_depth is set to 0
+ * and 0 is returned.
  *
  * Terminate process on encountering any error.
  */
 double
 imgdb::
 marshall_imsg(imsg_t *imsg)
+{
+  double imgsize;
+
+  if (imgdb_blobfd >= 0) {
+    if (pread(imgdb_blobfd, imsg, sizeof(imsg_t), imgdb_bloboff) == (ssize_t) sizeof(imsg_t)) {
+      imsg->im_format = ntohs(imsg->im_format);
+      imsg->im_width = ntohs(imsg->im_width);
+      imsg->im_height = ntohs(imsg->im_height);
+      imsg->im_tag = ntohl(imsg->im_tag);
+      return((double) (imgdb_bloblen - sizeof(imsg_t)));
+    }
+  } else if (imgdb_curimg) {
+    imgsize = marshall_img(&imgdb_curimg->ice_img, imsg);
+    if (!imgdb_scaled.empty()) {
+      imsg->im_width = imgdb_scaledw;
+      imsg->im_height = imgdb_scaledh;
+      imgsize = (double) imgdb_scaled.size();
+    }
+    /* as the store would have tagged it */
+    imsg->im_tag = imgstore_tag(&imgdb_curstat, imsg->im_width, imsg->im_height, imsg->im_format);
+    return(imgsize);
+  }
+
+  imsg->im_depth = 0;
+  imsg->im_format = imsg->im_width = imsg->im_height = 0;
+  return(0.0);
+}
+
+/*
+ * marshall_img: marshall_imsg() for a given image.
+ */
+double
+imgdb::
+marshall_img(LTGA *curimg, imsg_t *imsg)
 {
   int alpha, greyscale;
-  
-  imsg->im_depth = (unsigned char)(imgdb_curimg.GetPixelDepth()/8);
-  imsg->im_width = imgdb_curimg.GetImageWidth();
-  imsg->im_height = imgdb_curimg.GetImageHeight();
-  alpha = imgdb_curimg.GetAlphaDepth();
-  greyscale = imgdb_curimg.GetImageType();
+
+  imsg->im_depth = (unsigned char)(curimg->GetPixelDepth()/8);
+  imsg->im_width = curimg->GetImageWidth();
+  imsg->im_height = curimg->GetImageHeight();
+  alpha = curimg->GetAlphaDepth();
+  greyscale = curimg->GetImageType();
   greyscale = (greyscale == 3 || greyscale == 11);
   if (greyscale) {
     imsg->im_format = alpha ? GL_LUMINANCE_ALPHA : GL_LUMINANCE;
+  } else if (curimg->IsBGR()) {
+    /* straight from the file, see LTGA::ReadFile() */
+    imsg->im_format = alpha ? GL_BGRA : GL_BGR;
   } else {
     imsg->im_format = alpha ? GL_RGBA : GL_RGB;
   }
 
-  return((double) (imgdb_curimg.GetImageWidth() *
-                   imgdb_curimg.GetImageHeight() *
-                   (imgdb_curimg.GetPixelDepth()/8)));
+  return((double) (curimg->GetImageWidth() *
+                   curimg->GetImageHeight() *
+                   (curimg->GetPixelDepth()/8)));
 }
   
 /*
@@ -251,9 +828,9 @@ display()
   marshall_imsg(&imsg);
 
   /* give the updated image to OpenGL for texturing */
-  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) imsg.im_format,
+  glTexImage2D(GL_TEXTURE_2D, 0, (GLint) netimg_texfmt(imsg.im_format),
                (GLsizei) imsg.im_width, (GLsizei) imsg.im_height, 0,
-               (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, imgdb_curimg.GetPixels());
+               (GLenum) imsg.im_format, GL_UNSIGNED_BYTE, getimage());
 
   return;
 }
@@ -21,46 +21,117 @@
 #define __IMGDB_H__
 
 #include <string>
+#include <set>
+#include <vector>
 using namespace std;
 
 #include "ltga.h"
 #include "hash.h"
 #include "netimg.h"
+#include "imgcache.h"
+#include "imgstore.h"
+#include "cbfilter.h"
 
 #define IMGDB_FILELIST  "FILELIST.txt"
 #define IMGDB_DIRSEP "/"
 #define IMGDB_IDRBEG 0
 #define IMGDB_IDREND 1
 #define IMGDB_MAXDBSIZE 1024 // DB can only hold 1024 images max
+#define IMGDB_MAXCACHED   64 // plus this many images cached from remote nodes
 #define IMGDB_FOUND    1
 #define IMGDB_FALSE   -1
 #define IMGDB_MISS     0
 #define IMGDB_NETMISS -2
+#define IMGDB_IMGEXT  ".tga"  // only files with this extension are watched
+#define IMGDB_LOADERS    8  // max threads hashing and probing FILELIST.txt
+#define IMGDB_LDCHUNK  256  // names handed to a loader thread at a time
+#define IMGDB_MINVARIANT 64  // downscaled variants are at least this wide and high
+
+typedef struct {
+  unsigned char le_md[SHA1_MDLEN];
+  unsigned char le_ID;
+  unsigned char le_inrange;
+  unsigned char le_readable;
+} imgdb_ldent_t;             // loaddb() result for one FILELIST.txt name
+
+typedef struct {
+  const vector<string> *ld_names;
+  imgdb_ldent_t *ld_ents;    // one per name
+  int ld_n;
+  int ld_next;               // next name to hand out
+  unsigned char ld_beg, ld_end;
+  int ld_dirfd;              // imgdb_folder, for probing image files
+} imgdb_ldjob_t;
 
 typedef struct {
   unsigned char img_ID;
+  unsigned char img_cached;     // cached from a remote node, may be evicted
+  unsigned long img_atime;      // last hit, for evicting cached images
   char img_name[NETIMG_MAXFNAME];
 } image_t;
    
 class imgdb {
   unsigned char imgdb_IDrange[2];     // (start, end]
-  unsigned long imgdb_bloomfilter;    // 64-bit bloom filter
+  cbfilter imgdb_bloomfilter;         // counting bloom filter, supports removal
   int imgdb_size;
+  int imgdb_ncached;                  // how many of imgdb_size are cached images
+  unsigned long imgdb_clock;          // ticks on every hit
+  unsigned int imgdb_gen;             // see generation()
   string imgdb_folder;  // image folder name
-  image_t imgdb_db[IMGDB_MAXDBSIZE];
-  LTGA imgdb_curimg;
+  image_t imgdb_db[IMGDB_MAXDBSIZE+IMGDB_MAXCACHED];
+  imgcache imgdb_cache;          // decoded images, shared across requests
+  imgcache_ent *imgdb_curimg;    // handle on the image being served
+  imgstore imgdb_store;          // wire-ready copies of the images, see ingest()
+  int imgdb_blobfd;              // if the image being served is in imgdb_store,
+  off_t imgdb_bloboff;           //   its store file and blob, else -1
+  long imgdb_bloblen;
+  unsigned short imgdb_fitw;     // display size of the client, see setfit()
+  unsigned short imgdb_fith;
+  vector<char> imgdb_scaled;     // imgdb_curimg downscaled to fit, if not empty
+  unsigned short imgdb_scaledw, imgdb_scaledh;
+  struct stat imgdb_curstat;     // of the image file of imgdb_curimg, for im_tag
+  int imgdb_watchfd;             // inotify descriptor on imgdb_folder, or -1
+  set<string> imgdb_added;       // images that appeared in imgdb_folder while watched
+  set<string> imgdb_removed;     // images that left imgdb_folder while watched
+
+  int loadcur(unsigned char id, char *imgname);
+  void addimg(unsigned char id, unsigned char *md, char *fname);
+  int readable(char *fname);
+  void removeimg(int idx);
+  void updateimg(char *fname, int present);
+  void ingest();
+  static double marshall_img(LTGA *img, imsg_t *imsg);
+  static void halve(const char *src, int width, int height, int depth, char *dst);
 
 public:
   imgdb(); // default constructor
+  ~imgdb();
   void setfolder(char *imagefolder) { imgdb_folder = imagefolder; }
+  /* images found from now on are served downscaled for a width x height
+     display, 0 meaning any size, see imgstore_covers() */
+  void setfit(unsigned short width, unsigned short height) { imgdb_fitw = width; imgdb_fith = height; }
   void loadimg(unsigned char id, unsigned char *md, char *fname);
+  void cacheimg(unsigned char id, unsigned char *md, char *fname);
   void loaddb();
   void reloaddb(unsigned char begin, unsigned char end);
+  int watch();
+  int watchfd() { return(imgdb_watchfd); }
+  void handlewatch();
   int searchdb(char *imgname);
-  /* readimg: load the image from file to memory */
-  void readimg(char *imgname) { imgdb_curimg.LoadFromFile(imgdb_folder+IMGDB_DIRSEP+imgname); }
+  /* readimg: make imgname the current image, decoding it only if not cached */
+  int readimg(char *imgname);
   double marshall_imsg(imsg_t *imsg);
-  char *getimage() { return((char * ) imgdb_curimg.GetPixels()); }
+  /* summary of the DB for neighbors, see cbfilter::bitmap() */
+  unsigned int bfsize() { return(imgdb_bloomfilter.size()); }
+  /* changes whenever images in our range are added or removed, so that
+     a summary taken since says whether we have an image */
+  unsigned int generation() { return(imgdb_gen); }
+  void bfbitmap(unsigned char *bits) { imgdb_bloomfilter.bitmap(bits); }
+  char *getimage() { return(!imgdb_scaled.empty() ? &imgdb_scaled[0] :
+                            imgdb_curimg ? (char *) imgdb_curimg->ice_img.GetPixels() : NULL); }
+  /* wire-ready blob of the current image: imsg_t in network byte order, then
+     the pixels.  Returns the descriptor to read it from, or -1 if there is none. */
+  int getblob(off_t *off, long *len) { *off = imgdb_bloboff; *len = imgdb_bloblen; return(imgdb_blobfd); }
 #if 0
   void display();
 #endif
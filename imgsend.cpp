@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <string.h>        // memset(), memcpy()
+#include <limits.h>        // LONG_MAX
+#include <unistd.h>        // pread(), usleep()
+#include <arpa/inet.h>     // htons(), htonl()
+#include <sys/types.h>
+#include <sys/socket.h>    // send()
+#ifdef __linux__
+#include <sys/sendfile.h>  // sendfile()
+#endif
+
+#include "netimg.h"
+#include "imgdb.h"
+#include "imgcodec.h"
+#include "imgsend.h"
+#include "metrics.h"
+#include "nlog.h"
+
+/*
+ * imgsend_from: send up to len bytes at *off of file fd on socket sd,
+ * advancing *off.  Returns the number of bytes sent, or -1 on error.
+ */
+static int
+imgsend_from(int sd, int fd, off_t *off, long len)
+{
+#ifdef __linux__
+  int bytes = sendfile(sd, fd, off, len);
+#else
+  char buf[NETIMG_MSS*16];
+  int bytes = pread(fd, buf, len < (long) sizeof(buf) ? len : sizeof(buf), *off);
+  if (bytes > 0) {
+    bytes = send(sd, buf, bytes, 0);
+  }
+  if (bytes > 0) {
+    *off += bytes;
+  }
+#endif
+  return(bytes);
+}
+
+/*
+ * imgsend_stripes: the rest of imgsend() when the client accepts
+ * "codec".  Sends the imsg packet, already in network byte order, then
+ * the "imgsize" bytes of the image as a series of istripe_t stripes,
+ * each compressed with "codec" or, if it doesn't compress, raw.  The
+ * image comes from "ip" if not NULL, else from the image store blob at
+ * "off" in "fd".
+ * Like imgsend(), pauses after each NETIMG_NUMSEG-th of the image.
+ */
+static void
+imgsend_stripes(int sd, unsigned char codec, imsg_t *imsg, long imgsize, const char *ip,
+                int fd, off_t off, int pauseus)
+{
+  int depth = imsg->im_depth, width = ntohs(imsg->im_width);
+  int bytes;
+  long sent, total, done, rawlen, len, paused = 0, wire = 0;
+  long stripelen = (long) imgcodec_striperows(width, depth)*width*depth;
+  long segsize = imgsize/NETIMG_NUMSEG;
+  char *raw = new char[stripelen];
+  char *buf = new char[sizeof(istripe_t)+stripelen];
+  istripe_t *stripe = (istripe_t *) buf;
+  const char *src;
+
+  bytes = send(sd, (char *) imsg, sizeof(imsg_t), 0);
+  net_assert((bytes != sizeof(imsg_t)), "imgsend_stripes: send imsg");
+
+  segsize = segsize < NETIMG_MSS ? NETIMG_MSS : segsize;
+  for (done = 0; done < imgsize; done += rawlen) {
+    rawlen = imgsize-done < stripelen ? imgsize-done : stripelen;
+    if (ip) {
+      src = ip+done;
+    } else {
+      net_assert((pread(fd, raw, rawlen, off+done) != rawlen), "imgsend_stripes: read image store");
+      src = raw;
+    }
+
+    memset(stripe, 0, sizeof(istripe_t));
+    len = imgcodec_encode(codec, depth, src, rawlen, buf+sizeof(istripe_t), rawlen);
+    if (len < 0) {
+      stripe->is_codec = NETIMG_CODEC_RAW;
+      memcpy(buf+sizeof(istripe_t), src, rawlen);
+      len = rawlen;
+    } else {
+      stripe->is_codec = codec;
+    }
+    stripe->is_rawlen = htonl(rawlen);
+    stripe->is_len = htonl(len);
+
+    total = sizeof(istripe_t)+len;
+    for (sent = 0; sent < total; sent += bytes) {
+      bytes = send(sd, buf+sent, total-sent, 0);
+      net_assert((bytes <= 0), "imgsend_stripes: send stripe");
+    }
+    wire += total;
+
+    if (done+rawlen-paused >= segsize || done+rawlen == imgsize) {
+      nlog(NLOG_DEBUG, "imgsend_stripes: size %ld, sent %ld as %ld\n", imgsize-paused, done+rawlen-paused, wire);
+      paused = done+rawlen;
+      wire = 0;
+      if (pauseus) {
+        usleep(pauseus);
+      }
+    }
+  }
+
+  delete [] raw;
+  delete [] buf;
+  return;
+}
+
+/*
+ * imgsend: send the current image of "db" to the client on socket
+ * "sd", as "req" asks.
+ * First send the specifics of the image (width, height, etc.) in an
+ * imsg_t packet.  If "found" is > 0, send the image, from the image
+ * store blob if it has one, else from memory.  Otherwise, set the
+ * im_depth field of the imsg_t packet to 0 and send only the imsg_t
+ * packet.  The image is sent in NETIMG_NUMSEG segments, pausing
+ * "pauseus" microseconds after each, if not 0.
+ * If the client asked for it, the image is sent in Adam7 pass order,
+ * so that a coarse version of it arrives first.  It is sent as stripes
+ * if the client accepts a codec, see imgcodec_pick(), and only the
+ * range it asked for, if the range is of this version of the image.
+ * The imsg_t echoes the query's iq_id in im_id.
+ *
+ * Terminates process upon encountering any error.
+ */
+void
+imgsend(int sd, const imgsend_req *req, imgdb *db, int found, int pauseus)
+{
+  int segsize;
+  char *ip = NULL;
+  int bytes;
+  long left;
+  imsg_t imsg;
+  double imgdsize;
+  long imgsize = 0L, rangeoff = 0L, rangelen = 0L;
+  int blobfd = -1;
+  off_t bloboff = 0;
+  long bloblen;
+  unsigned char codec = NETIMG_CODEC_RAW;
+  int progressive = 0;
+  char *ilace = NULL;
+  unsigned long long start = metrics_now();
+
+  memset(&imsg, 0, sizeof(imsg_t));
+  imsg.im_vers = NETIMG_VERS;
+  imsg.im_id = req->isr_id;
+
+  if (found > 0) {
+    blobfd = db->getblob(&bloboff, &bloblen);
+    bloboff += sizeof(imsg_t);  // the pixels, marshall_imsg() reads the imsg
+    codec = imgcodec_pick(req->isr_codecs);
+    progressive = (req->isr_flags & NETIMG_PROGRESSIVE) != 0;
+    imgdsize = db->marshall_imsg(&imsg);
+    net_assert((imgdsize > (double) LONG_MAX), "imgsend: image too large");
+    imgsize = (long) imgdsize;
+  }
+
+  if (found <= 0) {
+    if (!found) {
+      nlog(NLOG_INFO, "Bloom filter missed.\n");
+    } else {
+      nlog(NLOG_INFO, "Bloom filter false positive.\n");
+    }
+    imsg.im_depth = (unsigned char) 0;
+  } else if (!imsg.im_depth) {
+    /* found, but it couldn't be decoded, see imgdb::loadcur();
+       marshall_imsg() left an imsg_t of no image */
+    nlog(NLOG_WARN, "imgsend: image can't be loaded.\n");
+    found = 0;
+  } else {
+    /* the range asked for, in whole pixels, unless it is of
+       another version of the image, then the whole image */
+    rangelen = imgsize;
+    if (!req->isr_tag || req->isr_tag == imsg.im_tag) {
+      rangeoff = (long) req->isr_off - (long) req->isr_off % imsg.im_depth;
+      rangeoff = rangeoff < imgsize ? rangeoff : imgsize;
+      rangelen = imgsize - rangeoff;
+      if (req->isr_len && rangeoff < imgsize && (long) req->isr_off + (long) req->isr_len < imgsize) {
+        rangelen = ((long) req->isr_off + (long) req->isr_len + imsg.im_depth-1)
+          / imsg.im_depth * imsg.im_depth - rangeoff;
+        rangelen = rangelen < imgsize - rangeoff ? rangelen : imgsize - rangeoff;
+      }
+    }
+
+    /* an empty range, e.g., of a client whose copy is current, is
+       answered with the imsg_t alone */
+    if (!rangelen) {
+      codec = NETIMG_CODEC_RAW;
+      progressive = 0;
+      imsg.im_flags |= req->isr_flags & NETIMG_PROGRESSIVE;
+    }
+
+    if (progressive) {
+      ip = db->getimage();
+      if (blobfd >= 0) {
+        ip = new char[imgsize];
+        bytes = pread(blobfd, ip, imgsize, bloboff);
+        net_assert((bytes != imgsize), "imgsend: read image store");
+      }
+      ilace = new char[imgsize];
+      imgcodec_interlace(ip, ilace, imsg.im_width, imsg.im_height, imsg.im_depth);
+      if (blobfd >= 0) {
+        delete [] ip;
+        blobfd = -1;
+      }
+      ip = ilace;
+      imsg.im_flags |= NETIMG_PROGRESSIVE;
+    } else if (blobfd < 0) {
+      ip = db->getimage();
+    }
+
+    if (ip) {
+      ip += rangeoff;
+    } else {
+      bloboff += rangeoff;
+    }
+
+    imsg.im_codec = codec;
+    imsg.im_width = htons(imsg.im_width);
+    imsg.im_height = htons(imsg.im_height);
+    imsg.im_format = htons(imsg.im_format);
+    imsg.im_tag = htonl(imsg.im_tag);
+    imsg.im_offset = htonl(rangeoff);
+    imsg.im_length = htonl(rangelen);
+    imsg.im_id = req->isr_id;   // the blob's imsg_t has none
+
+    if (codec != NETIMG_CODEC_RAW) {
+      imgsend_stripes(sd, codec, &imsg, rangelen, ip, blobfd, bloboff, pauseus);
+      delete [] ilace;
+      metrics_since(METRICS_SEND, start);
+      return;
+    }
+  }
+
+  /*
+   * Send the imsg packet to the client
+   */
+  bytes = send(sd, (char *) &imsg, sizeof(imsg_t), 0);
+  net_assert((bytes != sizeof(imsg_t)), "imgsend: send imsg");
+
+  if (found > 0) {
+    segsize = rangelen/NETIMG_NUMSEG;                   /* compute segment size */
+    segsize = segsize < NETIMG_MSS ? NETIMG_MSS : segsize;  /* but don't let segment be too small */
+    for (left = rangelen; left; left -= bytes) {
+      if (blobfd >= 0) {
+        bytes = imgsend_from(sd, blobfd, &bloboff, segsize > left ? left : segsize);
+      } else {
+        bytes = send(sd, (char *) ip, segsize > left ? left : segsize, 0);
+      }
+      net_assert((bytes <= 0), "imgsend: send image");
+      ip += bytes;
+      nlog(NLOG_DEBUG, "imgsend: size %d, sent %d\n", (int) left, bytes);
+      if (pauseus) {
+        usleep(pauseus);
+      }
+    }
+  }
+
+  delete [] ilace;
+  if (found > 0) {
+    metrics_since(METRICS_SEND, start);
+  }
+  return;
+}
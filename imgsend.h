@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __IMGSEND_H__
+#define __IMGSEND_H__
+
+#include "netimg.h"
+#include "imgdb.h"
+
+/* what a client asked for in its iqry_t, in host byte order */
+typedef struct {
+  unsigned char isr_codecs;     // NETIMG_CODEC_* the client accepts
+  unsigned char isr_flags;      // its iq_flags
+  unsigned int isr_tag;         // the range it wants, see iqry_t
+  unsigned int isr_off;
+  unsigned int isr_len;
+  unsigned int isr_id;          // its iq_id, echoed as is
+} imgsend_req;
+
+extern void imgsend(int sd, const imgsend_req *req, imgdb *db, int found, int pauseus);
+
+#endif /* __IMGSEND_H__ */
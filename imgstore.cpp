@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/file.h>      // flock()
+#include <sys/stat.h>
+#include <arpa/inet.h>     // ntohs(), htonl()
+#include <string>
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "netimg.h"
+#include "imgstore.h"
+
+#define IMGSTORE_ROUNDUP(off) (((off) + IMGSTORE_ALIGN-1) & ~((long long) IMGSTORE_ALIGN-1))
+
+/*
+ * imgstore_pwrite: write all of buf at offset off of fd.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+imgstore_pwrite(int fd, const char *buf, long len, off_t off)
+{
+  ssize_t bytes;
+
+  while (len > 0) {
+    bytes = pwrite(fd, buf, len, off);
+    if (bytes <= 0) {
+      return(-1);
+    }
+    buf += bytes;
+    off += bytes;
+    len -= bytes;
+  }
+  return(0);
+}
+
+imgstore::
+imgstore()
+{
+  is_fd = is_lockfd = is_wfd = -1;
+  is_woff = 0;
+}
+
+imgstore::
+~imgstore()
+{
+  abort();
+  if (is_fd >= 0) {
+    close(is_fd);
+  }
+}
+
+/*
+ * open: forget the current store and load the index of the store in
+ * "folder", if there is a usable one.  A missing, truncated, or
+ * otherwise unusable store file leaves the store empty.
+ */
+void imgstore::
+open(const string &folder)
+{
+  imgstore_hdr hdr;
+  imgstore_ent *ents;
+  struct stat st;
+  unsigned int i;
+  long len;
+
+  if (is_fd >= 0) {
+    close(is_fd);
+  }
+  is_index.clear();
+  is_folder = folder;
+
+  is_fd = ::open((is_folder+"/"+IMGSTORE_FILE).c_str(), O_RDONLY);
+  if (is_fd < 0) {
+    return;
+  }
+  if (fstat(is_fd, &st) ||
+      pread(is_fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+      hdr.ish_magic != IMGSTORE_MAGIC || hdr.ish_vers != IMGSTORE_VERS ||
+      hdr.ish_netvers != NETIMG_VERS || hdr.ish_index < (long long) sizeof(hdr) ||
+      hdr.ish_index+(long long) (hdr.ish_count*sizeof(imgstore_ent)) > (long long) st.st_size) {
+    close(is_fd);
+    is_fd = -1;
+    return;
+  }
+
+  len = hdr.ish_count*sizeof(imgstore_ent);
+  ents = new imgstore_ent[hdr.ish_count+1];
+  if (pread(is_fd, ents, len, hdr.ish_index) == len) {
+    for (i = 0; i < hdr.ish_count; i++) {
+      ents[i].ise_name[NETIMG_MAXFNAME-1] = '\0';
+      if (ents[i].ise_len >= (long long) sizeof(imsg_t) &&
+          ents[i].ise_off >= 0 && ents[i].ise_off+ents[i].ise_len <= st.st_size) {
+        /* variants without the levels before them are useless */
+        vector<imgstore_ent> &levels = is_index[ents[i].ise_name];
+        if (ents[i].ise_level == levels.size()) {
+          levels.push_back(ents[i]);
+        }
+      }
+    }
+  }
+  delete [] ents;
+
+  return;
+}
+
+/*
+ * fresh: whether the blob of "ent" was made from the image file
+ * currently in the folder.
+ */
+int imgstore::
+fresh(const imgstore_ent *ent)
+{
+  struct stat st;
+
+  return(!stat((is_folder+"/"+ent->ise_name).c_str(), &st) &&
+         imgstore_mtime(&st) == ent->ise_mtime &&
+         (long long) st.st_ino == ent->ise_ino &&
+         (long long) st.st_size == ent->ise_size);
+}
+
+int imgstore::
+fresh(const char *imgname)
+{
+  map<string, vector<imgstore_ent> >::iterator it;
+
+  it = is_index.find(imgname);
+  return(it != is_index.end() && !it->second.empty() && fresh(&it->second[0]));
+}
+
+/*
+ * lookup: find the blob of image "imgname" to send to a "maxw" by
+ * "maxh" display: the smallest variant that still covers the display,
+ * see imgstore_covers().  Returns the descriptor of the store file,
+ * with the blob at *off, *len bytes long, or -1 if the image isn't in
+ * the store.  The image file isn't checked; call forget() when it
+ * changes.
+ */
+int imgstore::
+lookup(const char *imgname, int maxw, int maxh, off_t *off, long *len)
+{
+  map<string, vector<imgstore_ent> >::iterator it;
+  unsigned int level;
+
+  it = is_index.find(imgname);
+  if (it == is_index.end() || it->second.empty()) {
+    return(-1);
+  }
+  vector<imgstore_ent> &levels = it->second;
+  for (level = 0; level+1 < levels.size() &&
+         imgstore_covers(levels[level+1].ise_width, levels[level+1].ise_height, maxw, maxh);
+       level++);
+  *off = (off_t) levels[level].ise_off;
+  *len = (long) levels[level].ise_len;
+  return(is_fd);
+}
+
+/*
+ * forget: stop serving the blobs of "imgname", e.g., because its image
+ * file has changed.  The blobs are dropped from the file on the next
+ * rebuild.
+ */
+void imgstore::
+forget(const char *imgname)
+{
+  is_index.erase(imgname);
+}
+
+/*
+ * append: copy the "len"-byte blob at "off" of "fd" into the store
+ * being built, recording it as "ent".  Returns 0 on success, -1 on
+ * error.
+ */
+int imgstore::
+append(imgstore_ent *ent, int fd, off_t off, long len)
+{
+  char buf[65536];
+  long chunk, done;
+
+  for (done = 0; done < len; done += chunk) {
+    chunk = len-done < (long) sizeof(buf) ? len-done : (long) sizeof(buf);
+    if (pread(fd, buf, chunk, off+done) != chunk ||
+        imgstore_pwrite(is_wfd, buf, chunk, is_woff+done)) {
+      return(-1);
+    }
+  }
+
+  is_wents.push_back(*ent);
+  is_wents.back().ise_off = is_woff;
+  is_woff = IMGSTORE_ROUNDUP(is_woff+len);
+
+  return(0);
+}
+
+/*
+ * begin: start building a new store.  The blobs, all variants, of
+ * images in the current store whose image files haven't changed are
+ * carried over, including those of images this node doesn't serve, so
+ * nodes sharing the folder don't undo each other's work.  To that end,
+ * IMGSTORE_LOCK is held until commit() or abort(), waiting for any
+ * other node's rebuild to finish first, and the current store is
+ * opened again under it, so that its blobs are the ones carried over.
+ * Returns 0 on success, -1 on error, with errno set.
+ */
+int imgstore::
+begin()
+{
+  map<string, vector<imgstore_ent> >::iterator it;
+  unsigned int level;
+  char pid[16];
+  int err;
+
+  abort();
+  is_woff = IMGSTORE_ROUNDUP((long long) sizeof(imgstore_hdr));
+
+  is_lockfd = ::open((is_folder+"/"+IMGSTORE_LOCK).c_str(), O_RDWR | O_CREAT, 0644);
+  if (is_lockfd < 0 || flock(is_lockfd, LOCK_EX)) {
+    err = errno;
+    abort();
+    errno = err;
+    return(-1);
+  }
+  open(is_folder);
+
+  snprintf(pid, sizeof(pid), ".%d", (int) getpid());
+  is_wpath = is_folder+"/"+IMGSTORE_FILE+pid;
+  is_wfd = ::open(is_wpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (is_wfd < 0) {
+    err = errno;
+    abort();
+    errno = err;
+    return(-1);
+  }
+
+  for (it = is_index.begin(); it != is_index.end(); it++) {
+    if (it->second.empty() || !fresh(&it->second[0])) {
+      continue;
+    }
+    for (level = 0; level < it->second.size(); level++) {
+      if (append(&it->second[level], is_fd, (off_t) it->second[level].ise_off,
+                 (long) it->second[level].ise_len)) {
+        err = errno;
+        abort();
+        errno = err;
+        return(-1);
+      }
+    }
+  }
+
+  return(0);
+}
+
+/*
+ * put: add the blob of variant "level" of image "imgname" to the store
+ * being built: "imsg", which must already be in network byte order,
+ * with its im_tag set here, followed by the "len" bytes at "pixels".  The variants of an image
+ * must be put in level order, starting with level 0.
+ * Returns 0 on success, -1 on error.
+ */
+int imgstore::
+put(const char *imgname, int level, const imsg_t *imsg, const char *pixels, long len)
+{
+  imgstore_ent *ent;
+  imsg_t tagged;
+  struct stat st;
+
+  if (is_wfd < 0 ||
+      stat((is_folder+"/"+imgname).c_str(), &st)) {
+    return(-1);
+  }
+  tagged = *imsg;
+  tagged.im_tag = htonl(imgstore_tag(&st, ntohs(imsg->im_width), ntohs(imsg->im_height),
+                                     ntohs(imsg->im_format)));
+  if (imgstore_pwrite(is_wfd, (const char *) &tagged, sizeof(imsg_t), is_woff) ||
+      imgstore_pwrite(is_wfd, pixels, len, is_woff+sizeof(imsg_t))) {
+    return(-1);
+  }
+
+  is_wents.resize(is_wents.size()+1);
+  ent = &is_wents.back();
+  memset(ent, 0, sizeof(imgstore_ent));
+  strncpy(ent->ise_name, imgname, NETIMG_MAXFNAME-1);
+  ent->ise_off = is_woff;
+  ent->ise_len = sizeof(imsg_t)+len;
+  ent->ise_mtime = imgstore_mtime(&st);
+  ent->ise_size = (long long) st.st_size;
+  ent->ise_ino = (long long) st.st_ino;
+  ent->ise_width = ntohs(imsg->im_width);
+  ent->ise_height = ntohs(imsg->im_height);
+  ent->ise_level = (unsigned char) level;
+  is_woff = IMGSTORE_ROUNDUP(is_woff+ent->ise_len);
+
+  return(0);
+}
+
+/*
+ * commit: write out the index of the store being built, after its
+ * blobs, then its header, put it in place of the current store, and
+ * open it.  The next node waiting in begin() then finds it in place.
+ * Returns 0 on success, -1 on error, in which case the current store
+ * is left as it was.
+ */
+int imgstore::
+commit()
+{
+  imgstore_hdr hdr;
+  int err;
+
+  if (is_wfd < 0) {
+    return(-1);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.ish_magic = IMGSTORE_MAGIC;
+  hdr.ish_vers = IMGSTORE_VERS;
+  hdr.ish_netvers = NETIMG_VERS;
+  hdr.ish_count = is_wents.size();
+  hdr.ish_index = is_woff;
+  if ((!is_wents.empty() &&
+       imgstore_pwrite(is_wfd, (const char *) &is_wents[0],
+                       is_wents.size()*sizeof(imgstore_ent), is_woff)) ||
+      imgstore_pwrite(is_wfd, (const char *) &hdr, sizeof(hdr), 0) ||
+      fsync(is_wfd) ||
+      rename(is_wpath.c_str(), (is_folder+"/"+IMGSTORE_FILE).c_str())) {
+    err = errno;
+    abort();
+    errno = err;
+    return(-1);
+  }
+  is_wpath.clear();
+  abort();
+
+  open(is_folder);
+  return(0);
+}
+
+/*
+ * abort: throw away the store being built, if any, and let other
+ * nodes rebuild.
+ */
+void imgstore::
+abort()
+{
+  if (is_wfd >= 0) {
+    close(is_wfd);
+    is_wfd = -1;
+  }
+  if (!is_wpath.empty()) {
+    unlink(is_wpath.c_str());
+    is_wpath.clear();
+  }
+  is_wents.clear();
+  if (is_lockfd >= 0) {
+    close(is_lockfd);  // releases the lock
+    is_lockfd = -1;
+  }
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __IMGSTORE_H__
+#define __IMGSTORE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "netimg.h"
+
+#define IMGSTORE_FILE   "FILELIST.pix"  // kept in the image folder, next to FILELIST.txt
+#define IMGSTORE_LOCK   IMGSTORE_FILE ".lock"  // held while the store is rebuilt
+#define IMGSTORE_MAGIC  0x5850494eU     // "NIPX" on little-endian hosts
+#define IMGSTORE_VERS   4
+#define IMGSTORE_ALIGN  4096            // blobs start on page boundaries
+
+/*
+ * The store file is an imgstore_hdr, followed by the blobs, followed
+ * by ish_count imgstore_ent index entries at ish_index.  Each blob is
+ * exactly what sendimg() puts on the wire for the image: its imsg_t,
+ * already in network byte order, followed by its pixels, top row
+ * first, in RGB(A) order.  Besides the image itself (level 0), an image
+ * may have downscaled variants, each half the size of the level before
+ * it; the entries of an image are in level order.  The file is local
+ * to the host, so the header and index are in host byte order.
+ */
+typedef struct {
+  unsigned int ish_magic;
+  unsigned short ish_vers;      // IMGSTORE_VERS
+  unsigned short ish_netvers;   // NETIMG_VERS of the imsg_t in the blobs
+  unsigned int ish_count;
+  unsigned int ish_rsvd;
+  long long ish_index;          // offset of the index, written last
+} imgstore_hdr;
+
+typedef struct {
+  char ise_name[NETIMG_MAXFNAME];
+  long long ise_off;            // of the blob in the store file
+  long long ise_len;            // of the blob, including the imsg_t
+  long long ise_mtime;          // of the image file the blob was made from, in ns
+  long long ise_size;
+  long long ise_ino;
+  unsigned short ise_width;     // of the variant
+  unsigned short ise_height;
+  unsigned char ise_level;      // 0 for the image itself
+  unsigned char ise_rsvd[3];
+} imgstore_ent;
+
+/*
+ * imgstore_covers: whether a "w" by "h" variant is still at least as
+ * large as a "maxw" by "maxh" display, 0 meaning any size.  With no
+ * display size at all, only the image itself does.
+ */
+static inline int
+imgstore_covers(int w, int h, int maxw, int maxh)
+{
+  return((maxw || maxh) && w >= maxw && h >= maxh);
+}
+
+/*
+ * imgstore_mtime: when the file of "st" was last modified, in
+ * nanoseconds, so that rewriting an image within the second it was
+ * written in still changes its version.
+ */
+static inline long long
+imgstore_mtime(const struct stat *st)
+{
+#ifdef __APPLE__
+  return((long long) st->st_mtimespec.tv_sec*1000000000LL + st->st_mtimespec.tv_nsec);
+#else
+  return((long long) st->st_mtim.tv_sec*1000000000LL + st->st_mtim.tv_nsec);
+#endif
+}
+
+/*
+ * imgstore_tag: im_tag of the "w" by "h" variant, in pixel format
+ * "format", of the image file of "st", from its modification time,
+ * inode and size.  Never 0.
+ */
+static inline unsigned int
+imgstore_tag(const struct stat *st, int w, int h, int format)
+{
+  unsigned long long v[6] = { (unsigned long long) imgstore_mtime(st),
+                              (unsigned long long) st->st_ino,
+                              (unsigned long long) st->st_size,
+                              (unsigned long long) w, (unsigned long long) h,
+                              (unsigned long long) format };
+  unsigned int tag = 2166136261U;  // FNV-1a
+  int i, j;
+
+  for (i = 0; i < 6; i++) {
+    for (j = 0; j < 64; j += 8) {
+      tag = (tag ^ (unsigned int) ((v[i] >> j) & 0xff))*16777619U;
+    }
+  }
+  return(tag ? tag : 1);
+}
+
+/*
+ * Wire-ready copies of the images in a folder, see imgdb::ingest().
+ * The store is rebuilt into a temporary file that is renamed over the
+ * old one, so an open store, ours or another node's, is never
+ * modified under its readers.  Rebuilds of nodes sharing the folder
+ * take turns, see begin().
+ */
+class imgstore {
+  string is_folder;
+  int is_fd;                            // open store, or -1
+  map<string, vector<imgstore_ent> > is_index;  // by name, then level
+  int is_lockfd;                        // IMGSTORE_LOCK, locked while building, or -1
+  int is_wfd;                           // store being built, or -1
+  string is_wpath;
+  vector<imgstore_ent> is_wents;        // its index
+  long long is_woff;                    // where the next blob goes
+
+  int fresh(const imgstore_ent *ent);
+  int append(imgstore_ent *ent, int fd, off_t off, long len);
+  imgstore(const imgstore &);           // not copyable
+  imgstore &operator=(const imgstore &);
+
+public:
+  imgstore();
+  ~imgstore();
+  void open(const string &folder);
+  int fresh(const char *imgname);
+  int lookup(const char *imgname, int maxw, int maxh, off_t *off, long *len);
+  void forget(const char *imgname);
+  int begin();
+  int put(const char *imgname, int level, const imsg_t *imsg, const char *pixels, long len);
+  int commit();
+  void abort();
+};
+
+#endif /* __IMGSTORE_H__ */
@@ -26,27 +26,340 @@ THE POSSIBILITY OF SUCH DAMAGE.
 ------------------------------------------------------------------------------*/
 
 #include "ltga.h"
-#include <fstream>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TGA_X86SIMD
+#include <immintrin.h>
+#endif
 
 //--------------------------------------------------
 // global functions
 //--------------------------------------------------
-static int TGAReadError = 0;
+#define TGA_HEADERSIZE 18
+#define TGA_READBUF    (64*1024)
+#define TGA_WRITEBUF   (64*1024)
+#define TGA_SWAPCHUNK  (64*1024)   // pixels read and swapped at a time
+#define LTGA_CKPTPIXELS (256*1024) // pixels between RLE checkpoints
+#define LTGA_DECODERS  8           // most threads decoding one RLE image
+
+// Buffered reader for LoadFromFile. Small reads, such as RLE packet
+// headers, are served from a TGA_READBUF buffer; reads larger than the
+// buffer go straight into the destination.
+class TGAReader
+{
+public:
+    TGAReader(FILE *fp) : m_fp(fp), m_pos(0), m_len(0), m_tell(0) {}
+
+    // the file offset of the next byte to be read
+    size_t Tell() const { return m_tell; }
+
+    // reads size bytes into data, returns false if the file is too short
+    bool Read(byte *data, size_t size)
+    {
+        size_t n = m_len - m_pos;
+        m_tell += size;
+        if (size <= n)
+        {
+            memcpy(data, m_buf+m_pos, size);
+            m_pos += size;
+            return true;
+        }
+        memcpy(data, m_buf+m_pos, n);
+        data += n;
+        size -= n;
+        m_pos = m_len = 0;
+        if (size >= TGA_READBUF)
+            return fread(data, 1, size, m_fp) == size;
+        m_len = fread(m_buf, 1, TGA_READBUF, m_fp);
+        if (m_len < size)
+            return false;
+        memcpy(data, m_buf, size);
+        m_pos = size;
+        return true;
+    }
+
+    bool Skip(size_t size)
+    {
+        size_t n = m_len - m_pos;
+        m_tell += size;
+        if (size <= n)
+        {
+            m_pos += size;
+            return true;
+        }
+        m_pos = m_len = 0;
+        return fseek(m_fp, (long)(size - n), SEEK_CUR) == 0;
+    }
+
+private:
+    FILE *m_fp;
+    size_t m_pos, m_len;
+    size_t m_tell;
+    byte m_buf[TGA_READBUF];
+};
+
+//--------------------------------------------------
+// R and B swap kernels. Each swaps the first and third byte of n
+// pixels going from src to dst; src and dst may be the same buffer.
+//--------------------------------------------------
+typedef void (*SwapFunc)(byte *dst, const byte *src, size_t n);
+
+static void Swap24(byte *dst, const byte *src, size_t n)
+{
+    byte temp;
+    for (size_t i = 0; i < n*3; i += 3)
+    {
+        temp = src[i];
+        dst[i+1] = src[i+1];
+        dst[i] = src[i+2];
+        dst[i+2] = temp;
+    }
+}
+
+static void Swap32(byte *dst, const byte *src, size_t n)
+{
+    uint p;
+    for (size_t i = 0; i < n; i++)
+    {
+        memcpy(&p, src+i*4, 4);
+        p = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16); // little endian
+        memcpy(dst+i*4, &p, 4);
+    }
+}
 
-void ReadData(std::ifstream &file, char* data, uint size)
+#ifdef TGA_X86SIMD
+// 16 bytes hold 5 24-bit pixels and 1 byte of the next, which is left as is
+__attribute__((target("ssse3")))
+static void Swap24SSSE3(byte *dst, const byte *src, size_t n)
 {
-    if (!file.is_open())
+    const __m128i mask = _mm_setr_epi8(2,1,0, 5,4,3, 8,7,6, 11,10,9, 14,13,12, 15);
+    size_t i = 0;
+    for (; i+6 <= n; i += 5)
+        _mm_storeu_si128((__m128i*)(dst+i*3),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+i*3)), mask));
+    Swap24(dst+i*3, src+i*3, n-i);
+}
+
+__attribute__((target("ssse3")))
+static void Swap32SSSE3(byte *dst, const byte *src, size_t n)
+{
+    const __m128i mask = _mm_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+    size_t i = 0;
+    for (; i+4 <= n; i += 4)
+        _mm_storeu_si128((__m128i*)(dst+i*4),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+i*4)), mask));
+    Swap32(dst+i*4, src+i*4, n-i);
+}
+
+// 10 24-bit pixels at a time: each 128-bit lane gets 5 of them, with the
+// high lane loaded from 15 bytes in. Both loads happen before the stores,
+// and the low lane's 16th byte is rewritten by the high lane's store.
+__attribute__((target("avx2")))
+static void Swap24AVX2(byte *dst, const byte *src, size_t n)
+{
+    const __m256i mask = _mm256_setr_epi8(2,1,0, 5,4,3, 8,7,6, 11,10,9, 14,13,12, 15,
+                                          2,1,0, 5,4,3, 8,7,6, 11,10,9, 14,13,12, 15);
+    size_t i = 0;
+    for (; i+11 <= n; i += 10)
+    {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src+i*3))),
+            _mm_loadu_si128((const __m128i*)(src+i*3+15)), 1);
+        v = _mm256_shuffle_epi8(v, mask);
+        _mm_storeu_si128((__m128i*)(dst+i*3), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i*)(dst+i*3+15), _mm256_extracti128_si256(v, 1));
+    }
+    Swap24SSSE3(dst+i*3, src+i*3, n-i);
+}
+
+__attribute__((target("avx2")))
+static void Swap32AVX2(byte *dst, const byte *src, size_t n)
+{
+    const __m256i mask = _mm256_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15,
+                                          2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+    size_t i = 0;
+    for (; i+8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i*)(dst+i*4),
+            _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src+i*4)), mask));
+    Swap32SSSE3(dst+i*4, src+i*4, n-i);
+}
+#endif
+
+// Returns the fastest swap kernel this CPU supports for depth-byte
+// pixels, or 0 if depth-byte pixels have no R and B to swap.
+static SwapFunc GetSwapFunc(uint depth)
+{
+    static SwapFunc swap24 = 0, swap32 = 0;
+
+    if (!swap24)
+    {
+        swap24 = Swap24;
+        swap32 = Swap32;
+#ifdef TGA_X86SIMD
+        if (__builtin_cpu_supports("avx2"))
+        {
+            swap24 = Swap24AVX2;
+            swap32 = Swap32AVX2;
+        }
+        else if (__builtin_cpu_supports("ssse3"))
+        {
+            swap24 = Swap24SSSE3;
+            swap32 = Swap32SSSE3;
+        }
+#endif
+    }
+    return depth == 3 ? swap24 : depth == 4 ? swap32 : 0;
+}
+
+// Fills size bytes at dst, a multiple of depth bytes, with the depth-byte
+// pixel at the start of dst, doubling the copied span each time.
+static void FillRun(byte *dst, size_t size, uint depth)
+{
+    size_t n;
+
+    if (depth == 1)
+    {
+        memset(dst+1, dst[0], size-1);
         return;
-    uint a = file.tellg();
-    a+= size;
-    file.read(data, size);
-    if (a != uint(file.tellg()))
+    }
+    for (n = depth; n < size; n *= 2)
+        memcpy(dst+n, dst, n < size-n ? n : size-n);
+}
+
+// Decodes the RLE packets at src, up to srcEnd, into the size bytes at
+// dst. Unless last, the packets must end exactly at dst+size; the last
+// packet of the image may run past it. Returns false if they don't.
+// If ckpts is given, the whole image is being decoded from the file
+// read at base, and a checkpoint is recorded in ckpts at the first
+// packet of every LTGA_CKPTPIXELS pixels, as LoadFromFile does.
+static bool DecodePackets(const byte *src, const byte *srcEnd, byte *dst, size_t size,
+                          uint depth, SwapFunc swap, bool last,
+                          std::vector<LTGACheckpoint> *ckpts = 0, const byte *base = 0)
+{
+    byte *start = dst, *end = dst + size;
+    size_t count, next = 0;
+
+    while (dst < end)
     {
-        TGAReadError = 1;
+        if (ckpts && (size_t)(dst - start) >= next*depth)
+        {
+            LTGACheckpoint ckpt;
+            ckpt.pixel = (dst - start)/depth;
+            ckpt.file = src - base;
+            ckpts->push_back(ckpt);
+            next = ckpt.pixel + LTGA_CKPTPIXELS;
+        }
+        if (src >= srcEnd)
+            return false;
+        count = ((*src & 127) + 1) * depth;
+        if (count > (size_t)(end - dst))
+        {
+            if (!last)
+                return false;
+            count = end - dst;
+        }
+        if ((*src++ & 128) == 128)
+        {   // this is an rle packet, one pixel repeated
+            if ((size_t)(srcEnd - src) < depth)
+                return false;
+            memcpy(dst, src, depth);
+            src += depth;
+            if (swap)
+                swap(dst, dst, 1);
+            FillRun(dst, count, depth);
+        }
+        else
+        {   // this is a raw packet
+            if ((size_t)(srcEnd - src) < count)
+                return false;
+            if (swap)
+                swap(dst, src, count/depth);
+            else
+                memcpy(dst, src, count);
+            src += count;
+        }
+        dst += count;
     }
+    return true;
 }
 
+#ifndef _WIN32
+// The segments between checkpoints of an image being decoded by
+// DecodeRLE, handed out to its threads one at a time
+struct TGASegments
+{
+    const byte *src, *srcEnd;
+    byte *pixels;
+    const LTGACheckpoint *checkpoints;
+    size_t n, npixels;
+    uint depth;
+    SwapFunc swap;
+    pthread_mutex_t lock;
+    size_t next;
+    bool failed;
+};
+
+static void *DecodeSegments(void *arg)
+{
+    TGASegments *segs = (TGASegments *)arg;
+    size_t i, beg, end;
+    bool ok;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&segs->lock);
+        i = segs->failed ? segs->n : segs->next++;
+        pthread_mutex_unlock(&segs->lock);
+        if (i >= segs->n)
+            return 0;
+
+        beg = segs->checkpoints[i].pixel;
+        end = i+1 < segs->n ? segs->checkpoints[i+1].pixel : segs->npixels;
+        ok = DecodePackets(segs->src + segs->checkpoints[i].file, segs->srcEnd,
+                           segs->pixels + beg*segs->depth, (end-beg)*segs->depth,
+                           segs->depth, segs->swap, i+1 == segs->n);
+        if (!ok)
+        {
+            pthread_mutex_lock(&segs->lock);
+            segs->failed = true;
+            pthread_mutex_unlock(&segs->lock);
+        }
+    }
+}
+#endif
+
+#ifndef _WIN32
+// makes index that of the file of st, with no checkpoints yet
+static void StampIndex(LTGAIndex *index, const struct stat &st)
+{
+#ifdef __APPLE__
+    index->mtime = (long long)st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    index->mtime = (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    index->ino = (long long)st.st_ino;
+    index->size = (long long)st.st_size;
+    index->checkpoints.clear();
+}
+
+// true if index is of the file of st as it is now
+static bool IndexHolds(const LTGAIndex &index, const struct stat &st)
+{
+    LTGAIndex now;
+
+    StampIndex(&now, st);
+    return index.mtime == now.mtime && index.ino == now.ino && index.size == now.size;
+}
+#endif
+
 //--------------------------------------------------
 LTGA::LTGA()
 {
@@ -57,6 +370,8 @@ LTGA::LTGA()
     m_alphaDepth = 0;
     m_type = itUndefined;
     m_pixels = 0;
+    m_file = 0;
+    m_bgr = false;
 }
 
 
@@ -70,6 +385,8 @@ LTGA::LTGA(const std::string &filename)
     m_alphaDepth = 0;
     m_type = itUndefined;
     m_pixels = 0;
+    m_file = 0;
+    m_bgr = false;
     LoadFromFile(filename);
 }
 
@@ -82,6 +399,10 @@ LTGA::LTGA(uint _width, uint _height) : m_height(_height), m_width(_width) {
 
     m_type = itRGB;
 
+    m_pixels = 0;
+    m_file = 0;
+    m_bgr = false;
+
 #if 0
     m_pixels = (byte*) malloc(m_width*m_height*(m_pixelDepth/8));
 
@@ -100,36 +421,18 @@ LTGA::~LTGA()
 
 
 //--------------------------------------------------
-bool LTGA::LoadFromFile(const std::string &filename)
+// parses the 18-byte TGA header into the members, returns false if the
+// image is of a kind we can't load
+bool LTGA::ParseHeader(const byte *header, bool &rle, bool &truecolor)
 {
-    if (m_loaded)
-        Clear();
-    m_loaded = false;
+    rle = false;
+    truecolor = false;
 
-    std::ifstream file;
-    file.open(filename.c_str(), std::ios::binary);
-    if (!file.is_open())
+    // header[0] is the length of the ID field, header[1] the color map type
+    if (header[1] == 1)
         return false;
 
-    bool rle = false;
-    bool truecolor = false;
-    uint CurrentPixel = 0;
-    byte ch_buf1, ch_buf2;
-    byte buf1[1000];
-
-    byte IDLength;
-    byte IDColorMapType;
-    byte IDImageType;
-
-    ReadData(file, (char*)&IDLength, 1);
-    ReadData(file, (char*)&IDColorMapType, 1);
-    
-    if (IDColorMapType == 1)
-        return false;
-
-    ReadData(file, (char*)&IDImageType, 1); 
-
-    switch (IDImageType)
+    switch (header[2])
     {
     case 2:
             truecolor = true;
@@ -149,21 +452,16 @@ bool LTGA::LoadFromFile(const std::string &filename)
             return false;
     }
 
-    file.seekg(5, std::ios::cur);
-
-    file.seekg(4, std::ios::cur);
-    ReadData(file, (char*)&m_width, 2);
-    ReadData(file, (char*)&m_height, 2);
-    ReadData(file, (char*)&m_pixelDepth, 1);
+    // skip the color map spec (5 bytes) and the x and y origin (4 bytes)
+    m_width = header[12] | (header[13] << 8);
+    m_height = header[14] | (header[15] << 8);
+    m_pixelDepth = header[16];
 
     if (! ((m_pixelDepth == 8) || (m_pixelDepth ==  24) ||
              (m_pixelDepth == 16) || (m_pixelDepth == 32)))
         return false;
 
-    ReadData(file, (char*)&ch_buf1, 1); 
-    
-    ch_buf2 = 15; //00001111;
-    m_alphaDepth = ch_buf1 & ch_buf2;
+    m_alphaDepth = header[17] & 15; //00001111;
 
     if (! ((m_alphaDepth == 0) || (m_alphaDepth == 8)))
         return false;
@@ -178,126 +476,520 @@ bool LTGA::LoadFromFile(const std::string &filename)
     if (m_type == itUndefined)
         return false;
 
-    file.seekg(IDLength, std::ios::cur);
+    return true;
+}
+
+
+//--------------------------------------------------
+bool LTGA::LoadFromFile(const std::string &filename, LTGAIndex *index)
+{
+    if (m_loaded)
+        Clear();
+    m_loaded = false;
+
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    // the reader's buffer is too large for the stack
+    TGAReader *file = new TGAReader(fp);
+
+    bool rle, truecolor;
+    byte header[TGA_HEADERSIZE];
+    uint depth;
+    size_t size;
+    SwapFunc swap;
+#ifndef _WIN32
+    struct stat st;
+#endif
+
+    if (index)
+    {
+        index->mtime = index->ino = index->size = -1;
+        index->checkpoints.clear();
+#ifndef _WIN32
+        if (fstat(fileno(fp), &st) == 0)
+            StampIndex(index, st);
+#endif
+    }
 
-    m_pixels = (byte*) malloc(m_width*m_height*(m_pixelDepth/8));
+    if (!file->Read(header, TGA_HEADERSIZE))
+        goto fail;
+
+    if (!ParseHeader(header, rle, truecolor))
+        goto fail;
+
+    if (!file->Skip(header[0]))
+        goto fail;
+
+    depth = m_pixelDepth/8;
+    size = (size_t)m_width*m_height*depth;
+    m_pixels = (byte*) malloc(size ? size : 1);
+    if (!m_pixels)
+        goto fail;
+
+    // BGR(A) is swapped to RGB(A) as pixels are read, while in cache
+    swap = truecolor ? GetSwapFunc(depth) : 0;
 
     if (!rle)
-        ReadData(file, (char*)m_pixels, m_width*m_height*(m_pixelDepth/8));
+    {
+        size_t chunk = (size_t)TGA_SWAPCHUNK*depth;
+        for (size_t off = 0; off < size; off += chunk)
+        {
+            if (chunk > size - off)
+                chunk = size - off;
+            if (!file->Read(m_pixels+off, chunk))
+                goto fail;
+            if (swap)
+                swap(m_pixels+off, m_pixels+off, chunk/depth);
+        }
+    }
     else
     {
-        while (CurrentPixel < m_width*m_height -1)
+        byte *dst = m_pixels;
+        byte *end = m_pixels + size;
+        byte packet;
+        size_t count, next = 0;
+
+        while (dst < end)
         {
-            ReadData(file, (char*)&ch_buf1, 1);
-            if ((ch_buf1 & 128) == 128)
-            {   // this is an rle packet
-                ch_buf2 = (byte)((ch_buf1 & 127) + 1);   // how many pixels are encoded using this packet
-                ReadData(file, (char*)buf1, m_pixelDepth/8);
-                for (uint i=CurrentPixel; i<CurrentPixel+ch_buf2; i++)
-                    for (uint j=0; j<m_pixelDepth/8; j++)
-                        m_pixels[i*m_pixelDepth/8+j] = buf1[j];
-                CurrentPixel += ch_buf2;
+            if (index && (size_t)(dst - m_pixels) >= next*depth)
+            {   // the first packet at or after the next checkpoint
+                LTGACheckpoint ckpt;
+                ckpt.pixel = (dst - m_pixels)/depth;
+                ckpt.file = file->Tell();
+                index->checkpoints.push_back(ckpt);
+                next = ckpt.pixel + LTGA_CKPTPIXELS;
+            }
+            if (!file->Read(&packet, 1))
+                goto fail;
+            count = ((packet & 127) + 1) * depth;  // bytes encoded by this packet
+            if (count > (size_t)(end - dst))
+                count = end - dst;                 // don't run past the image
+            if ((packet & 128) == 128)
+            {   // this is an rle packet, one pixel repeated
+                if (!file->Read(dst, depth))
+                    goto fail;
+                if (swap)
+                    swap(dst, dst, 1);
+                FillRun(dst, count, depth);
             }
             else
             {   // this is a raw packet
-                ch_buf2 = (byte)((ch_buf1 & 127) + 1);
-                ReadData(file, (char*)buf1, m_pixelDepth/8*ch_buf2);
-                for (uint i=CurrentPixel; i<CurrentPixel+ch_buf2; i++)
-                    for (uint j=0; j<m_pixelDepth/8; j++)
-                        m_pixels[i*m_pixelDepth/8+j] =  buf1[(i-CurrentPixel)*m_pixelDepth/8+j];
-                CurrentPixel += ch_buf2;
+                if (!file->Read(dst, count))
+                    goto fail;
+                if (swap)
+                    swap(dst, dst, count/depth);
             }
+            dst += count;
         }
     }
 
-    if (TGAReadError != 0)
+    delete file;
+    fclose(fp);
+    m_loaded = true;
+
+    return true;
+
+fail:
+    delete file;
+    fclose(fp);
+    Clear();
+    if (index)
+        index->checkpoints.clear();
+    return false;
+}
+
+//--------------------------------------------------
+// decodes the RLE image, whose header has been parsed, read at map
+// from the checkpoints in index, the segments between them in parallel
+bool LTGA::DecodeRLE(const byte *map, size_t size, const LTGAIndex &index, bool truecolor)
+{
+#ifndef _WIN32
+    const std::vector<LTGACheckpoint> &ckpts = index.checkpoints;
+    uint depth = m_pixelDepth/8;
+    size_t npixels = (size_t)m_width*m_height, i;
+    pthread_t tids[LTGA_DECODERS-1];
+    int nthreads, started;
+    long ncpu;
+    TGASegments segs;
+
+    // the index came from another decode, but make sure of it
+    if (ckpts.empty() || ckpts[0].pixel != 0)
+        return false;
+    for (i = 0; i < ckpts.size(); i++)
+        if (ckpts[i].pixel >= npixels || ckpts[i].file >= size ||
+            (i && ckpts[i].pixel <= ckpts[i-1].pixel))
+            return false;
+
+    m_pixels = (byte*) malloc(npixels ? npixels*depth : 1);
+    if (!m_pixels)
+        return false;
+
+    segs.src = map;
+    segs.srcEnd = map + size;
+    segs.pixels = m_pixels;
+    segs.checkpoints = &ckpts[0];
+    segs.n = ckpts.size();
+    segs.npixels = npixels;
+    segs.depth = depth;
+    segs.swap = truecolor ? GetSwapFunc(depth) : 0;
+    segs.next = 0;
+    segs.failed = false;
+    pthread_mutex_init(&segs.lock, NULL);
+
+    // this thread decodes too
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu < 1 ? 1 : ncpu > LTGA_DECODERS ? LTGA_DECODERS : (int)ncpu;
+    nthreads = (size_t)nthreads > segs.n ? (int)segs.n : nthreads;
+    for (started = 0; started < nthreads-1; started++)
+        if (pthread_create(&tids[started], NULL, DecodeSegments, &segs))
+            break;
+    DecodeSegments(&segs);
+    while (started > 0)
+        pthread_join(tids[--started], NULL);
+    pthread_mutex_destroy(&segs.lock);
+
+    if (segs.failed)
     {
+        free(m_pixels);
+        m_pixels = 0;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------
+bool LTGA::ReadFile(const std::string &filename, LTGAIndex *index)
+{
+#ifndef _WIN32
+    if (m_loaded)
         Clear();
+    m_loaded = false;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
         return false;
+
+    struct stat st;
+    bool rle = false, truecolor;
+    byte *file = 0;
+    size_t size = 0, got = 0, offset;
+    ssize_t n;
+
+    // read rather than mapped: a mapping of a file that is later
+    // truncated faults on the pages that are gone. Serving without a
+    // copy is left to the image store, whose blobs go out by sendfile.
+    if (fstat(fd, &st) == 0 && st.st_size > TGA_HEADERSIZE)
+    {
+        size = (size_t)st.st_size;
+        file = (byte*) malloc(size);
+        for (; file && got < size; got += n)
+        {
+            n = pread(fd, file + got, size - got, got);
+            if (n <= 0)
+                break;
+        }
+        if (got < size)
+        {
+            free(file);
+            file = 0;
+        }
     }
-    m_loaded = true;
+    close(fd);
 
-    file.close(); // close file SJ
+    if (file && ParseHeader(file, rle, truecolor) && !rle)
+    {
+        offset = TGA_HEADERSIZE + file[0];
+        if (size - offset >= (size_t)m_width*m_height*(m_pixelDepth/8))
+        {
+            m_file = file;
+            m_pixels = file + offset;
+            m_bgr = truecolor && GetSwapFunc(m_pixelDepth/8);
+            m_loaded = true;
+            return true;
+        }
+    }
+    else if (file && rle && index && index->checkpoints.size() > 1 && IndexHolds(*index, st))
+    {
+        if (DecodeRLE(file, size, *index, truecolor))
+        {
+            free(file);
+            m_loaded = true;
+            return true;
+        }
+    }
+    else if (file && rle)
+    {   // no index, or not of this file: decode in one go, indexing it
+        uint depth = m_pixelDepth/8;
+        size_t npixels = (size_t)m_width*m_height;
+        std::vector<LTGACheckpoint> *ckpts = 0;
 
-    // swap BGR(A) to RGB(A)
+        if (index)
+        {
+            StampIndex(index, st);
+            ckpts = &index->checkpoints;
+        }
+        offset = TGA_HEADERSIZE + file[0];
+        m_pixels = (byte*) malloc(npixels ? npixels*depth : 1);
+        if (m_pixels && offset <= size &&
+            DecodePackets(file + offset, file + size, m_pixels, npixels*depth, depth,
+                          truecolor ? GetSwapFunc(depth) : 0, true, ckpts, file))
+        {
+            free(file);
+            m_loaded = true;
+            return true;
+        }
+        if (index)
+            index->checkpoints.clear();
+    }
 
-    byte temp;
-    if ((m_type == itRGB) || (m_type == itRGBA))
-        if ((m_pixelDepth == 24) || (m_pixelDepth == 32))
-            for (uint i= 0; i<m_width*m_height; i++)
+    free(file);
+    Clear();
+    if (file)
+        return false;   // read, but not a TGA image it can decode
+#endif
+    return LoadFromFile(filename, index);
+}
+
+//--------------------------------------------------
+bool LTGA::IndexFile(const std::string &filename, LTGAIndex &index)
+{
+    index.mtime = index.ino = index.size = -1;
+    index.checkpoints.clear();
+#ifndef _WIN32
+    if (m_loaded)
+        Clear();
+    m_loaded = false;
+
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return false;
+    TGAReader *file = new TGAReader(fp);
+
+    struct stat st;
+    bool rle, truecolor, ok = false;
+    byte header[TGA_HEADERSIZE], packet;
+    size_t npixels, done, next = 0;
+    uint depth, count;
+
+    if (fstat(fileno(fp), &st) == 0 && file->Read(header, TGA_HEADERSIZE) &&
+        ParseHeader(header, rle, truecolor) && file->Skip(header[0]))
+    {
+        StampIndex(&index, st);
+        depth = m_pixelDepth/8;
+        npixels = (size_t)m_width*m_height;
+        for (done = 0; rle && done < npixels; done += count)
+        {
+            if (done >= next)
             {
-                temp = m_pixels[i*m_pixelDepth/8];
-                m_pixels[i*m_pixelDepth/8] = m_pixels[i*m_pixelDepth/8+2];
-                m_pixels[i*m_pixelDepth/8+2] = temp;
+                LTGACheckpoint ckpt;
+                ckpt.pixel = done;
+                ckpt.file = file->Tell();
+                index.checkpoints.push_back(ckpt);
+                next = done + LTGA_CKPTPIXELS;
             }
+            if (!file->Read(&packet, 1))
+                break;
+            count = (packet & 127) + 1;
+            // a run is one pixel, a raw packet one per pixel; a skip
+            // past the end of the file is only caught by the next read
+            if (!file->Skip((packet & 128) == 128 ? depth : count*depth))
+                break;
+        }
+        ok = !rle || done >= npixels;
+    }
 
-    return true;
+    delete file;
+    fclose(fp);
+    Clear();
+    if (!ok)
+        index.checkpoints.clear();
+    return ok;
+#else
+    return false;
+#endif
 }
 
 void LTGA::SwapRB() {
-    byte temp;
     if ((m_type == itRGB) || (m_type == itRGBA))
-        if ((m_pixelDepth == 24) || (m_pixelDepth == 32))
-            for (uint i= 0; i<m_width*m_height; i++)
-            {
-                temp = m_pixels[i*m_pixelDepth/8];
-                m_pixels[i*m_pixelDepth/8] = m_pixels[i*m_pixelDepth/8+2];
-                m_pixels[i*m_pixelDepth/8+2] = temp;
-            }
+    {
+        SwapFunc swap = GetSwapFunc(m_pixelDepth/8);
+        if (swap)
+        {
+            swap(m_pixels, m_pixels, (size_t)m_width*m_height);
+            m_bgr = !m_bgr;
+        }
+    }
 }
 
-struct TGA_HEADER
+// Buffered writer for WriteToFile. Pixels are swizzled or encoded
+// straight into the buffer, which is written out as it fills.
+class TGAWriter
 {
-    byte  identsize;          // size of ID field that follows 18 byte header (0 usually)
-    byte  colourmaptype;      // type of colour map 0=none, 1=has palette
-    byte  imagetype;          // type of image 0=none,1=indexed,2=rgb,3=grey,+8=rle packed
+public:
+    TGAWriter(FILE *fp) : m_fp(fp), m_len(0), m_ok(true) {}
 
-    short colourmapstart;     // first colour map entry in palette
-    short colourmaplength;    // number of colours in palette
-    byte  colourmapbits;      // number of bits per palette entry 15,16,24,32
+    // returns room for size bytes, at most TGA_WRITEBUF, to be
+    // filled in before the next call
+    byte *Reserve(size_t size)
+    {
+        if (m_len + size > TGA_WRITEBUF)
+            Flush();
+        m_len += size;
+        return m_buf + m_len - size;
+    }
+
+    // returns false if any write failed
+    bool Flush()
+    {
+        if (m_len && fwrite(m_buf, 1, m_len, m_fp) != m_len)
+            m_ok = false;
+        m_len = 0;
+        return m_ok;
+    }
 
-    short xstart;             // image x origin
-    short ystart;             // image y origin
-    short width;              // image width in pixels
-    short height;             // image height in pixels
-    byte  bits;               // image bits per pixel 8,16,24,32
-    byte  descriptor;         // image descriptor bits (vh flip bits)
+private:
+    FILE *m_fp;
+    size_t m_len;
+    bool m_ok;
+    byte m_buf[TGA_WRITEBUF];
 };
 
+// Returns the number of pixels, at most n, at the start of the
+// depth-byte pixels at p that are the same as the first. Pixels
+// 0..j are the same iff byte k equals byte k+depth for all k < j*depth.
+static size_t RunLength(const byte *p, size_t n, uint depth)
+{
+    size_t k = 0, len = (n-1)*depth;
 
-using namespace std;
-void LTGA::WriteToFile(const std::string& name) {
-  LTGA* pltga = this;
-  TGA_HEADER th;
+    for (; k < len && p[k] == p[k+depth]; k++);
+    return k/depth + 1;
+}
 
-  th.identsize = 0;
-  th.colourmaptype = 0;
-  th.imagetype = 2;
-  th.colourmapstart = 0;
-  th.colourmaplength = 0;
-  th.colourmapbits = 0;
-  th.xstart = 0;
-  th.ystart = 0;
-  th.width = pltga->GetImageWidth();
-  th.height = pltga->GetImageHeight();
-  th.bits = pltga->GetPixelDepth();
-  th.descriptor = 0x0F & pltga->GetAlphaDepth();
+#ifdef TGA_X86SIMD
+__attribute__((target("sse2")))
+static size_t RunLengthSSE2(const byte *p, size_t n, uint depth)
+{
+    size_t k = 0, len = (n-1)*depth;
+    int eq;
 
-  ofstream os(name.c_str(), ios_base::binary);
+    for (; k+16 <= len; k += 16)
+    {
+        eq = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+k)),
+                                              _mm_loadu_si128((const __m128i*)(p+k+depth))));
+        if (eq != 0xffff)
+            return (k + __builtin_ctz(~eq))/depth + 1;
+    }
+    for (; k < len && p[k] == p[k+depth]; k++);
+    return k/depth + 1;
+}
+#endif
 
-  os.write((char*)&th, 3);
-  os.write((char*)&th.colourmapstart, 5);
-  os.write((char*)&th.xstart, 10);
+// Writes the n depth-byte pixels at src as RLE packets, swizzled by
+// swap, if not 0. Runs of 2 or more pixels become run packets.
+static void EncodePackets(TGAWriter *out, const byte *src, size_t n, uint depth, SwapFunc swap)
+{
+    static size_t (*runLength)(const byte *, size_t, uint) = 0;
+    size_t i, run, lit;
+    byte *dst;
+
+    if (!runLength)
+    {
+        runLength = RunLength;
+#ifdef TGA_X86SIMD
+        if (__builtin_cpu_supports("sse2"))
+            runLength = RunLengthSSE2;
+#endif
+    }
+
+    for (i = 0; i < n; )
+    {
+        run = runLength(src+i*depth, n-i < 128 ? n-i : 128, depth);
+        if (run > 1)
+        {
+            dst = out->Reserve(1+depth);
+            dst[0] = (byte)(128 | (run-1));
+            if (swap)
+                swap(dst+1, src+i*depth, 1);
+            else
+                memcpy(dst+1, src+i*depth, depth);
+            i += run;
+            continue;
+        }
 
-  //cerr << "wrote header with " << sizeof(th) << " bytes." << endl;
+        // literals up to the next run of 2 or more
+        for (lit = i+1; lit < n && lit-i < 128 &&
+                 !(lit+1 < n && !memcmp(src+lit*depth, src+(lit+1)*depth, depth)); lit++);
+        dst = out->Reserve(1+(lit-i)*depth);
+        dst[0] = (byte)(lit-i-1);
+        if (swap)
+            swap(dst+1, src+i*depth, lit-i);
+        else
+            memcpy(dst+1, src+i*depth, (lit-i)*depth);
+        i = lit;
+    }
+}
 
-  SwapRB();
+// Writes the image as an uncompressed (type 2 or 3) or, if rle, an RLE
+// (type 10 or 11) TGA file. The pixels are swizzled to BGR(A) as they
+// are copied out, so the image itself is never modified. RLE packets
+// don't cross rows. Returns false if the file can't be written.
+bool LTGA::WriteToFile(const std::string& name, bool rle)
+{
+    uint depth = m_pixelDepth/8;
+    size_t rowlen = (size_t)m_width*depth;
+    bool greyscale = m_type == itGreyscale;
+    byte header[TGA_HEADERSIZE];
+    SwapFunc swap;
 
-  os.write((char*)pltga->GetPixels(), pltga->GetImageWidth()*pltga->GetImageHeight()*(pltga->GetPixelDepth()/8));
+    if (!m_loaded || !m_pixels || !depth)
+        return false;
 
-  os.close();
+    FILE *fp = fopen(name.c_str(), "wb");
+    if (!fp)
+        return false;
+    // the writer's buffer is too large for the stack
+    TGAWriter *out = new TGAWriter(fp);
+
+    memset(header, 0, TGA_HEADERSIZE);
+    header[2] = (greyscale ? 3 : 2) + (rle ? 8 : 0);
+    header[12] = m_width & 0xff;
+    header[13] = (m_width >> 8) & 0xff;
+    header[14] = m_height & 0xff;
+    header[15] = (m_height >> 8) & 0xff;
+    header[16] = m_pixelDepth;
+    header[17] = m_alphaDepth & 15;
+    memcpy(out->Reserve(TGA_HEADERSIZE), header, TGA_HEADERSIZE);
+
+    // TGA files are BGR(A)
+    swap = !greyscale && !m_bgr ? GetSwapFunc(depth) : 0;
+
+    if (rle)
+    {
+        for (uint y = 0; y < m_height; y++)
+            EncodePackets(out, m_pixels+y*rowlen, m_width, depth, swap);
+    }
+    else
+    {
+        size_t size = rowlen*m_height;
+        size_t chunk = (size_t)(TGA_WRITEBUF/depth)*depth;
+        for (size_t off = 0; off < size; off += chunk)
+        {
+            if (chunk > size - off)
+                chunk = size - off;
+            if (swap)
+                swap(out->Reserve(chunk), m_pixels+off, chunk/depth);
+            else
+                memcpy(out->Reserve(chunk), m_pixels+off, chunk);
+        }
+    }
 
-  SwapRB();
+    bool ok = out->Flush();
+    delete out;
+    return fclose(fp) == 0 && ok;
 }
 
 
@@ -305,9 +997,13 @@ void LTGA::WriteToFile(const std::string& name) {
 //--------------------------------------------------
 void LTGA::Clear()
 {
-    if (m_pixels)
+    if (m_file)
+      free(m_file);
+    else if (m_pixels)
       free(m_pixels);
     m_pixels = 0;
+    m_file = 0;
+    m_bgr = false;
     m_loaded = false;
     m_width = 0;
     m_height = 0;
@@ -30,12 +30,33 @@ THE POSSIBILITY OF SUCH DAMAGE.
 //------------------------------------------------
 
 #include <string>
+#include <vector>
 
 //------------------------------------------------
 
 typedef unsigned char byte;
 typedef unsigned int uint;
 
+// an RLE packet the decoder can start at: its header is at byte "file"
+// of the file and it encodes pixels from "pixel" on
+struct LTGACheckpoint
+{
+    size_t pixel;
+    size_t file;
+};
+
+// checkpoints of an RLE file, in pixel order, about every
+// LTGA_CKPTPIXELS pixels apart, see LoadFromFile, ReadFile and
+// IndexFile. They hold for as long as the file keeps its mtime, to the
+// nanosecond, its inode and its size.
+struct LTGAIndex
+{
+    long long mtime;
+    long long ino;
+    long long size;
+    std::vector<LTGACheckpoint> checkpoints;
+};
+
 enum LImageType {itUndefined, itRGB, itRGBA, itGreyscale};
 const char *const LImageTypeString[] = { "Undefined", "RGB", "RGBA", "Greyscale" };
 //------------------------------------------------
@@ -53,8 +74,22 @@ public:
     // the destructor, cleans up the memory
     virtual ~LTGA();
     // this method loads a tga file. It clears all the data
-    // if needed.
-    bool LoadFromFile(const std::string &filename);
+    // if needed. If index is given, the checkpoints of an RLE
+    // file are recorded in it along the way.
+    bool LoadFromFile(const std::string &filename, LTGAIndex *index = 0);
+    // like LoadFromFile, but the file is read whole, in one go, and the
+    // pixels of an uncompressed image are used in place, in the file's
+    // BGR(A) order. RLE images are decoded by several threads at once if
+    // index holds the file's checkpoints, else in one pass over the bytes
+    // read, recording them. The file is read only once; LoadFromFile is
+    // left to when it can't be read whole. Nothing refers to the file
+    // afterwards, so it may be rewritten or removed while the image is
+    // in use.
+    bool ReadFile(const std::string &filename, LTGAIndex *index = 0);
+    // records the checkpoints of an RLE file in index without decoding
+    // it, for a later ReadFile; only the packet headers are looked at.
+    // No image is loaded. Returns false if the file can't be read.
+    bool IndexFile(const std::string &filename, LTGAIndex &index);
     // this method clears the data, calling it is not nessesary, since it is
     // automatically called by the destructor
     void Clear();
@@ -79,15 +114,25 @@ public:
     
 	// Returns true if an image has been loaded
 	bool IsLoaded(void) const { return m_loaded; }
+	// Returns true if the pixels are in BGR(A) rather than RGB(A) order
+	bool IsBGR(void) const { return m_bgr; }
 
     void SwapRB();
 
-    // IG added this -- may not work for every little file you got.
-    void WriteToFile(const std::string& name);
+    // writes the image as a TGA file, RLE-encoded if rle is true.
+    // Returns false if the file can't be written.
+    bool WriteToFile(const std::string& name, bool rle = false);
 
 protected:
+    bool ParseHeader(const byte *header, bool &rle, bool &truecolor);
+    bool DecodeRLE(const byte *map, size_t size, const LTGAIndex &index, bool truecolor);
+
     // this is the pixel buffer -> the image
     byte *m_pixels;
+    // the file contents m_pixels points into, if ReadFile read them
+    byte *m_file;
+    // true if m_pixels is BGR(A), as in the file
+    bool m_bgr;
     // the pixel depth of the image, including the alpha bits
     uint m_pixelDepth;
     // the depth of the alpha bitplane
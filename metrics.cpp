@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>
+#include <time.h>          // clock_gettime()
+#include <string>
+using namespace std;
+
+#include "metrics.h"
+
+/*
+ * Each thread updates its own slot, so updates need neither locks nor
+ * atomic instructions; readers sum the slots as they find them.  The
+ * last slot is shared by the threads that come after the others have
+ * been taken, and is updated atomically.
+ */
+typedef struct {
+  volatile unsigned long long ms_counters[METRICS_NCOUNTERS];
+  volatile unsigned long long ms_buckets[METRICS_NHISTS][METRICS_BUCKETS];
+  volatile unsigned long long ms_sums[METRICS_NHISTS];
+} metrics_slot;
+
+static metrics_slot metrics_slots[METRICS_MAXTHREADS];
+static int metrics_nslots;
+static __thread metrics_slot *metrics_mine;
+
+#define METRICS_SHARED (&metrics_slots[METRICS_MAXTHREADS-1])
+
+static const char *metrics_types[METRICS_FIND] = {
+  "join", "wlcm", "reid", "query", "reply", "miss", "redrt", "smry"
+};
+static const char *metrics_results[METRICS_NCOUNTERS-METRICS_BFHIT] = {
+  "hit", "miss", "false_positive"
+};
+
+/* per histogram: exposed name and help, unit in exposed units, and the
+   largest bucket exposed on its own, see metrics_expose() */
+static const struct {
+  const char *mh_name;
+  const char *mh_help;
+  double mh_unit;
+  int mh_maxbucket;
+} metrics_hists[METRICS_NHISTS] = {
+  { "dhtn_lookup_seconds", "Time to look an image up in the local database.", 1e-6, 239 },
+  { "dhtn_decode_seconds", "Time to decode an image file.", 1e-6, 239 },
+  { "dhtn_send_seconds", "Time to send an image to a client, pauses included.", 1e-6, 239 },
+  { "dhtn_search_hops", "DHT hops of the searches answered.", 1.0, 15 },
+};
+
+static metrics_slot *
+metrics_slotof()
+{
+  int i;
+
+  if (!metrics_mine) {
+    i = __sync_fetch_and_add(&metrics_nslots, 1);
+    metrics_mine = i < METRICS_MAXTHREADS-1 ? &metrics_slots[i] : METRICS_SHARED;
+  }
+  return(metrics_mine);
+}
+
+static inline void
+metrics_add(metrics_slot *slot, volatile unsigned long long *v, unsigned long long n)
+{
+  if (slot == METRICS_SHARED) {
+    __sync_fetch_and_add(v, n);
+  } else {
+    *v += n;
+  }
+}
+
+/*
+ * metrics_bucket: the bucket of "value".  Values below 16 have their own
+ * bucket; above, a value with its top bit at 2^(e+3) falls in one of the
+ * 8 buckets of width 2^e.
+ */
+static int
+metrics_bucket(unsigned long long value)
+{
+  int msb, e;
+
+  if (value < (2U << METRICS_SUBBITS)) {
+    return((int) value);
+  }
+  msb = 63-__builtin_clzll(value);
+  e = msb-METRICS_SUBBITS;
+  return((e << METRICS_SUBBITS) + (int) (value >> e));
+}
+
+/*
+ * metrics_upper: the largest value in "bucket".
+ */
+static unsigned long long
+metrics_upper(int bucket)
+{
+  int e;
+
+  if (bucket < (2 << METRICS_SUBBITS)) {
+    return((unsigned long long) bucket);
+  }
+  e = (bucket >> METRICS_SUBBITS)-1;
+  return((((unsigned long long) (bucket & ((1 << METRICS_SUBBITS)-1)) + (1 << METRICS_SUBBITS) + 1) << e)-1);
+}
+
+/*
+ * metrics_now: a monotonic clock, in usecs.
+ */
+unsigned long long
+metrics_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long) ts.tv_sec*1000000ULL + ts.tv_nsec/1000);
+}
+
+void
+metrics_count(int counter)
+{
+  metrics_slot *slot = metrics_slotof();
+
+  metrics_add(slot, &slot->ms_counters[counter], 1);
+}
+
+void
+metrics_observe(int hist, unsigned long long value)
+{
+  metrics_slot *slot = metrics_slotof();
+
+  metrics_add(slot, &slot->ms_buckets[hist][metrics_bucket(value)], 1);
+  metrics_add(slot, &slot->ms_sums[hist], value);
+}
+
+/*
+ * metrics_since: observe the usecs since "start", from metrics_now().
+ */
+void
+metrics_since(int hist, unsigned long long start)
+{
+  metrics_observe(hist, metrics_now()-start);
+}
+
+/*
+ * metrics_collect: the counters, and the buckets and sum of each
+ * histogram, summed over all slots.
+ */
+static void
+metrics_collect(unsigned long long *counters, unsigned long long (*buckets)[METRICS_BUCKETS],
+                unsigned long long *sums)
+{
+  int n = metrics_nslots < METRICS_MAXTHREADS ? metrics_nslots : METRICS_MAXTHREADS;
+  int s, i, h;
+
+  for (i = 0; i < METRICS_NCOUNTERS; i++) {
+    counters[i] = 0;
+  }
+  for (h = 0; h < METRICS_NHISTS; h++) {
+    sums[h] = 0;
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+      buckets[h][i] = 0;
+    }
+  }
+  for (s = 0; s < n; s++) {
+    metrics_slot *slot = &metrics_slots[s];
+    for (i = 0; i < METRICS_NCOUNTERS; i++) {
+      counters[i] += slot->ms_counters[i];
+    }
+    for (h = 0; h < METRICS_NHISTS; h++) {
+      sums[h] += slot->ms_sums[h];
+      for (i = 0; i < METRICS_BUCKETS; i++) {
+        buckets[h][i] += slot->ms_buckets[h][i];
+      }
+    }
+  }
+}
+
+/*
+ * metrics_expose: append the metrics to "out" in the Prometheus text
+ * exposition format.  Histogram buckets are exposed at every value
+ * below 16, then at every power of 2, up to mh_maxbucket, so that the
+ * set of buckets doesn't change from one scrape to the next.
+ */
+void
+metrics_expose(string *out)
+{
+  static unsigned long long buckets[METRICS_NHISTS][METRICS_BUCKETS];
+  unsigned long long counters[METRICS_NCOUNTERS], sums[METRICS_NHISTS], cum;
+  char line[256];
+  int i, h;
+
+  metrics_collect(counters, buckets, sums);
+
+  out->append("# HELP dhtn_messages_total DHT messages received, by type.\n"
+              "# TYPE dhtn_messages_total counter\n");
+  for (i = 0; i < METRICS_FIND; i++) {
+    snprintf(line, sizeof(line), "dhtn_messages_total{type=\"%s\"} %llu\n",
+             metrics_types[i], counters[i]);
+    out->append(line);
+  }
+  out->append("# HELP dhtn_client_queries_total Image queries from clients.\n"
+              "# TYPE dhtn_client_queries_total counter\n");
+  snprintf(line, sizeof(line), "dhtn_client_queries_total %llu\n", counters[METRICS_FIND]);
+  out->append(line);
+  out->append("# HELP dhtn_searchdb_total Local database searches, by Bloom filter outcome.\n"
+              "# TYPE dhtn_searchdb_total counter\n");
+  for (i = METRICS_BFHIT; i < METRICS_NCOUNTERS; i++) {
+    snprintf(line, sizeof(line), "dhtn_searchdb_total{result=\"%s\"} %llu\n",
+             metrics_results[i-METRICS_BFHIT], counters[i]);
+    out->append(line);
+  }
+
+  for (h = 0; h < METRICS_NHISTS; h++) {
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n",
+             metrics_hists[h].mh_name, metrics_hists[h].mh_help, metrics_hists[h].mh_name);
+    out->append(line);
+    for (i = cum = 0; i < METRICS_BUCKETS; i++) {
+      cum += buckets[h][i];
+      if (i <= metrics_hists[h].mh_maxbucket &&
+          (i < (2 << METRICS_SUBBITS) || (i & ((1 << METRICS_SUBBITS)-1)) == (1 << METRICS_SUBBITS)-1)) {
+        snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", metrics_hists[h].mh_name,
+                 metrics_upper(i)*metrics_hists[h].mh_unit, cum);
+        out->append(line);
+      }
+    }
+    snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n",
+             metrics_hists[h].mh_name, cum, metrics_hists[h].mh_name,
+             sums[h]*metrics_hists[h].mh_unit, metrics_hists[h].mh_name, cum);
+    out->append(line);
+  }
+}
+
+/*
+ * metrics_quantile: the upper bound of the bucket holding the "q"
+ * quantile of "buckets", of "count" values in all.
+ */
+static unsigned long long
+metrics_quantile(const unsigned long long *buckets, unsigned long long count, double q)
+{
+  unsigned long long cum = 0, rank = (unsigned long long) (q*count+0.5);
+  int i;
+
+  rank = rank ? rank : 1;
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    cum += buckets[i];
+    if (cum >= rank) {
+      return(metrics_upper(i));
+    }
+  }
+  return(0);
+}
+
+/*
+ * metrics_report: print a summary of the metrics on "fp", for people.
+ */
+void
+metrics_report(FILE *fp)
+{
+  static unsigned long long buckets[METRICS_NHISTS][METRICS_BUCKETS];
+  unsigned long long counters[METRICS_NCOUNTERS], sums[METRICS_NHISTS], n;
+  int i, h;
+
+  metrics_collect(counters, buckets, sums);
+
+  fprintf(fp, "messages:");
+  for (i = 0; i < METRICS_FIND; i++) {
+    fprintf(fp, " %s %llu", metrics_types[i], counters[i]);
+  }
+  fprintf(fp, "\nfinds %llu, searchdb hit %llu miss %llu false positive %llu\n",
+          counters[METRICS_FIND], counters[METRICS_BFHIT], counters[METRICS_BFMISS],
+          counters[METRICS_BFFALSE]);
+  for (h = 0; h < METRICS_NHISTS; h++) {
+    for (i = n = 0; i < METRICS_BUCKETS; i++) {
+      n += buckets[h][i];
+    }
+    fprintf(fp, "%s: count %llu", metrics_hists[h].mh_name, n);
+    if (n) {
+      fprintf(fp, " p50 %llu p90 %llu p99 %llu max %llu%s",
+              metrics_quantile(buckets[h], n, 0.50), metrics_quantile(buckets[h], n, 0.90),
+              metrics_quantile(buckets[h], n, 0.99), metrics_quantile(buckets[h], n, 1.0),
+              metrics_hists[h].mh_unit < 1.0 ? " usecs" : "");
+    }
+    fprintf(fp, "\n");
+  }
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+#include <string>
+using namespace std;
+
+#define METRICS_MAXTHREADS  16  // threads with their own slot, the rest share one
+
+/* counters */
+#define METRICS_JOIN      0   // DHT messages received, by type
+#define METRICS_WLCM      1
+#define METRICS_REID      2
+#define METRICS_QUERY     3
+#define METRICS_REPLY     4
+#define METRICS_MISS      5
+#define METRICS_REDRT     6
+#define METRICS_SMRY      7
+#define METRICS_FIND      8   // queries from clients
+#define METRICS_BFHIT     9   // searchdb(): the image is here
+#define METRICS_BFMISS   10   //   the Bloom filter says it isn't
+#define METRICS_BFFALSE  11   //   the Bloom filter was wrong
+#define METRICS_NCOUNTERS 12
+
+/* histograms */
+#define METRICS_LOOKUP    0   // searchdb(), in usecs
+#define METRICS_DECODE    1   // decoding an image file, in usecs
+#define METRICS_SEND      2   // sendimg(), in usecs
+#define METRICS_HOPS      3   // DHT hops of the searches answered
+#define METRICS_NHISTS    4
+
+/*
+ * Histograms are log-linear, as in HdrHistogram: exact below 16, then 8
+ * buckets per power of 2, so a value is known to within 1/8 of itself.
+ */
+#define METRICS_SUBBITS   3
+#define METRICS_BUCKETS ((64-METRICS_SUBBITS+1)<<METRICS_SUBBITS)
+
+extern unsigned long long metrics_now();
+extern void metrics_count(int counter);
+extern void metrics_observe(int hist, unsigned long long value);
+extern void metrics_since(int hist, unsigned long long start);
+extern void metrics_expose(string *out);
+extern void metrics_report(FILE *fp);
+
+#endif /* __METRICS_H__ */
@@ -41,12 +41,39 @@
 #define NETIMG_MSS      1440
 #define NETIMG_USLEEP 500000    // 500 ms
 
-#define NETIMG_VERS    0x1
+#define NETIMG_VERS    0x5
+#define NETIMG_STRIPE  65536    // target bytes of pixels per stripe, see istripe_t
+
+#define NETIMG_CODEC_RAW   0x00  // uncompressed
+#define NETIMG_CODEC_RLE   0x01  // TGA-style run-length of whole pixels, always available
+#define NETIMG_CODEC_LZ4   0x02  // if built with NETIMG_LZ4
+#define NETIMG_CODEC_ZSTD  0x04  // if built with NETIMG_ZSTD
+
+#define NETIMG_PROGRESSIVE 0x01  // iq_flags, im_flags: pixels sent in Adam7 pass order
+#define NETIMG_KEEPALIVE   0x02  // iq_flags: keep the connection open for more queries
+
+/* im_format may also be BGR(A), for images served straight from their
+   files.  OpenGL 1.1 headers don't define these. */
+#ifndef GL_BGR
+#define GL_BGR  0x80E0
+#define GL_BGRA 0x80E1
+#endif
+/* texture internal format for pixels of format im_format */
+#define netimg_texfmt(fmt) ((fmt) == GL_BGR ? GL_RGB : (fmt) == GL_BGRA ? GL_RGBA : (fmt))
 
 typedef struct {
   unsigned char iq_vers;
   unsigned char iq_type;
   char iq_name[NETIMG_MAXFNAME];  // must be NULL terminated
+  unsigned char iq_codecs;        // NETIMG_CODEC_* the client can decode, or'ed
+  unsigned char iq_flags;         // NETIMG_PROGRESSIVE if the client wants it
+  unsigned short iq_maxwidth;     // client's display size, network byte order,
+  unsigned short iq_maxheight;    //   0 for any: smaller images may be sent
+  unsigned int iq_tag;            // im_tag of a partial copy to resume, with the same
+                                  //   iq_flags and display size, 0 for any version
+  unsigned int iq_offset;         // bytes of pixels wanted, as sent: [offset, offset+length),
+  unsigned int iq_length;         //   0 length for the rest, network byte order
+  unsigned int iq_id;             // echoed in im_id, to match replies to queries
 } iqry_t;
 
 typedef struct {
@@ -55,8 +82,25 @@ typedef struct {
   unsigned short im_format;
   unsigned short im_width;
   unsigned short im_height;
+  unsigned char im_codec;   // NETIMG_CODEC_RAW: the pixels follow as is,
+                            // else they follow as a series of stripes
+  unsigned char im_flags;   // NETIMG_PROGRESSIVE: the pixels follow pass by pass,
+                            // see imgcodec_interlace(), instead of row by row
+  unsigned char im_rsvd[2];
+  unsigned int im_tag;      // version of the pixels sent, never 0; a range
+                            // of another version is ignored, see iq_tag
+  unsigned int im_offset;   // the bytes of pixels that follow: [offset, offset+length)
+  unsigned int im_length;   //   of the im_width*im_height*im_depth, network byte order
+  unsigned int im_id;       // iq_id of the query this answers
 } imsg_t;
 
+typedef struct {
+  unsigned char is_codec;   // the stripe's own codec, RAW if it didn't compress
+  unsigned char is_rsvd[3];
+  unsigned int is_rawlen;   // bytes of pixels, whole pixels, network byte order
+  unsigned int is_len;      // bytes of payload following, network byte order
+} istripe_t;
+
 extern void netimg_glutinit(int *argc, char *argv[], void (*idlefunc)());
 extern void netimg_imginit();
 
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>         // snprintf()
+#include <stdlib.h>        // atexit()
+#include <string.h>        // memcpy(), strlen(), strchr()
+#include <stdarg.h>
+#include <ctype.h>         // isdigit()
+#include <stdint.h>        // intmax_t, uintptr_t
+#include <stddef.h>        // ptrdiff_t
+#include <unistd.h>        // write()
+#include <errno.h>         // ETIMEDOUT
+#include <signal.h>        // sigaction(), raise()
+#include <time.h>          // clock_gettime(), nanosleep()
+#include <pthread.h>
+
+#include "nlog.h"
+
+#define NLOG_LINEMAX  1024  // longest message written, longer ones are cut
+#define NLOG_OUTBUF  65536  // written at once
+
+/*
+ * A message waiting to be written: its format and its arguments,
+ * packed one after the other.  Numbers take 8 bytes each, strings
+ * their length and a NUL.
+ */
+typedef struct {
+  volatile unsigned long nr_seq;  // see nlog_post()
+  const char *nr_fmt;
+  short nr_level;
+  short nr_len;                   // bytes of nr_args used
+  int nr_rsvd;
+  char nr_args[NLOG_ARGBYTES];
+} nlog_rec;
+
+/* a conversion of a format */
+typedef struct {
+  int ns_stars;       // '*' width and precision, each an int argument
+  char ns_len;        // length modifier, 'H' for hh and 'q' for ll
+  char ns_conv;
+} nlog_spec;
+
+int nlog_level = NLOG_INFO;
+
+/*
+ * The ring is a bounded queue in which each record's nr_seq tells
+ * whose turn it is: a writer of position "pos" may fill the record
+ * when nr_seq is "pos", the reader may take it when it is pos+1, and
+ * hands it back to the writer of pos+NLOG_RING.  Writers claim
+ * positions by advancing nlog_head with compare-and-swap.
+ */
+static nlog_rec nlog_ring[NLOG_RING];
+static volatile unsigned long nlog_head;     // next position to claim
+static volatile unsigned long nlog_written;  // positions before this are out
+static volatile long nlog_dropped;
+static pthread_once_t nlog_once = PTHREAD_ONCE_INIT;
+static volatile int nlog_started;
+
+/* the writer sleeps on nlog_wake while the ring is empty, see
+   nlog_writer(); nlog_flush() waits on nlog_done */
+static pthread_mutex_t nlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nlog_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t nlog_done = PTHREAD_COND_INITIALIZER;
+static volatile int nlog_idle;
+
+static const char *nlog_prefix[NLOG_DEBUG+1] = { "error: ", "warning: ", "", "" };
+
+static const char *
+nlog_parse(const char *p, nlog_spec *s)
+{
+  s->ns_stars = 0;
+  s->ns_len = 0;
+  for (; *p && strchr("-+ #0'", *p); p++);
+  if (*p == '*') {
+    s->ns_stars++;
+    p++;
+  }
+  for (; isdigit((unsigned char) *p); p++);
+  if (*p == '.') {
+    if (*++p == '*') {
+      s->ns_stars++;
+      p++;
+    }
+    for (; isdigit((unsigned char) *p); p++);
+  }
+  switch (*p) {
+  case 'h':
+    s->ns_len = *++p == 'h' ? (p++, 'H') : 'h';
+    break;
+  case 'l':
+    s->ns_len = *++p == 'l' ? (p++, 'q') : 'l';
+    break;
+  case 'L': case 'j': case 'z': case 't':
+    s->ns_len = *p++;
+    break;
+  }
+  s->ns_conv = *p;
+  return(*p ? p+1 : p);
+}
+
+static int
+nlog_put(nlog_rec *r, const void *v, int len)
+{
+  if (r->nr_len+len > NLOG_ARGBYTES) {
+    return(-1);
+  }
+  memcpy(r->nr_args+r->nr_len, v, len);
+  r->nr_len += len;
+  return(0);
+}
+
+/*
+ * nlog_pack: copy the arguments "ap" of the format of "r" into it.
+ * Strings are cut to fit; arguments that don't fit at all are left
+ * out, see nlog_format().
+ */
+static void
+nlog_pack(nlog_rec *r, va_list ap)
+{
+  const char *p = r->nr_fmt, *str;
+  nlog_spec s;
+  long long v;
+  double d;
+  int i, len;
+
+  while ((p = strchr(p, '%'))) {
+    p = nlog_parse(p+1, &s);
+    if (s.ns_conv == '%') {
+      continue;
+    }
+    for (i = 0; i < s.ns_stars; i++) {
+      v = va_arg(ap, int);
+      if (nlog_put(r, &v, sizeof(v))) {
+        return;
+      }
+    }
+
+    switch (s.ns_conv) {
+    case 'd': case 'i':
+      switch (s.ns_len) {
+      case 'l': v = va_arg(ap, long); break;
+      case 'q': v = va_arg(ap, long long); break;
+      case 'j': v = va_arg(ap, intmax_t); break;
+      case 'z': v = (long long) va_arg(ap, size_t); break;
+      case 't': v = va_arg(ap, ptrdiff_t); break;
+      default: v = va_arg(ap, int); break;
+      }
+      break;
+    case 'u': case 'o': case 'x': case 'X':
+      switch (s.ns_len) {
+      case 'l': v = (long long) va_arg(ap, unsigned long); break;
+      case 'q': v = (long long) va_arg(ap, unsigned long long); break;
+      case 'j': v = (long long) va_arg(ap, uintmax_t); break;
+      case 'z': v = (long long) va_arg(ap, size_t); break;
+      case 't': v = va_arg(ap, ptrdiff_t); break;
+      default: v = (long long) va_arg(ap, unsigned int); break;
+      }
+      break;
+    case 'c':
+      v = va_arg(ap, int);
+      break;
+    case 'p':
+      v = (long long) (uintptr_t) va_arg(ap, void *);
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      d = s.ns_len == 'L' ? (double) va_arg(ap, long double) : va_arg(ap, double);
+      if (nlog_put(r, &d, sizeof(d))) {
+        return;
+      }
+      continue;
+    case 's':
+      str = va_arg(ap, const char *);
+      str = str ? str : "(null)";
+      len = strlen(str);
+      len = len < NLOG_ARGBYTES-r->nr_len ? len : NLOG_ARGBYTES-r->nr_len-1;
+      if (len < 0) {
+        return;
+      }
+      nlog_put(r, str, len);
+      nlog_put(r, "", 1);
+      continue;
+    default:
+      return;                 // %n, or not a conversion we know
+    }
+    if (nlog_put(r, &v, sizeof(v))) {
+      return;
+    }
+  }
+}
+
+/* one conversion, with its '*' arguments, if any */
+template <class T> static int
+nlog_conv(char *out, int room, const char *spec, int nstars, int *stars, T v)
+{
+  switch (nstars) {
+  case 0:
+    return(snprintf(out, room, spec, v));
+  case 1:
+    return(snprintf(out, room, spec, stars[0], v));
+  default:
+    return(snprintf(out, room, spec, stars[0], stars[1], v));
+  }
+}
+
+/*
+ * nlog_format: the message of "r", formatted at "out", which has room
+ * for at least NLOG_LINEMAX bytes.  The message always ends in a
+ * newline.  Returns its length.
+ */
+static int
+nlog_format(nlog_rec *r, char *out)
+{
+  const char *p = r->nr_fmt, *q, *a = r->nr_args, *end = r->nr_args+r->nr_len;
+  int n, room = NLOG_LINEMAX-1, stars[2], i, len;
+  char spec[32];
+  nlog_spec s;
+  long long v;
+  double d;
+
+  n = snprintf(out, room, "%s", nlog_prefix[r->nr_level]);
+  while (*p && n < room) {
+    if (*p != '%') {
+      out[n++] = *p++;
+      continue;
+    }
+    q = nlog_parse(p+1, &s);
+    if (s.ns_conv == '%') {
+      out[n++] = '%';
+      p = q;
+      continue;
+    }
+    len = (int) (s.ns_stars+1)*sizeof(long long);
+    if ((s.ns_conv == 's' && a+s.ns_stars*sizeof(long long) >= end) ||
+        (s.ns_conv != 's' && a+len > end) || q-p >= (int) sizeof(spec)) {
+      n += snprintf(out+n, room-n, "...");
+      break;
+    }
+    memcpy(spec, p, q-p);
+    spec[q-p] = '\0';
+    for (i = 0; i < s.ns_stars; i++, a += sizeof(long long)) {
+      memcpy(&v, a, sizeof(v));
+      stars[i] = (int) v;
+    }
+
+    switch (s.ns_conv) {
+    case 's':
+      len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, a);
+      a += strlen(a)+1;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      memcpy(&d, a, sizeof(d));
+      a += sizeof(d);
+      if (s.ns_len == 'L') {
+        len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (long double) d);
+      } else {
+        len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, d);
+      }
+      break;
+    default:
+      memcpy(&v, a, sizeof(v));
+      a += sizeof(v);
+      if (s.ns_conv == 'p') {
+        len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (void *) (uintptr_t) v);
+        break;
+      }
+      switch (s.ns_len) {
+      case 'l': len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (long) v); break;
+      case 'q': len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, v); break;
+      case 'j': len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (intmax_t) v); break;
+      case 'z': len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (size_t) v); break;
+      case 't': len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (ptrdiff_t) v); break;
+      default: len = nlog_conv(out+n, room-n, spec, s.ns_stars, stars, (int) v); break;
+      }
+      break;
+    }
+    n += len < 0 ? 0 : len < room-n ? len : room-n-1;
+    p = q;
+  }
+
+  n = n < room ? n : room-1;
+  if (!n || out[n-1] != '\n') {
+    out[n++] = '\n';
+  }
+  return(n);
+}
+
+static void
+nlog_write(const char *buf, int len)
+{
+  int bytes;
+
+  for (; len > 0; buf += bytes, len -= bytes) {
+    bytes = write(STDERR_FILENO, buf, len);
+    if (bytes <= 0) {
+      return;
+    }
+  }
+}
+
+/* whether the record at "tail" is ready for the writer */
+static inline int
+nlog_ready(unsigned long tail)
+{
+  return((long) (nlog_ring[tail & (NLOG_RING-1)].nr_seq - (tail+1)) >= 0);
+}
+
+/*
+ * nlog_writer: the background thread.  Formats the messages waiting
+ * in the ring and writes them out in batches.  When there are none,
+ * it sleeps until nlog_post() queues one: it sets nlog_idle, then
+ * looks at the ring once more, while nlog_post() fills in a record,
+ * then looks at nlog_idle, so one of them sees the other.
+ */
+static void *
+nlog_writer(void *arg)
+{
+  static char out[NLOG_OUTBUF];
+  unsigned long tail = 0;
+  long dropped = 0, d;
+  nlog_rec *r;
+  int len;
+
+  for (;;) {
+    len = 0;
+    while (nlog_ready(tail)) {
+      r = &nlog_ring[tail & (NLOG_RING-1)];
+      __sync_synchronize();
+      if (len > NLOG_OUTBUF-NLOG_LINEMAX) {
+        nlog_write(out, len);
+        len = 0;
+      }
+      len += nlog_format(r, out+len);
+      __sync_synchronize();
+      r->nr_seq = tail+NLOG_RING;
+      tail++;
+    }
+
+    d = nlog_dropped;
+    if (d != dropped && len <= NLOG_OUTBUF-NLOG_LINEMAX) {
+      len += snprintf(out+len, NLOG_LINEMAX, "nlog: %ld messages dropped\n", d-dropped);
+      dropped = d;
+    }
+    if (len) {
+      nlog_write(out, len);
+      pthread_mutex_lock(&nlog_mutex);
+      nlog_written = tail;
+      pthread_cond_broadcast(&nlog_done);
+      pthread_mutex_unlock(&nlog_mutex);
+      continue;
+    }
+
+    pthread_mutex_lock(&nlog_mutex);
+    nlog_idle = 1;
+    __sync_synchronize();
+    while (nlog_idle && !nlog_ready(tail)) {
+      pthread_cond_wait(&nlog_wake, &nlog_mutex);
+    }
+    nlog_idle = 0;
+    pthread_mutex_unlock(&nlog_mutex);
+  }
+
+  return(NULL);
+}
+
+/*
+ * nlog_abort: on SIGABRT, e.g., of a failed net_assert(), give the
+ * writer a second to write out what was queued before it, then die
+ * as we would have.  Only sleeps, to be safe in a signal handler.
+ */
+static void
+nlog_abort(int sig)
+{
+  unsigned long head = nlog_head;
+  struct timespec ms = { 0, 1000000L };
+  int i;
+
+  for (i = 0; (long) (nlog_written - head) < 0 && i < NLOG_FLUSHMS; i++) {
+    nanosleep(&ms, NULL);
+  }
+  raise(sig);                  // SA_RESETHAND put back the default action
+}
+
+static void
+nlog_start()
+{
+  pthread_t tid;
+  struct sigaction sa;
+  unsigned long i;
+
+  for (i = 0; i < NLOG_RING; i++) {
+    nlog_ring[i].nr_seq = i;
+  }
+  if (pthread_create(&tid, NULL, nlog_writer, NULL)) {
+    perror("nlog_start: pthread_create");
+    return;
+  }
+  pthread_detach(tid);
+  atexit(nlog_flush);
+
+  /* unless the program handles SIGABRT itself */
+  if (!sigaction(SIGABRT, NULL, &sa) && sa.sa_handler == SIG_DFL) {
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = nlog_abort;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGABRT, &sa, NULL);
+  }
+  nlog_started = 1;
+}
+
+void
+nlog_setlevel(int level)
+{
+  nlog_level = level;
+}
+
+/*
+ * nlog_post: queue a message for the writer, see nlog(), and wake it
+ * if it is idle.  Never waits, except for an NLOG_ERROR message, which
+ * is written, with all before it, before returning, see nlog_flush():
+ * if the ring is full, the message is dropped and counted.
+ */
+void
+nlog_post(int level, const char *fmt, ...)
+{
+  unsigned long pos, seq;
+  nlog_rec *r;
+  va_list ap;
+
+  pthread_once(&nlog_once, nlog_start);
+  if (!nlog_started) {
+    return;
+  }
+
+  pos = nlog_head;
+  for (;;) {
+    r = &nlog_ring[pos & (NLOG_RING-1)];
+    seq = r->nr_seq;
+    if (seq == pos) {
+      if (__sync_bool_compare_and_swap(&nlog_head, pos, pos+1)) {
+        break;
+      }
+    } else if ((long) (seq - pos) < 0) {
+      __sync_fetch_and_add(&nlog_dropped, 1L);
+      return;
+    }
+    pos = nlog_head;
+  }
+  __sync_synchronize();
+
+  r->nr_fmt = fmt;
+  r->nr_level = (short) (level < NLOG_ERROR ? NLOG_ERROR : level > NLOG_DEBUG ? NLOG_DEBUG : level);
+  r->nr_len = 0;
+  va_start(ap, fmt);
+  nlog_pack(r, ap);
+  va_end(ap);
+
+  __sync_synchronize();
+  r->nr_seq = pos+1;
+  __sync_synchronize();
+  if (nlog_idle) {
+    pthread_mutex_lock(&nlog_mutex);
+    nlog_idle = 0;
+    pthread_cond_signal(&nlog_wake);
+    pthread_mutex_unlock(&nlog_mutex);
+  }
+
+  if (level <= NLOG_ERROR) {
+    nlog_flush();
+  }
+}
+
+/*
+ * nlog_flush: wait, for NLOG_FLUSHMS at most, for the messages queued
+ * so far to be written.  Called at exit.
+ */
+void
+nlog_flush()
+{
+  unsigned long head = nlog_head;
+  struct timespec until;
+
+  if (!nlog_started) {
+    return;
+  }
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += NLOG_FLUSHMS/1000;
+  until.tv_nsec += (NLOG_FLUSHMS%1000)*1000000L;
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&nlog_mutex);
+  while ((long) (nlog_written - head) < 0) {
+    if (pthread_cond_timedwait(&nlog_done, &nlog_mutex, &until) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&nlog_mutex);
+}
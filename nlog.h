@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __NLOG_H__
+#define __NLOG_H__
+
+#define NLOG_ERROR    0
+#define NLOG_WARN     1
+#define NLOG_INFO     2   // the default, see nlog_setlevel()
+#define NLOG_DEBUG    3
+
+/* levels above this are compiled out, e.g., -DNLOG_MAXLEVEL=NLOG_INFO */
+#ifndef NLOG_MAXLEVEL
+#define NLOG_MAXLEVEL NLOG_DEBUG
+#endif
+
+#define NLOG_RING     4096  // records waiting to be written, a power of 2
+#define NLOG_ARGBYTES  232  // room for the arguments of a record
+#define NLOG_FLUSHMS  1000  // longest wait for the writer, see nlog_flush()
+
+extern int nlog_level;
+
+/*
+ * nlog(level, fmt, ...): log a printf-style message to stderr if
+ * "level" is enabled.  The arguments of a disabled level aren't even
+ * evaluated.  Only the arguments are copied here, strings included;
+ * a background thread formats and writes the message later, so "fmt"
+ * must be a string literal.  A message is dropped rather than waited
+ * for if NLOG_RING of them are already waiting.  Messages are written
+ * in order, but may come after what is written to stderr directly
+ * after them.  NLOG_ERROR messages, and those before them, are
+ * written by the time nlog() returns, and those queued before an
+ * abort(), e.g., of a failed net_assert(), before the process dies.
+ */
+#define nlog_on(level) ((level) <= NLOG_MAXLEVEL && (level) <= nlog_level)
+#define nlog(level, ...) do { if (nlog_on(level)) nlog_post((level), __VA_ARGS__); } while (0)
+
+extern void nlog_setlevel(int level);
+extern void nlog_post(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+extern void nlog_flush();
+
+#endif /* __NLOG_H__ */
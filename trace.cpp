@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#include <stdio.h>
+#include <sys/time.h>      // gettimeofday()
+#include <set>
+#include <string>
+using namespace std;
+
+#include "trace.h"
+
+static FILE *trace_fp;
+static set<int> trace_named;    // pids whose process_name has been written
+
+/*
+ * trace_now: the wall clock, in usecs.  Unlike metrics_now(), it can
+ * be compared across hosts, as far as their clocks agree.
+ */
+unsigned long long
+trace_now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return((unsigned long long) tv.tv_sec*1000000ULL + tv.tv_usec);
+}
+
+/*
+ * trace_open: start the trace file at "path", replacing any file
+ * there.  Returns 0 on success, -1 on error.
+ */
+int
+trace_open(const char *path)
+{
+  if (trace_fp) {
+    fclose(trace_fp);
+  }
+  trace_named.clear();
+  trace_fp = fopen(path, "w");
+  if (!trace_fp) {
+    return(-1);
+  }
+  fputs("[\n", trace_fp);
+  fflush(trace_fp);
+  return(0);
+}
+
+/*
+ * trace_quote: append "s" to "out" as a JSON string.
+ */
+static void
+trace_quote(string *out, const char *s)
+{
+  char esc[8];
+
+  *out += '"';
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      *out += '\\';
+      *out += *s;
+    } else if ((unsigned char) *s < 0x20) {
+      snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) *s);
+      *out += esc;
+    } else {
+      *out += *s;
+    }
+  }
+  *out += '"';
+}
+
+/*
+ * trace_process: name process "pid" in the viewer, unless it already
+ * has been.
+ */
+void
+trace_process(int pid, const char *name)
+{
+  char buf[64];
+  string ev;
+
+  if (!trace_fp || !trace_named.insert(pid).second) {
+    return;
+  }
+  snprintf(buf, sizeof(buf), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+  ev = buf;
+  trace_quote(&ev, name);
+  ev += "}},\n";
+  fputs(ev.c_str(), trace_fp);
+}
+
+/*
+ * trace_span: write a span "name" of "dur" usecs starting at "ts", from
+ * trace_now(), on thread "tid" of process "pid".  "args", if not NULL,
+ * are the members of its JSON args object, e.g., "\"hop\":2".
+ */
+void
+trace_span(const char *name, int pid, int tid, unsigned long long ts,
+           long long dur, const char *args)
+{
+  char buf[128];
+  string ev;
+
+  if (!trace_fp) {
+    return;
+  }
+  ev = "{\"name\":";
+  trace_quote(&ev, name);
+  snprintf(buf, sizeof(buf), ",\"cat\":\"dht\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%lld",
+           pid, tid, ts, dur > 0 ? dur : 0LL);
+  ev += buf;
+  if (args) {
+    ev += ",\"args\":{";
+    ev += args;
+    ev += '}';
+  }
+  ev += "},\n";
+  fputs(ev.c_str(), trace_fp);
+}
+
+/*
+ * trace_flush: push the spans written so far out to the file.
+ */
+void
+trace_flush()
+{
+  if (trace_fp) {
+    fflush(trace_fp);
+  }
+}
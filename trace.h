@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2014 University of Michigan, Ann Arbor.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the University of Michigan, Ann Arbor. The name of the University
+ * may not be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+*/
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Spans written in the Chrome trace event format, for chrome://tracing
+ * or Perfetto.  The file is a JSON array that is appended to as spans
+ * come and never closed, which both viewers accept, so a trace file is
+ * usable even if the process dies.
+ */
+extern unsigned long long trace_now();
+extern int trace_open(const char *path);
+extern void trace_process(int pid, const char *name);
+extern void trace_span(const char *name, int pid, int tid, unsigned long long ts,
+                       long long dur, const char *args);
+extern void trace_flush();
+
+#endif /* __TRACE_H__ */